@@ -2,4 +2,4 @@ CC := hipcc
 CXX := hipcc
 
 CFLAGS := -g
-LDFLAGS := -no-pie
+LDFLAGS := -no-pie -luring
@@ -0,0 +1,26 @@
+#ifndef AFFINITY_H__
+#define AFFINITY_H__
+
+#include <stdbool.h>	// bool
+#include <pthread.h>	// pthread_t
+
+struct affinity_layout {
+	int node;	// NUMA node of the NIC, -1 if unknown
+	int io;		// CPU taking the queue's IRQ, the receive/send thread
+	int copy;	// its SMT sibling or a CPU on the same node, -1 if none
+	bool spread;	// no queue IRQ found, `io` picked by queue from the node
+};
+
+int affinity_get_queue_cpu(char *interface, int queue);
+int affinity_get_numa_node(char *interface);
+int affinity_get_sibling(int cpu, int node);
+int affinity_get_node_cpus(int node, int *cpus, int max);
+
+int affinity_get_layout(char *interface, int queue, struct affinity_layout *);
+
+int affinity_pin(int cpu);
+int affinity_pin_thread(pthread_t , int cpu);
+
+char *affinity_get_error(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef CHECK_H__
+#define CHECK_H__
+
+#include <stddef.h>	// size_t
+
+typedef struct checker *Checker;
+
+/* runs on the checker thread for every submitted job, in submit order */
+typedef int (*CheckerStage)(void *arg, void *job);
+
+Checker checker_create(size_t job_size, int depth, CheckerStage , void *arg);
+
+// queue a copy of `job`, waiting while `depth` jobs are ahead of it
+int checker_submit(Checker , const void *job);
+
+// jobs submitted so far, for checker_wait() to wait on
+unsigned long checker_mark(Checker );
+int checker_wait(Checker , unsigned long mark);
+
+// wait for every job, and start over after a failed one
+int checker_drain(Checker );
+
+void checker_destroy(Checker );
+
+char *check_get_error(void);
+
+#endif
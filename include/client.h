@@ -2,16 +2,45 @@
 #define CLIENT_H__
 
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "memory_provider.h"
 
 typedef struct client *Client;
 
+struct client_stats {
+	size_t bytes;		// payload bytes sent
+	size_t sends;		// MSG_ZEROCOPY sendmsg() calls or SEND_ZC requests
+	size_t completed;	// zerocopy sends reported complete
+	size_t notifications;	// error queue reads
+	size_t ranges;		// completion ranges after merging
+	size_t copied;		// sends the kernel fell back to copying
+	size_t stalls;		// times the zerocopy window was full
+	size_t enters;		// io_uring_enter() calls
+};
+
 Client client_setup(Memory , size_t size, char *address, int port);
 
+void client_set_zerocopy_window(Client , int window);
+void client_set_dma_segment(Client , size_t iov_len,
+			    size_t base, size_t region);
+int client_set_dma_slots(Client , int nslot);
+
+int client_set_pipeline(Client , size_t chunk, int depth);
+int client_pin_pipeline(Client , int cpu);
+int client_set_uring(Client , unsigned depth, size_t chunk);
+void client_set_persistent(Client , bool );
+void client_set_offset(Client , size_t offset);
+void client_set_busy_poll(Client , int usecs, int budget);
+void client_set_latency(Client , bool );
+
 int client_run_as_tcp(Client , char *address, int port);
 int client_run_as_dma(Client , Memory dmabuf, char *address, int port,
 		      char *interface, int dmabuf_id);
+int client_disconnect(Client );
+
+void client_get_stats(Client , struct client_stats *);
+const double *client_get_latencies(Client , size_t *count);
 
 void client_cleanup(Client );
 
@@ -0,0 +1,32 @@
+#ifndef COMPLETION_H__
+#define COMPLETION_H__
+
+#include <stddef.h>	// size_t
+#include <stdint.h>	// uint32_t
+
+typedef struct completion_tracker *CompletionTracker;
+
+struct completion_stats {
+	size_t sends;		// MSG_ZEROCOPY sends tracked
+	size_t completed;	// sends reported complete
+	size_t notifications;	// recvmsg(MSG_ERRQUEUE) calls that returned
+	size_t ranges;		// completion ranges after merging
+	size_t copied;		// sends the kernel fell back to copying
+	size_t stalls;		// times the sender had to block
+};
+
+CompletionTracker completion_tracker_create(int fd, int window);
+
+int completion_tracker_reserve(CompletionTracker );
+uint32_t completion_tracker_sent(CompletionTracker );
+
+int completion_tracker_wait(CompletionTracker , uint32_t id);
+int completion_tracker_flush(CompletionTracker );
+
+void completion_tracker_get_stats(CompletionTracker , struct completion_stats *);
+
+void completion_tracker_destroy(CompletionTracker );
+
+char *completion_get_error(void);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef CPU_H__
+#define CPU_H__
+
+#include <stdbool.h>	// bool
+#include <stdint.h>	// uint64_t
+
+typedef struct cpu_meter *CpuMeter;
+
+struct cpu_usage {
+	bool has_cycles;	// false when perf_event_open() is not allowed
+	uint64_t cycles;	// cycles of every thread, kernel time included
+	double seconds;		// user + system CPU time of the process
+};
+
+CpuMeter cpu_meter_create(void);
+
+int cpu_meter_start(CpuMeter );
+int cpu_meter_stop(CpuMeter , struct cpu_usage *);
+
+void cpu_meter_destroy(CpuMeter );
+
+char *cpu_get_error(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef FRAME_H__
+#define FRAME_H__
+
+#include <stddef.h>	// size_t
+#include <stdint.h>	// uint32_t, uint64_t
+
+#define FRAME_MAGIC	0x444d4651	// "DMFQ"
+
+// sent in network byte order in front of every message on a kept connection
+struct frame_header {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t offset;	// where the payload goes in the receiver context
+	uint64_t length;
+} __attribute__((packed));
+
+void frame_header_pack(struct frame_header *, uint32_t seq,
+		       uint64_t offset, uint64_t length);
+int frame_header_unpack(struct frame_header *, uint32_t seq,
+			uint64_t *offset, uint64_t *length);
+
+int frame_send_header(int fd, uint32_t seq, uint64_t offset, uint64_t length);
+
+char *frame_get_error(void);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef GATHER_H__
+#define GATHER_H__
+
+#include <stddef.h>	// size_t
+
+#include "memory_provider.h"
+
+typedef struct gatherer *Gatherer;
+
+struct gather_stats {
+	size_t frags;		// fragments handed to gatherer_add()
+	size_t copies;		// copies issued after merging
+	size_t batches;		// gatherer_flush() calls that copied something
+	size_t bytes;
+};
+
+Gatherer gatherer_create(MemoryProvider , size_t capacity);
+
+int gatherer_add(Gatherer , Memory dst, Memory src, size_t len);
+int gatherer_flush(Gatherer );
+
+void gatherer_get_stats(Gatherer , struct gather_stats *);
+
+void gatherer_destroy(Gatherer );
+
+char *gather_get_error(void);
+
+#endif
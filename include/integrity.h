@@ -0,0 +1,67 @@
+#ifndef INTEGRITY_H__
+#define INTEGRITY_H__
+
+#include <stddef.h>	// size_t
+#include <stdint.h>	// uint32_t, SIZE_MAX
+#include <stdbool.h>	// bool
+
+#include "validator.h"
+
+#define INTEGRITY_MAGIC	0x444d464d	// "DMFM"
+#define INTEGRITY_OK	SIZE_MAX
+
+typedef struct integrity *Integrity;
+
+// where one stream stands in the block it is hashing; every stream that
+// feeds a tracker needs its own
+struct integrity_cursor {
+	size_t next;		// context offset of its next byte
+	size_t block;		// index of the block it is in
+	uint32_t crc;		// of that block up to `next`
+	bool hashing;		// false once a gap left the block unchecked
+};
+
+#define INTEGRITY_CURSOR_INIT	{ SIZE_MAX, SIZE_MAX, 0, false }
+
+struct integrity_stats {
+	size_t verified;	// blocks whose CRC matched the manifest
+	size_t skipped;		// blocks a stream joined midway, unchecked
+	size_t bytes;		// bytes hashed
+};
+
+// CRC32C (Castagnoli), chained: pass 0 first, then the previous result
+uint32_t integrity_crc32c(uint32_t crc, const void *buffer, size_t len);
+
+// one CRC per `block` bytes of `buffer`, the last block may be short
+void integrity_hash(const void *buffer, size_t len, size_t block,
+		    uint32_t *hashes);
+
+// offset of the first block not matching `hashes`, or INTEGRITY_OK
+size_t integrity_check(const void *buffer, size_t len, size_t block,
+		       const uint32_t *hashes);
+
+size_t integrity_get_nblock(size_t size, size_t block);
+
+int integrity_push_manifest(char *bind_addr, char *address, int port,
+			    size_t size, size_t block, const uint32_t *hashes);
+// fails on a manifest that does not cover exactly `size` bytes
+int integrity_accept_manifest(char *address, int port,
+			      size_t size, size_t *block, uint32_t **hashes);
+
+// tracks the blocks of a `size` byte context against its manifest
+Integrity integrity_create(size_t size, size_t block, const uint32_t *hashes);
+
+// whole blocks of a piece are checked over its threads, NULL for none
+void integrity_set_validator(Integrity , Validator );
+
+// bytes at `src` belong at context offset `pos`; fails on a bad block
+int integrity_update(Integrity , struct integrity_cursor *,
+		     const void *src, size_t pos, size_t len);
+
+void integrity_get_stats(Integrity , struct integrity_stats *);
+
+void integrity_destroy(Integrity );
+
+char *integrity_get_error(void);
+
+#endif
@@ -2,8 +2,11 @@
 #define MEMORY_H__
 
 #include <stddef.h>	// size_t
+#include <stdint.h>	// uint32_t
 
 #include "memory_provider.h"
+#include "staging.h"
+#include "validator.h"
 
 extern MemoryProvider gp;
 extern MemoryProvider hp;
@@ -19,6 +22,14 @@ int memory_close(int );
 int memory_validate(Memory , size_t );
 int memory_initialize(Memory , size_t );
 
+int memory_hash(Memory , size_t , size_t block, uint32_t *hashes);
+
+// `node` -1 for no placement
+int memory_set_validator(int nthread, int node);
+Validator memory_get_validator(void);	// NULL without memory_set_validator()
+
+void memory_get_staging_stats(struct staging_stats *);
+
 const char *memory_get_error(void);
 
 void memory_cleanup(void);
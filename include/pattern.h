@@ -0,0 +1,45 @@
+#ifndef PATTERN_H__
+#define PATTERN_H__
+
+#include <stddef.h>	// size_t
+#include <stdint.h>	// SIZE_MAX
+
+// byte `i` of a validated stream is `i % PATTERN_SEED`
+#define PATTERN_SEED	10
+
+#define PATTERN_OK	SIZE_MAX
+
+// the same pattern with another seed, e.g. ncdevmem's -v
+typedef struct pattern_period *PatternPeriod;
+
+struct pattern_kernel {
+	const char *name;
+
+	// `offset` is where the buffer starts in the stream
+	void (*fill)(PatternPeriod , void *buffer, size_t offset, size_t len);
+	size_t (*verify)(PatternPeriod , const void *buffer,
+			 size_t offset, size_t len);
+};
+
+void pattern_fill(void *buffer, size_t offset, size_t len);
+
+// index of the first mismatching byte, or PATTERN_OK
+size_t pattern_verify(const void *buffer, size_t offset, size_t len);
+
+// `seed` from 1 to 256, NULL otherwise or when out of memory
+PatternPeriod pattern_period_create(size_t seed);
+
+void pattern_period_fill(PatternPeriod , void *buffer,
+			 size_t offset, size_t len);
+size_t pattern_period_verify(PatternPeriod , const void *buffer,
+			     size_t offset, size_t len);
+
+void pattern_period_destroy(PatternPeriod );
+
+// the PATTERN_SEED period pattern_fill() and pattern_verify() use
+PatternPeriod pattern_get_standard(void);
+
+// the kernels this CPU runs, the one used by pattern_*() last
+const struct pattern_kernel *pattern_get_kernels(int *count);
+
+#endif
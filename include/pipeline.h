@@ -0,0 +1,29 @@
+#ifndef PIPELINE_H__
+#define PIPELINE_H__
+
+#include <stddef.h>	// size_t
+
+#include "memory_provider.h"
+
+typedef struct pipeline *Pipeline;
+
+/* runs on the pipeline thread for every submitted slot, in submit order */
+typedef int (*PipelineStage)(void *arg, Memory slot, size_t offset, size_t len);
+
+Pipeline pipeline_create(Memory base, size_t chunk, int depth,
+			 PipelineStage , void *arg);
+
+int pipeline_acquire(Pipeline , size_t *offset, size_t *len);
+int pipeline_submit(Pipeline , int slot, size_t offset, size_t len);
+int pipeline_drain(Pipeline );
+
+Memory pipeline_get_slot(Pipeline , int slot);
+size_t pipeline_get_chunk(Pipeline );
+
+int pipeline_pin(Pipeline , int cpu);
+
+void pipeline_destroy(Pipeline );
+
+char *pipeline_get_error(void);
+
+#endif
@@ -2,16 +2,108 @@
 #define SERVER_H__
 
 #include "memory_provider.h"
+#include "integrity.h"
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 typedef struct server *Server;
 
+struct server_stats {
+	size_t bytes;		// payload bytes received
+	size_t recvs;		// recv()/recvmsg() calls
+	size_t frags;		// devmem fragments
+	size_t copies;		// dmabuf-to-context copies after merging
+	size_t dontneed;	// setsockopt(SO_DEVMEM_DONTNEED) calls
+	size_t tokens;		// frag tokens released
+	size_t ranges;		// token ranges after merging
+	size_t messages;	// messages (or connections) fully received
+
+	size_t peak_tokens;	// most frag tokens held at once
+	size_t peak_bytes;	// most frag bytes held at once
+	size_t throttles;	// times recvmsg() was held back by the credit
+	double throttled;	// seconds spent held back
+
+	size_t ctrl_full;	// recvmsg() calls cut short by the control buffer
+	size_t ctrl_frags;	// frags the control buffer has room for
+
+	size_t enters;		// io_uring_enter() calls of the io_uring engine
+	size_t zerocopy;	// bytes mapped by TCP_ZEROCOPY_RECEIVE
+	size_t spins;		// busy-poll receives that found nothing
+
+	size_t accepts;		// connections accepted on this listener
+	size_t local;		// ... that came in on this server's CPU
+	size_t handoffs;	// ... passed on to the server on their CPU
+	size_t adopted;		// connections passed on by other listeners
+
+	size_t checked;		// bytes checked against the pattern on arrival
+};
+
+struct server_quota {
+	atomic_int accept;	// connections left to accept
+	atomic_int finish;	// connections left to drain
+};
+
+struct server_frag {
+	size_t offset;		// into the dmabuf, or `linear` if linear is set
+	size_t length;
+	uint32_t token;
+	bool linear;		// not steered into the dmabuf, no token to return
+};
+
+struct server_message {
+	const struct server_frag *frags;
+	size_t nfrag;
+	size_t offset;		// where the message belongs in the context
+	size_t length;
+	Memory linear;		// host buffer holding the linear frags
+	bool more;		// cut short by the credit, the rest follows
+};
+
+/* sees every accepted connection with the CPU and NAPI ID it came in on;
+ * returns 1 once it gave the fd to server_hand_off(), 0 to keep it */
+typedef int (*ServerDispatch)(void *arg, int fd, int cpu, unsigned int napi_id);
+
+struct server_conn_stats {
+	size_t bytes;
+	double elapsed;		// seconds from accept() to end of stream
+};
+
 Server server_setup(Memory , size_t , char *address, int port);
 
+int server_set_token_release(Server , size_t batch, int timeout_us);
+int server_set_pipeline(Server , size_t chunk, int depth);
+int server_pin_pipeline(Server , int cpu);
+
+int server_set_check(Server , bool check);
+int server_set_integrity(Server , Integrity );
+void server_set_persistent(Server , bool );
+void server_set_credit(Server , size_t tokens, size_t bytes);
+void server_set_rcvlowat(Server , int bytes);
+void server_set_busy_poll(Server , int usecs, int budget);
+void server_set_latency(Server , bool );
+int server_set_uring(Server , unsigned nbuf);
+
 int server_run_as_tcp(Server );
 int server_run_as_dma(Server , Memory dmabuf);
+int server_run_as_uring(Server );
+int server_run_as_zerocopy(Server );
+
+int server_recv_dma_frags(Server , Memory dmabuf, struct server_message *);
+int server_materialize(Server , Memory dmabuf, const struct server_message *);
+int server_release(Server );
+
+int server_run_event_loop(Server , Memory dmabuf, int nconn);
+int server_run_shared_loop(Server , Memory dmabuf, struct server_quota *);
+
+int server_set_dispatch(Server , int cpu, ServerDispatch , void *arg);
+int server_hand_off(Server , int fd);
+int server_set_steering(Server , const int *cpus, int ncpu);
+const struct server_conn_stats *server_get_conn_stats(Server , int *nconn);
+
+void server_get_stats(Server , struct server_stats *);
 
 void server_cleanup(Server );
 
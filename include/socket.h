@@ -7,6 +7,14 @@ int socket_create(char *address, int port);
 
 int socket_connect(int fd, char *address, int port);
 
+int socket_set_nonblocking(int fd);
+int socket_set_rcvlowat(int fd, int bytes);
+int socket_set_busy_poll(int fd, int usecs, int budget);
+int socket_set_nodelay(int fd);
+
+int socket_get_incoming(int fd, int *cpu, unsigned int *napi_id);
+int socket_attach_cpu_steering(int fd, const int *cpus, int ncpu);
+
 int socket_destroy(int sockfd);
 
 char *socket_get_error(void);
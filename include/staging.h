@@ -0,0 +1,29 @@
+#ifndef STAGING_H__
+#define STAGING_H__
+
+#include <stddef.h>	// size_t
+
+#include "memory_provider.h"
+
+typedef struct staging_pool *StagingPool;
+
+struct staging_stats {
+	size_t hits;		// requests served by an idle buffer
+	size_t misses;		// requests that allocated a new one
+	size_t buffers;		// buffers owned by the pool
+	size_t held;		// bytes owned by the pool, idle or in use
+	size_t idle;		// bytes waiting for the next request
+};
+
+StagingPool staging_pool_create(MemoryProvider host, MemoryProvider device);
+
+Memory staging_pool_get(StagingPool , size_t size);
+int staging_pool_put(StagingPool , Memory );
+
+void staging_pool_get_stats(StagingPool , struct staging_stats *);
+
+void staging_pool_destroy(StagingPool );
+
+char *staging_get_error(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef STREAM_H__
+#define STREAM_H__
+
+#include <stddef.h>
+
+#include "memory_provider.h"
+
+#include "client.h"
+
+typedef struct stream_pool *StreamPool;
+
+StreamPool stream_pool_create(Memory , size_t , char *address, int port,
+			      int nstream, int *cpus);
+
+int stream_pool_run(StreamPool , Memory dmabuf, char *address, int port,
+		    char *interface, int dmabuf_id, int ntimes);
+
+int stream_pool_get_size(StreamPool );
+Client stream_pool_get_client(StreamPool , int stream);
+double stream_pool_get_elapsed(StreamPool , int stream);
+
+void stream_pool_destroy(StreamPool );
+
+char *stream_get_error(void);
+
+#endif
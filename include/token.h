@@ -0,0 +1,27 @@
+#ifndef TOKEN_H__
+#define TOKEN_H__
+
+#include <stddef.h>	// size_t
+#include <stdint.h>	// uint32_t
+
+typedef struct token_releaser *TokenReleaser;
+
+struct token_stats {
+	size_t tokens;		// frag tokens handed back to the page pool
+	size_t ranges;		// struct dmabuf_token entries after merging
+	size_t syscalls;	// setsockopt(SO_DEVMEM_DONTNEED) calls
+};
+
+TokenReleaser token_releaser_create(size_t batch, int timeout_us);
+
+int token_releaser_add(TokenReleaser , int fd, uint32_t token, size_t size);
+int token_releaser_flush(TokenReleaser );
+
+void token_releaser_get_pending(TokenReleaser , size_t *tokens, size_t *bytes);
+void token_releaser_get_stats(TokenReleaser , struct token_stats *);
+
+void token_releaser_destroy(TokenReleaser );
+
+char *token_get_error(void);
+
+#endif
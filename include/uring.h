@@ -0,0 +1,52 @@
+#ifndef URING_H__
+#define URING_H__
+
+#include <stddef.h>	// size_t
+
+typedef struct uring_receiver *UringReceiver;
+typedef struct uring_sender *UringSender;
+
+struct uring_stats {
+	size_t enters;		// io_uring_enter() calls
+	size_t completions;	// recv completions carrying data
+	size_t arms;		// multishot recv (re)submissions
+	size_t nobufs;		// completions that found the buffer ring empty
+};
+
+struct uring_send_stats {
+	size_t enters;		// io_uring_enter() calls
+	size_t sends;		// SEND_ZC requests
+	size_t notifications;	// notification CQEs, one per zerocopy send
+	size_t copied;		// sends the kernel fell back to copying
+	size_t stalls;		// times the in-flight queue was full
+};
+
+// `data` is called per completion, `flush` once per batch; buffers go back
+// to the ring only after `flush` returns, so it must finish the copies
+struct uring_consumer {
+	int (*data)(void *arg, void *buffer, size_t len);
+	int (*flush)(void *arg);
+	void *arg;
+};
+
+UringReceiver uring_receiver_create(void *buffers, unsigned nbuf,
+				    size_t buf_size);
+
+int uring_receiver_run(UringReceiver , int fd, struct uring_consumer *);
+
+void uring_receiver_get_stats(UringReceiver , struct uring_stats *);
+
+void uring_receiver_destroy(UringReceiver );
+
+UringSender uring_sender_create(void *buffer, size_t size, unsigned depth);
+
+int uring_sender_send(UringSender , int fd,
+		      size_t offset, size_t len, size_t chunk);
+
+void uring_sender_get_stats(UringSender , struct uring_send_stats *);
+
+void uring_sender_destroy(UringSender );
+
+char *uring_get_error(void);
+
+#endif
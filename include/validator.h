@@ -0,0 +1,32 @@
+#ifndef VALIDATOR_H__
+#define VALIDATOR_H__
+
+#include <stddef.h>	// size_t
+#include <stdint.h>	// uint32_t
+
+typedef struct validator *Validator;
+
+// `node` -1 leaves the threads wherever the scheduler puts them
+Validator validator_create(int nthread, int node);
+
+void validator_fill(Validator , void *buffer, size_t offset, size_t len);
+
+// first mismatching byte of the whole buffer, or PATTERN_OK
+size_t validator_verify(Validator , const void *buffer,
+			size_t offset, size_t len);
+
+// integrity_hash() with the blocks spread over the threads
+void validator_hash(Validator , const void *buffer, size_t len,
+		    size_t block, uint32_t *hashes);
+
+// integrity_check() with the blocks spread over the threads
+size_t validator_check(Validator , const void *buffer, size_t len,
+		       size_t block, const uint32_t *hashes);
+
+int validator_get_size(Validator );
+
+void validator_destroy(Validator );
+
+char *validator_get_error(void);
+
+#endif
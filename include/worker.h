@@ -0,0 +1,27 @@
+#ifndef WORKER_H__
+#define WORKER_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "memory_provider.h"
+
+#include "server.h"
+
+typedef struct worker_pool *WorkerPool;
+
+WorkerPool worker_pool_create(Memory , size_t , char *address, int port,
+			      int nworker, int *cpus);
+
+int worker_pool_set_dispatch(WorkerPool , bool steering);
+
+int worker_pool_run(WorkerPool , Memory dmabuf, int nconn);
+
+int worker_pool_get_size(WorkerPool );
+Server worker_pool_get_server(WorkerPool , int worker);
+
+void worker_pool_destroy(WorkerPool );
+
+char *worker_get_error(void);
+
+#endif
@@ -69,6 +69,8 @@
 #include <time.h>
 #include <net/if.h>
 
+#include "pattern.h"
+
 #include "netdev-user.h"
 #include "ethtool-user.h"
 #include <ynl.h>
@@ -88,11 +90,16 @@
 
 #define MAX_IOV 1024
 
+/* limits of a single SO_DEVMEM_DONTNEED call, see net/core/sock.c */
+#define MAX_DONTNEED_TOKENS 128
+#define MAX_DONTNEED_FRAGS 1024
+
 static size_t max_chunk;
 static char *server_ip;
 static char *client_ip;
 static char *port;
 static size_t do_validation;
+static PatternPeriod validation_period;	/* of the -v seed */
 static int start_queue = -1;
 static int num_queues = -1;
 static char *ifname;
@@ -100,6 +107,9 @@ static unsigned int ifindex;
 static unsigned int dmabuf_id;
 static uint32_t tx_dmabuf_id;
 static int waittime_ms = 500;
+static size_t token_batch = 128;
+static int token_timeout_us = 1000;
+static int zc_window = 64;
 
 struct memory_buffer {
 	int fd;
@@ -126,22 +136,21 @@ void validate_buffer(void *line, size_t size, size_t seed)
 {
 	unsigned char *ptr = line;
 	static int errors;
-	size_t i;
+	size_t i, at;
 
-	seed = seed % do_validation;
+	/* the vector kernels find each mismatch, the scan resumes past it */
+	for (i = 0; i < size; i += at + 1) {
+		at = pattern_period_verify(validation_period, ptr + i,
+					   seed + i, size - i);
+		if (at == PATTERN_OK)
+			break;
 
-	for (i = 0; i < size; i++) {
-		if (ptr[i] != seed) {
-			fprintf(stderr,
-				"Failed validation: expected=%u, actual=%u, index=%lu\n",
-				seed, ptr[i], i);
-			errors++;
-			if (errors > 20)
-				error(1, 0, "validation failed.");
-		}
-		seed++;
-		if (seed == do_validation)
-			seed = 0;
+		fprintf(stderr,
+			"Failed validation: expected=%zu, actual=%u, index=%zu\n",
+			(seed + i + at) % do_validation, ptr[i + at], i + at);
+		errors++;
+		if (errors > 20)
+			error(1, 0, "validation failed.");
 	}
 
 	// fprintf(stdout, "Validated buffer\n");
@@ -441,14 +450,98 @@ static struct netdev_queue_id *create_queues(void)
 	return queues;
 }
 
+struct token_ring {
+	__u32 *tokens;
+	size_t count;
+	struct dmabuf_token *ranges;
+	uint64_t oldest;
+	size_t syscalls;
+};
+
+static uint64_t gettimeofday_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+}
+
+static void flush_tokens(int fd, struct token_ring *ring)
+{
+	size_t nranges = 0;
+	size_t start, end;
+	size_t nfrags;
+	int ret;
+
+	/* merge consecutive tokens into one start/count range */
+	for (size_t i = 0; i < ring->count; i++) {
+		if (nranges &&
+		    ring->ranges[nranges - 1].token_start +
+		    ring->ranges[nranges - 1].token_count == ring->tokens[i] &&
+		    ring->ranges[nranges - 1].token_count < MAX_DONTNEED_FRAGS) {
+			ring->ranges[nranges - 1].token_count++;
+			continue;
+		}
+
+		ring->ranges[nranges].token_start = ring->tokens[i];
+		ring->ranges[nranges].token_count = 1;
+		nranges++;
+	}
+	ring->count = 0;
+
+	for (start = 0; start < nranges; start = end) {
+		nfrags = 0;
+		for (end = start; end < nranges &&
+		     end - start < MAX_DONTNEED_TOKENS &&
+		     nfrags + ring->ranges[end].token_count <= MAX_DONTNEED_FRAGS;
+		     end++)
+			nfrags += ring->ranges[end].token_count;
+
+		ret = setsockopt(fd, SOL_SOCKET, SO_DEVMEM_DONTNEED,
+				 ring->ranges + start,
+				 sizeof(struct dmabuf_token) * (end - start));
+		ring->syscalls++;
+		if (ret != nfrags)
+			error(1, 0, "SO_DEVMEM_DONTNEED not enough tokens");
+	}
+}
+
+static void release_token(int fd, struct token_ring *ring, __u32 token)
+{
+	if (!ring->count)
+		ring->oldest = gettimeofday_us();
+
+	ring->tokens[ring->count++] = token;
+
+	/* a timeout of 0 means none, as in source/token.c */
+	if (ring->count >= token_batch ||
+	    (token_timeout_us > 0 &&
+	     gettimeofday_us() - ring->oldest >= token_timeout_us))
+		flush_tokens(fd, ring);
+}
+
+/* One copy per run of physically contiguous frags in a recvmsg batch. */
+struct gather_run {
+	size_t dst;
+	size_t src;
+	size_t len;
+};
+
+#define MAX_BATCH_FRAGS \
+	(sizeof(int) * 20000 / CMSG_SPACE(sizeof(struct dmabuf_cmsg)) + 1)
+
 static int do_server(struct memory_buffer *mem)
 {
+	static struct gather_run runs[MAX_BATCH_FRAGS];
+	static __u32 batch_tokens[MAX_BATCH_FRAGS];
+	size_t gather_copies = 0, gather_frags = 0;
 	char ctrl_data[sizeof(int) * 20000];
 	size_t non_page_aligned_frags = 0;
 	struct sockaddr_in6 client_addr;
 	struct sockaddr_in6 server_sin;
 	size_t page_aligned_frags = 0;
 	size_t total_received = 0;
+	struct token_ring ring = {};
 	socklen_t client_addr_len;
 	size_t endptr = -1;
 	bool is_devmem = false;
@@ -487,6 +580,11 @@ static int do_server(struct memory_buffer *mem)
 	if (!tmp_mem)
 		error(1, ENOMEM, "malloc failed");
 
+	ring.tokens = calloc(token_batch, sizeof(*ring.tokens));
+	ring.ranges = calloc(token_batch, sizeof(*ring.ranges));
+	if (!ring.tokens || !ring.ranges)
+		error(1, ENOMEM, "calloc failed");
+
 	socket_fd = socket(AF_INET6, SOCK_STREAM, 0);
 	if (socket_fd < 0)
 		error(1, errno, "%s: [FAIL, create socket]\n", TEST_PREFIX);
@@ -523,7 +621,7 @@ static int do_server(struct memory_buffer *mem)
 		struct dmabuf_cmsg *dmabuf_cmsg = NULL;
 		struct cmsghdr *cm = NULL;
 		struct msghdr msg = { 0 };
-		struct dmabuf_token token;
+		size_t nruns = 0, ntokens = 0;
 		ssize_t ret;
 
 		is_devmem = false;
@@ -585,12 +683,17 @@ static int do_server(struct memory_buffer *mem)
 
 			endptr += dmabuf_cmsg->frag_size;
 
-			hipMemcpy(
-				tmp_mem + total_received,
-				mem->buf_mem + dmabuf_cmsg->frag_offset,
-				dmabuf_cmsg->frag_size,
-				hipMemcpyDeviceToDevice
-			);
+			if (nruns &&
+			    runs[nruns - 1].src + runs[nruns - 1].len ==
+			    dmabuf_cmsg->frag_offset) {
+				runs[nruns - 1].len += dmabuf_cmsg->frag_size;
+			} else {
+				runs[nruns].dst = total_received;
+				runs[nruns].src = dmabuf_cmsg->frag_offset;
+				runs[nruns].len = dmabuf_cmsg->frag_size;
+				nruns++;
+			}
+			gather_frags++;
 
 			/*
 			if (do_validation) {	
@@ -602,14 +705,7 @@ static int do_server(struct memory_buffer *mem)
 			}
 			*/
 
-			token.token_start = dmabuf_cmsg->frag_token;
-			token.token_count = 1;
-			ret = setsockopt(client_fd, SOL_SOCKET,
-					 SO_DEVMEM_DONTNEED, &token,
-					 sizeof(token));
-			if (ret != 1)
-				error(1, 0,
-				      "SO_DEVMEM_DONTNEED not enough tokens");
+			batch_tokens[ntokens++] = dmabuf_cmsg->frag_token;
 
 			total_received += dmabuf_cmsg->frag_size;
 
@@ -625,16 +721,40 @@ static int do_server(struct memory_buffer *mem)
 		if (!is_devmem)
 			error(1, 0, "flow steering error\n");
 
+		/* queue the whole batch, wait once, then hand the frags back */
+		for (size_t i = 0; i < nruns; i++)
+			hipMemcpyAsync(tmp_mem + runs[i].dst,
+				       mem->buf_mem + runs[i].src,
+				       runs[i].len,
+				       hipMemcpyDeviceToDevice, 0);
+		if (nruns)
+			hipStreamSynchronize(0);
+		gather_copies += nruns;
+
+		for (size_t i = 0; i < ntokens; i++)
+			release_token(client_fd, &ring, batch_tokens[i]);
+
 		// fprintf(stderr, "total_received=%lu\n", total_received);
 	}
 
+	flush_tokens(client_fd, &ring);
+
 	fprintf(stderr, "%s: ok\n", TEST_PREFIX);
 
 	fprintf(stderr, "page_aligned_frags=%lu, non_page_aligned_frags=%lu\n",
 		page_aligned_frags, non_page_aligned_frags);
 
+	fprintf(stderr, "gathered %lu frags in %lu copies\n",
+		gather_frags, gather_copies);
+
+	fprintf(stderr, "dontneed_syscalls=%lu (%.2f per GB)\n",
+		ring.syscalls,
+		total_received ? ring.syscalls / (total_received / 1e9) : 0.0);
+
 cleanup:
 
+	free(ring.tokens);
+	free(ring.ranges);
 	free(tmp_mem);
 	close(client_fd);
 	close(socket_fd);
@@ -705,9 +825,15 @@ static int do_poll(int fd)
 	return ret && (pfd.revents & POLLERR);
 }
 
-static void wait_compl(int fd)
+struct zc_tracker {
+	__u32 next_id;		/* id the kernel assigns to the next send */
+	__u32 completed;	/* sends reported complete so far */
+	size_t notifications;
+};
+
+/* Reap every notification queued right now, without blocking. */
+static void zc_harvest(int fd, struct zc_tracker *zc)
 {
-	int64_t tstop = gettimeofday_ms() + waittime_ms;
 	char control[CMSG_SPACE(100)] = {};
 	struct sock_extended_err *serr;
 	struct msghdr msg = {};
@@ -715,23 +841,21 @@ static void wait_compl(int fd)
 	__u32 hi, lo;
 	int ret;
 
-	msg.msg_control = control;
-	msg.msg_controllen = sizeof(control);
-
-	while (gettimeofday_ms() < tstop) {
-		if (!do_poll(fd))
-			continue;
+	while (1) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
 
-		ret = recvmsg(fd, &msg, MSG_ERRQUEUE);
+		ret = recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
 		if (ret < 0) {
 			if (errno == EAGAIN)
-				continue;
+				return;
 			error(1, errno, "recvmsg(MSG_ERRQUEUE)");
-			return;
 		}
 		if (msg.msg_flags & MSG_CTRUNC)
 			error(1, 0, "MSG_CTRUNC\n");
 
+		zc->notifications++;
+
 		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
 			if (cm->cmsg_level != SOL_IP &&
 			    cm->cmsg_level != SOL_IPV6)
@@ -752,12 +876,26 @@ static void wait_compl(int fd)
 			hi = serr->ee_data;
 			lo = serr->ee_info;
 
-			fprintf(stderr, "tx complete [%d,%d]\n", lo, hi);
-			return;
+			zc->completed += hi - lo + 1;
 		}
 	}
+}
+
+/* Block until at most max_outstanding zerocopy sends are in flight. */
+static void zc_wait(int fd, struct zc_tracker *zc, __u32 max_outstanding)
+{
+	int64_t tstop = gettimeofday_ms() + waittime_ms;
+
+	while (zc->next_id - zc->completed > max_outstanding) {
+		if (gettimeofday_ms() >= tstop)
+			error(1, 0, "did not receive tx completion");
 
-	error(1, 0, "did not receive tx completion");
+		if (!do_poll(fd))
+			continue;
+
+		zc_harvest(fd, zc);
+		tstop = gettimeofday_ms() + waittime_ms;
+	}
 }
 
 static int do_client(struct memory_buffer *mem)
@@ -778,6 +916,8 @@ static int do_client(struct memory_buffer *mem)
 	int opt = 1;
 	int ret;
 	size_t total_sended = 0;
+	struct zc_tracker zc = {};
+	size_t tx_off = 0;
 
 	ret = parse_address(server_ip, atoi(port), &server_sin);
 	if (ret < 0)
@@ -820,8 +960,7 @@ static int do_client(struct memory_buffer *mem)
 
 	if (do_validation) {
 		line = malloc(mem->size);
-		for (size_t i = 0; i < mem->size; i++)
-			line[i] = i % do_validation;
+		pattern_period_fill(validation_period, line, 0, mem->size);
 
 		line_size = MAX_IOV * max_chunk;
 	}
@@ -839,6 +978,14 @@ static int do_client(struct memory_buffer *mem)
 		if (total_sended + line_size >= mem->size)
 			line_size = mem->size - total_sended;
 
+		/* cycle through the dmabuf; only wait for completions when
+		 * wrapping onto memory that may still be in flight
+		 */
+		if (tx_off + line_size > mem->size) {
+			zc_wait(socket_fd, &zc, 0);
+			tx_off = 0;
+		}
+
 		if (max_chunk) {
 			msg.msg_iovlen = (line_size + max_chunk - 1) / max_chunk;
 			if (msg.msg_iovlen > MAX_IOV)
@@ -847,21 +994,22 @@ static int do_client(struct memory_buffer *mem)
 				      line_size, MAX_IOV);
 
 			for (int i = 0; i < msg.msg_iovlen; i++) {
-				iov[i].iov_base = (void *)(i * max_chunk);
+				iov[i].iov_base = (void *)(tx_off + i * max_chunk);
 				iov[i].iov_len = max_chunk;
 			}
 
 			iov[msg.msg_iovlen - 1].iov_len =
 				line_size - (msg.msg_iovlen - 1) * max_chunk;
 		} else {
-			iov[0].iov_base = 0;
+			iov[0].iov_base = (void *)tx_off;
 			iov[0].iov_len = line_size;
 			msg.msg_iovlen = 1;
 		}
 
 		msg.msg_iov = iov;
 		hipMemcpy(
-			mem->buf_mem, line, line_size, hipMemcpyHostToDevice
+			mem->buf_mem + tx_off, line, line_size,
+			hipMemcpyHostToDevice
 		);
 
 		msg.msg_control = ctrl_data;
@@ -876,18 +1024,27 @@ static int do_client(struct memory_buffer *mem)
 
 		*((__u32 *)CMSG_DATA(cmsg)) = ddmabuf;
 
+		zc_wait(socket_fd, &zc, zc_window - 1);
+
 		ret = sendmsg(socket_fd, &msg, MSG_ZEROCOPY);
 		if (ret < 0)
 			error(1, errno, "Failed sendmsg");
 
 		fprintf(stderr, "sendmsg_ret=%d\n", ret);
 
-		wait_compl(socket_fd);
+		zc.next_id++;
+		if (zc.next_id - zc.completed >= zc_window / 2)
+			zc_harvest(socket_fd, &zc);
 
 		total_sended += ret;
+		tx_off += ret;
 	}
 
+	zc_wait(socket_fd, &zc, 0);
+
 	fprintf(stderr, "%s: tx ok\n", TEST_PREFIX);
+	fprintf(stderr, "zerocopy sends=%u, notifications=%lu\n",
+		zc.next_id, zc.notifications);
 
 	free(line);
 	close(socket_fd);
@@ -904,7 +1061,7 @@ int main(int argc, char *argv[])
 	int is_server = 0, opt;
 	int ret;
 
-	while ((opt = getopt(argc, argv, "ls:c:p:v:q:t:f:z:")) != -1) {
+	while ((opt = getopt(argc, argv, "ls:c:p:v:q:t:f:z:b:u:w:")) != -1) {
 		switch (opt) {
 		case 'l':
 			is_server = 1;
@@ -933,6 +1090,15 @@ int main(int argc, char *argv[])
 		case 'z':
 			max_chunk = atoi(optarg);
 			break;
+		case 'b':
+			token_batch = atoi(optarg) ?: 1;
+			break;
+		case 'u':
+			token_timeout_us = atoi(optarg);
+			break;
+		case 'w':
+			zc_window = atoi(optarg) ?: 1;
+			break;
 		case '?':
 			fprintf(stderr, "unknown option: %c\n", optopt);
 			break;
@@ -942,6 +1108,12 @@ int main(int argc, char *argv[])
 	if (!ifname)
 		error(1, 0, "Missing -f argument\n");
 
+	if (do_validation) {
+		validation_period = pattern_period_create(do_validation);
+		if (!validation_period)
+			error(1, 0, "-v takes a seed from 1 to 256\n");
+	}
+
 	ifindex = if_nametoindex(ifname);
 
 	fprintf(stderr, "using ifindex=%u\n", ifindex);
@@ -0,0 +1,347 @@
+#define _GNU_SOURCE	// strcasestr(), pthread_setaffinity_np(), CPU_SET()
+
+#include "affinity.h"
+
+#include <stdio.h>	// BUFSIZ, fopen(), fgets(), sscanf()
+#include <stdbool.h>	// false
+#include <stdlib.h>	// strtol()
+#include <string.h>	// strerror(), strstr(), strrchr(), strtok_r()
+#include <ctype.h>	// isdigit()
+#include <errno.h>	// errno
+#include <limits.h>	// PATH_MAX
+
+#include <unistd.h>	// readlink()
+#include <pthread.h>	// pthread_setaffinity_np()
+#include <sched.h>	// cpu_set_t
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+static __thread char error[BUFSIZ];
+
+static const char *queue_irq_tags[] = { "txrx", "rx", "comp", NULL };
+
+// trailing number of an IRQ name, e.g. "eth0-TxRx-3" or "mlx5_comp3@pci:..."
+static int irq_name_queue(char *name)
+{
+	char *end, *start;
+
+	end = strchr(name, '@');
+	if (end == NULL)
+		end = name + strlen(name);
+
+	start = end;
+	while (start > name && isdigit(start[-1]))
+		start--;
+
+	if (start == end || start == name)
+		return -1;
+
+	return strtol(start, NULL, 10);
+}
+
+static bool irq_name_is_queue(char *name)
+{
+	for (int i = 0; queue_irq_tags[i]; i++)
+		if (strcasestr(name, queue_irq_tags[i]))
+			return true;
+
+	return false;
+}
+
+static int get_pci_address(char *interface, char *address, size_t size)
+{
+	char path[PATH_MAX], link[PATH_MAX];
+	ssize_t len;
+	char *base;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device", interface);
+
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len == -1)
+		return -1;
+
+	link[len] = '\0';
+
+	base = strrchr(link, '/');
+	snprintf(address, size, "%s", base ? base + 1 : link);
+
+	return 0;
+}
+
+static int get_queue_irq(char *interface, int queue)
+{
+	char line[BUFSIZ], pci[64];
+	bool has_pci;
+	FILE *fp;
+	int irq;
+
+	has_pci = get_pci_address(interface, pci, sizeof(pci)) == 0;
+
+	fp = fopen("/proc/interrupts", "r");
+	if (fp == NULL) {
+		ERROR("failed to fopen(/proc/interrupts): %s", strerror(errno));
+		return -1;
+	}
+
+	irq = -1;
+	while (fgets(line, sizeof(line), fp)) {
+		char *name;
+
+		line[strcspn(line, "\n")] = '\0';
+
+		name = strrchr(line, ' ');
+		if (name == NULL)
+			continue;
+
+		name++;
+
+		if (!strstr(name, interface)
+		 && !(has_pci && strstr(name, pci)))
+			continue;
+
+		if (!irq_name_is_queue(name))
+			continue;
+
+		if (irq_name_queue(name) != queue)
+			continue;
+
+		irq = strtol(line, NULL, 10);
+		break;
+	}
+
+	fclose(fp);
+
+	if (irq == -1)
+		ERROR("no IRQ found for %s queue %d", interface, queue);
+
+	return irq;
+}
+
+static int get_irq_cpu(int irq)
+{
+	static const char *files[] = {
+		"effective_affinity_list", "smp_affinity_list", NULL
+	};
+
+	for (int i = 0; files[i]; i++) {
+		char path[PATH_MAX];
+		FILE *fp;
+		int cpu;
+
+		snprintf(path, sizeof(path), "/proc/irq/%d/%s", irq, files[i]);
+
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			continue;
+
+		if (fscanf(fp, "%d", &cpu) != 1)
+			cpu = -1;
+
+		fclose(fp);
+
+		if (cpu != -1)
+			return cpu;
+	}
+
+	ERROR("failed to read affinity of IRQ %d", irq);
+
+	return -1;
+}
+
+int affinity_get_queue_cpu(char *interface, int queue)
+{
+	int irq;
+
+	if (interface == NULL) {
+		ERROR("no interface to look up");
+		return -1;
+	}
+
+	irq = get_queue_irq(interface, queue);
+	if (irq == -1)
+		return -1;
+
+	return get_irq_cpu(irq);
+}
+
+// CPUs of a sysfs cpulist such as "0-7,16-23", at most `max` of them
+static int cpulist_read(char *path, int *cpus, int max)
+{
+	char line[BUFSIZ], *token, *save;
+	FILE *fp;
+	int count;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+
+	if (fgets(line, sizeof(line), fp) == NULL) {
+		fclose(fp);
+		return -1;
+	}
+
+	fclose(fp);
+
+	count = 0;
+	for (token = strtok_r(line, ",\n", &save); token;
+	     token = strtok_r(NULL, ",\n", &save)) {
+		int first, last, n;
+
+		n = sscanf(token, "%d-%d", &first, &last);
+		if (n < 1)
+			continue;
+
+		if (n == 1)
+			last = first;
+
+		for (int cpu = first; cpu <= last && count < max; cpu++)
+			cpus[count++] = cpu;
+	}
+
+	return count;
+}
+
+// first CPU of a sysfs cpulist that is not `skip`
+static int cpulist_pick(char *path, int skip)
+{
+	int cpus[2], count;
+
+	count = cpulist_read(path, cpus, 2);
+
+	for (int i = 0; i < count; i++)
+		if (cpus[i] != skip)
+			return cpus[i];
+
+	return -1;
+}
+
+int affinity_get_numa_node(char *interface)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int node;
+
+	snprintf(path, sizeof(path),
+		 "/sys/class/net/%s/device/numa_node", interface);
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		ERROR("failed to fopen(%s): %s", path, strerror(errno));
+		return -1;
+	}
+
+	// single-node hosts and virtual devices report -1
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+
+	fclose(fp);
+
+	if (node < 0)
+		ERROR("no NUMA node reported for %s", interface);
+
+	return node < 0 ? -1 : node;
+}
+
+// SMT sibling of `cpu`, or else another CPU of `node` (-1 to skip that)
+int affinity_get_sibling(int cpu, int node)
+{
+	char path[PATH_MAX];
+	int sibling;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+		 cpu);
+
+	sibling = cpulist_pick(path, cpu);
+	if (sibling != -1 || node == -1)
+		goto CHECK_SIBLING;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+
+	sibling = cpulist_pick(path, cpu);
+
+CHECK_SIBLING:	if (sibling == -1)
+			ERROR("no sibling found for cpu %d", cpu);
+
+	return sibling;
+}
+
+int affinity_get_node_cpus(int node, int *cpus, int max)
+{
+	char path[PATH_MAX];
+	int count;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+
+	count = cpulist_read(path, cpus, max);
+	if (count < 1) {
+		ERROR("no CPUs found on node %d", node);
+		return -1;
+	}
+
+	return count;
+}
+
+int affinity_get_layout(char *interface, int queue,
+			struct affinity_layout *layout)
+{
+	int cpus[CPU_SETSIZE], count;
+
+	*layout = (struct affinity_layout) { -1, -1, -1, false };
+
+	if (interface == NULL) {
+		ERROR("no interface to look up");
+		return -1;
+	}
+
+	layout->node = affinity_get_numa_node(interface);
+
+	layout->io = affinity_get_queue_cpu(interface, queue);
+	if (layout->io == -1 && layout->node != -1) {
+		// no per-queue IRQ to follow: stay on the NIC's node, but give
+		// each queue its own CPU there instead of stacking them all
+		count = affinity_get_node_cpus(layout->node, cpus, CPU_SETSIZE);
+		if (count > 0) {
+			layout->io = cpus[queue % count];
+			layout->spread = true;
+		}
+	}
+
+	if (layout->io == -1)
+		return -1;
+
+	layout->copy = affinity_get_sibling(layout->io, layout->node);
+
+	return 0;
+}
+
+int affinity_pin_thread(pthread_t thread, int cpu)
+{
+	cpu_set_t cpuset;
+	int ret;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+
+	ret = pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset);
+	if (ret != 0) {
+		ERROR("failed to pthread_setaffinity_np(): %s", strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+int affinity_pin(int cpu)
+{
+	return affinity_pin_thread(pthread_self(), cpu);
+}
+
+char *affinity_get_error(void)
+{
+	return error;
+}
@@ -0,0 +1,230 @@
+#include "check.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// bool, true, false
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror(), memcpy()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_create(), pthread_mutex_lock(), ...
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct checker {
+	size_t job_size;
+	int depth;
+
+	CheckerStage stage;
+	void *arg;
+
+	// ring of `depth` jobs, copied in by checker_submit()
+	char *jobs;
+	int head;
+	int count;
+
+	unsigned long submitted;
+	unsigned long completed;
+	bool failed;
+	bool stop;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+static __thread char error[BUFSIZ];
+
+static void *checker_main(void *arg)
+{
+	Checker checker = arg;
+
+	pthread_mutex_lock(&checker->lock);
+	while (true) {
+		bool failed;
+		void *job;
+		int ret;
+
+		while (checker->count == 0 && !checker->stop)
+			pthread_cond_wait(&checker->work, &checker->lock);
+
+		if (checker->count == 0)
+			break;
+
+		job = checker->jobs + checker->job_size * checker->head;
+		failed = checker->failed;
+		pthread_mutex_unlock(&checker->lock);
+
+		// after a failure only drain the queue, the caller bails out
+		ret = failed ? -1 : checker->stage(checker->arg, job);
+
+		pthread_mutex_lock(&checker->lock);
+		if (ret == -1)
+			checker->failed = true;
+
+		// the slot is only handed back once the stage is done with it
+		checker->head = (checker->head + 1) % checker->depth;
+		checker->count--;
+		checker->completed++;
+
+		pthread_cond_broadcast(&checker->done);
+	}
+	pthread_mutex_unlock(&checker->lock);
+
+	return NULL;
+}
+
+Checker checker_create(size_t job_size, int depth,
+		       CheckerStage stage, void *arg)
+{
+	Checker checker;
+	int ret;
+
+	if (job_size == 0 || depth < 1) {
+		ERROR("invalid checker of %d jobs of %zu bytes",
+		      depth, job_size);
+		goto RETURN_NULL;
+	}
+
+	checker = malloc(sizeof(struct checker));
+	if (checker == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	checker->jobs = calloc(depth, job_size);
+	if (checker->jobs == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_CHECKER;
+	}
+
+	checker->job_size = job_size;
+	checker->depth = depth;
+
+	checker->stage = stage;
+	checker->arg = arg;
+
+	checker->head = checker->count = 0;
+	checker->submitted = checker->completed = 0;
+	checker->failed = checker->stop = false;
+
+	pthread_mutex_init(&checker->lock, NULL);
+	pthread_cond_init(&checker->work, NULL);
+	pthread_cond_init(&checker->done, NULL);
+
+	ret = pthread_create(&checker->thread, NULL, checker_main, checker);
+	if (ret != 0) {
+		ERROR("failed to pthread_create(): %s", strerror(ret));
+		goto DESTROY_LOCK;
+	}
+
+	return checker;
+
+DESTROY_LOCK:	pthread_cond_destroy(&checker->done);
+		pthread_cond_destroy(&checker->work);
+		pthread_mutex_destroy(&checker->lock);
+		free(checker->jobs);
+FREE_CHECKER:	free(checker);
+RETURN_NULL:	return NULL;
+}
+
+int checker_submit(Checker checker, const void *job)
+{
+	int tail;
+
+	pthread_mutex_lock(&checker->lock);
+
+	while (checker->count == checker->depth && !checker->failed)
+		pthread_cond_wait(&checker->done, &checker->lock);
+
+	if (checker->failed) {
+		pthread_mutex_unlock(&checker->lock);
+		ERROR("checker stage failed");
+		return -1;
+	}
+
+	tail = (checker->head + checker->count) % checker->depth;
+	memcpy(checker->jobs + checker->job_size * tail, job,
+	       checker->job_size);
+	checker->count++;
+	checker->submitted++;
+
+	pthread_cond_signal(&checker->work);
+	pthread_mutex_unlock(&checker->lock);
+
+	return 0;
+}
+
+unsigned long checker_mark(Checker checker)
+{
+	unsigned long mark;
+
+	pthread_mutex_lock(&checker->lock);
+	mark = checker->submitted;
+	pthread_mutex_unlock(&checker->lock);
+
+	return mark;
+}
+
+int checker_wait(Checker checker, unsigned long mark)
+{
+	int ret;
+
+	pthread_mutex_lock(&checker->lock);
+
+	while (checker->completed < mark)
+		pthread_cond_wait(&checker->done, &checker->lock);
+
+	ret = checker->failed ? -1 : 0;
+
+	pthread_mutex_unlock(&checker->lock);
+
+	if (ret == -1)
+		ERROR("checker stage failed");
+
+	return ret;
+}
+
+int checker_drain(Checker checker)
+{
+	int ret;
+
+	pthread_mutex_lock(&checker->lock);
+
+	while (checker->count > 0)
+		pthread_cond_wait(&checker->done, &checker->lock);
+
+	ret = checker->failed ? -1 : 0;
+	checker->failed = false;
+
+	pthread_mutex_unlock(&checker->lock);
+
+	if (ret == -1)
+		ERROR("checker stage failed");
+
+	return ret;
+}
+
+void checker_destroy(Checker checker)
+{
+	pthread_mutex_lock(&checker->lock);
+	checker->stop = true;
+	pthread_cond_signal(&checker->work);
+	pthread_mutex_unlock(&checker->lock);
+
+	pthread_join(checker->thread, NULL);
+
+	pthread_cond_destroy(&checker->done);
+	pthread_cond_destroy(&checker->work);
+	pthread_mutex_destroy(&checker->lock);
+
+	free(checker->jobs);
+	free(checker);
+}
+
+char *check_get_error(void)
+{
+	return error;
+}
@@ -11,23 +11,33 @@
 
 #include <sys/socket.h>
 #include <sys/time.h>	// gettimeofday()
-#include <sys/poll.h>	// poll()
-
-#include <linux/errqueue.h>
 
 #include "socket.h"
+#include "pipeline.h"
+#include "completion.h"
+#include "frame.h"
+#include "uring.h"
 
 #define CTRL_DATA_SIZE	CMSG_SPACE(sizeof(uint32_t))
 
 #define MAX_IOV	1024
 #define IOV_LEN	65536
 
-#define WAITTIME_MS	100
+#define ZEROCOPY_WINDOW	64
 
 #define ERROR(...) do {					\
 	snprintf(error, BUFSIZ, __VA_ARGS__);		\
 } while(false)
 
+#define GET_ELAPSED(START, END)					\
+	(  ((END).tv_sec - (START).tv_sec)			\
+	 + ((END).tv_usec - (START).tv_usec) * 1e-6 )
+
+struct tx_slot {
+	uint32_t id;	// last zerocopy send issued from the slot
+	bool busy;	// id is still meaningful on the current socket
+};
+
 struct client {
 	Memory context;
 	Memory buffer;
@@ -35,144 +45,472 @@ struct client {
 
 	char *address;
 	int port;
+
+	Pipeline pipeline;
+	char stage_error[BUFSIZ];	// why the send stage failed
+	int sockfd;
+
+	UringSender uring;
+	size_t uring_chunk;	// bytes per SEND_ZC
+
+	int busy_poll, busy_budget;
+
+	// round trip of every framed message, up to the receiver's ack
+	bool latency;
+	double *latencies;
+	size_t nlatency, latency_capacity;
+	struct timeval message_start;
+
+	bool persistent;
+	size_t offset;		// receiver context offset of this context
+	int conn_fd;		// kept connection, -1 when there is none
+	uint32_t seq;		// frame sequence number of the next message
+	CompletionTracker tracker;
+
+	int zerocopy_window;
+	size_t iov_len;
+	size_t base;		// dmabuf offset of this client's region
+	size_t region;
+
+	struct tx_slot *slots;
+	int nslot;
+	int slot;	// slot holding the next segment to send
+	bool staged;	// the first segment was copied ahead by the last run
+
+	struct client_stats stats;
 };
 
-static char error[BUFSIZ];
+static __thread char error[BUFSIZ];
 extern MemoryProvider hp, gp;
 
-static uint64_t gettimeofday_ms(void)
+Client client_setup(Memory context, size_t size, char *address, int port)
 {
-	struct timeval tv;
+	Client client;
+	struct sockaddr_in *sockaddr;
+	int ret;
+
+	client = malloc(sizeof(struct client));
+	if (client == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}	
+	
+	client->context = context;
+	client->size = size;
+	client->address = address;
+	client->port = port;
+
+	client->pipeline = NULL;
+	client->sockfd = -1;
+
+	client->uring = NULL;
+	client->uring_chunk = IOV_LEN;
+
+	client->busy_poll = client->busy_budget = 0;
+
+	client->latency = false;
+	client->latencies = NULL;
+	client->nlatency = client->latency_capacity = 0;
+
+	client->persistent = false;
+	client->offset = 0;
+	client->conn_fd = -1;
+	client->seq = 0;
+	client->tracker = NULL;
+
+	client->zerocopy_window = ZEROCOPY_WINDOW;
+	client->iov_len = IOV_LEN;
+	client->base = 0;
+	client->region = 0;
 
-	gettimeofday(&tv, NULL);
-	return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000ULL);
+	client->nslot = 1;
+	client->slot = 0;
+	client->staged = false;
+
+	client->stats = (struct client_stats) { 0 };
+
+	client->slots = calloc(client->nslot, sizeof(struct tx_slot));
+	if (client->slots == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_CLIENT;
+	}
+
+	client->buffer = memory_provider_alloc(hp, client->size);
+	if (client->buffer == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_SLOTS;
+	}
+	
+	return client;
+
+FREE_SLOTS:	free(client->slots);
+FREE_CLIENT:	free(client);
+RETURN_NULL:	return NULL;
 }
 
-static int do_poll(int fd)
+static int client_send_chunk(void *arg, Memory slot, size_t offset, size_t len)
 {
-	struct pollfd pfd;
+	Client client = arg;
+	size_t sendlen;
 	int ret;
 
-	pfd.revents = 0;
-	pfd.fd = fd;
+	for (sendlen = 0; sendlen < len; sendlen += ret) {
+		ret = send(client->sockfd, ((char *) slot) + sendlen,
+	     		   len - sendlen, 0);
+		if (ret == -1) {
+			// `error` belongs to the sending thread, not this one
+			snprintf(client->stage_error, BUFSIZ,
+				 "failed to send(): %s", strerror(errno));
+			return -1;
+		}
+	}
 
-	ret = poll(&pfd, 1, WAITTIME_MS);
-	if (ret == -1) {
-		ERROR("failed to poll(): %s", strerror(errno));
+	client->stats.bytes += len;
+
+	return 0;
+}
+
+static void client_reset_slots(Client client)
+{
+	for (int i = 0; i < client->nslot; i++)
+		client->slots[i].busy = false;
+
+	// a copy staged for this run may not match the next one
+	(void) memory_provider_wait(gp);
+
+	client->slot = 0;
+	client->staged = false;
+}
+
+void client_set_zerocopy_window(Client client, int window)
+{
+	client->zerocopy_window = window;
+}
+
+void client_set_dma_segment(Client client, size_t iov_len,
+			    size_t base, size_t region)
+{
+	client->iov_len = iov_len ? iov_len : IOV_LEN;
+	client->base = base;
+	client->region = region;
+
+	client_reset_slots(client);
+}
+
+void client_set_persistent(Client client, bool persistent)
+{
+	client->persistent = persistent;
+}
+
+void client_set_offset(Client client, size_t offset)
+{
+	client->offset = offset;
+}
+
+void client_set_busy_poll(Client client, int usecs, int budget)
+{
+	client->busy_poll = usecs;
+	client->busy_budget = budget;
+}
+
+void client_set_latency(Client client, bool latency)
+{
+	client->latency = latency;
+}
+
+const double *client_get_latencies(Client client, size_t *count)
+{
+	*count = client->nlatency;
+
+	return client->latencies;
+}
+
+// small messages must not wait for Nagle, the ack for an interrupt
+static int client_tune_socket(Client client, int sockfd)
+{
+	if ( !client->latency && client->busy_poll == 0)
+		return 0;
+
+	if (socket_set_nodelay(sockfd) == -1) {
+		ERROR("failed to socket_set_nodelay(): %s", socket_get_error());
 		return -1;
 	}
 
-	if (pfd.revents & POLLERR) {
-		ERROR("failed to poll(): %s", strerror(errno));
+	if (client->busy_poll > 0
+	 && socket_set_busy_poll(sockfd, client->busy_poll,
+				 client->busy_budget) == -1) {
+		ERROR("failed to socket_set_busy_poll(): %s",
+		      socket_get_error());
 		return -1;
 	}
 
 	return 0;
 }
 
-static int wait_compl(int fd)
+static int client_wait_ack(Client client, int sockfd)
 {
-	int64_t tstop = gettimeofday_ms() + WAITTIME_MS;
-	char control[CMSG_SPACE(100)] = {};
-	struct sock_extended_err *serr;
-	struct msghdr msg = {};
-	uint32_t hi, lo;
+	struct timeval end;
+	double *latencies;
+	size_t capacity;
+	char ack;
 	int ret;
 
-	msg.msg_control = control;
-	msg.msg_controllen = sizeof(control);
+	if ( !client->latency)
+		return 0;
 
-	while (gettimeofday_ms() < tstop) {
-		if (!do_poll(fd))
-			continue;
+	ret = recv(sockfd, &ack, 1, 0);
+	if (ret == -1) {
+		ERROR("failed to recv(): %s", strerror(errno));
+		return -1;
+	}
 
-		ret = recvmsg(fd, &msg, MSG_ERRQUEUE);
-		if (ret == -1) {
-			ERROR("failed to recvmsg(): %s", strerror(errno));
+	if (ret == 0) {
+		ERROR("receiver closed before acking message %u", client->seq);
+		return -1;
+	}
+
+	gettimeofday(&end, NULL);
+
+	if (client->nlatency == client->latency_capacity) {
+		capacity = client->latency_capacity
+			 ? client->latency_capacity * 2 : 1024;
+
+		latencies = realloc(client->latencies,
+				    sizeof(double) * capacity);
+		if (latencies == NULL) {
+			ERROR("failed to realloc(): %s", strerror(errno));
 			return -1;
 		}
 
-		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-		     cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
-		{
-			serr = (void *) CMSG_DATA(cmsg);
-			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
-				ERROR("wrong origin %u", serr->ee_origin);
-				return -1;
-			} if (serr->ee_errno != 0) {
-				ERROR("wrong errno %d", serr->ee_errno);
-				return -1;
-			}
-
-			hi = serr->ee_data;
-			lo = serr->ee_info;
-
-			return 0;
-		}
+		client->latencies = latencies;
+		client->latency_capacity = capacity;
 	}
 
-	ERROR("did not receive tx completion");
+	client->latencies[client->nlatency++] =
+		GET_ELAPSED(client->message_start, end);
 
-	return -1;
+	return 0;
 }
 
+int client_set_dma_slots(Client client, int nslot)
+{
+	struct tx_slot *slots;
 
-Client client_setup(Memory context, size_t size, char *address, int port)
+	if (nslot < 1) {
+		ERROR("invalid number of TX slots %d", nslot);
+		return -1;
+	}
+
+	slots = calloc(nslot, sizeof(struct tx_slot));
+	if (slots == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	client_reset_slots(client);
+	free(client->slots);
+
+	client->slots = slots;
+	client->nslot = nslot;
+
+	return 0;
+}
+
+int client_set_pipeline(Client client, size_t chunk, int depth)
 {
-	Client client;
-	struct sockaddr_in *sockaddr;
-	int ret;
+	Pipeline pipeline;
 
-	client = malloc(sizeof(struct client));
-	if (client == NULL) {
-		ERROR("failed to malloc(): %s", strerror(errno));
-		goto RETURN_NULL;
-	}	
-	
-	client->context = context;
-	client->size = size;
-	client->address = address;
-	client->port = port;
+	if (depth < 1) {
+		ERROR("invalid pipeline depth %d", depth);
+		return -1;
+	}
 
-	client->buffer = memory_provider_alloc(hp, client->size);
-	if (client->buffer == NULL) {
-		ERROR("failed to malloc(): %s", strerror(errno));
-		goto FREE_CLIENT;
+	// every slot lives in the host staging buffer
+	if (chunk == 0 || chunk * depth > client->size)
+		chunk = client->size / depth;
+
+	if (chunk == 0) {
+		ERROR("staging buffer is too small for %d slots", depth);
+		return -1;
 	}
-	
-	return client;
 
-FREE_CLIENT:	free(client);
-RETURN_NULL:	return NULL;
+	if (memory_provider_allow_access(hp, gp, client->buffer) == -1) {
+		ERROR("failed to memory_provider_allow_access(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
+	}
+
+	pipeline = pipeline_create(client->buffer, chunk, depth,
+			    	   client_send_chunk, client);
+	if (pipeline == NULL) {
+		ERROR("failed to pipeline_create(): %s", pipeline_get_error());
+		return -1;
+	}
+
+	if (client->pipeline)
+		pipeline_destroy(client->pipeline);
+
+	client->pipeline = pipeline;
+
+	return 0;
 }
 
-int client_run_as_tcp(Client client, char *address, int port)
+// the copy thread belongs next to the one driving the socket
+int client_pin_pipeline(Client client, int cpu)
 {
-	size_t sendlen;
+	if (client->pipeline == NULL) {
+		ERROR("no pipeline to pin");
+		return -1;
+	}
+
+	if (pipeline_pin(client->pipeline, cpu) == -1) {
+		ERROR("failed to pipeline_pin(): %s", pipeline_get_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+int client_set_uring(Client client, unsigned depth, size_t chunk)
+{
+	UringSender uring;
+
+	// SEND_ZC reads the staging buffer, registered with the ring once
+	uring = uring_sender_create(client->buffer, client->size,
+				    depth ? depth : ZEROCOPY_WINDOW);
+	if (uring == NULL) {
+		ERROR("failed to uring_sender_create(): %s", uring_get_error());
+		return -1;
+	}
+
+	if (client->uring)
+		uring_sender_destroy(client->uring);
+
+	client->uring = uring;
+	client->uring_chunk = chunk ? chunk : IOV_LEN;
+
+	return 0;
+}
+
+static int client_send_uring(Client client, int sockfd)
+{
+	struct uring_send_stats before, after;
 	int ret;
-	int sockfd;
 
-	sockfd = socket_create(client->address, ++client->port);
-	if (sockfd == -1) {
-		ERROR("failed to socket_create(): %s",
-		      socket_get_error());
-		goto RETURN_ERROR;
+	if (memory_provider_allow_access(hp, gp, client->buffer) == -1) {
+		ERROR("failed to memory_provider_allow_access(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
 	}
 
-	ret = socket_connect(sockfd, address, port);
+	ret = memory_provider_copy(hp, client->buffer,
+			     	   client->context, client->size);
+	if (ret == -1 || memory_provider_wait(hp) == -1) {
+		ERROR("failed to amdgpu_memory_provider->memcpy_from(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
+	}
+
+	uring_sender_get_stats(client->uring, &before);
+
+	ret = uring_sender_send(client->uring, sockfd, 0, client->size,
+				client->uring_chunk);
+
+	uring_sender_get_stats(client->uring, &after);
+
+	client->stats.enters += after.enters - before.enters;
+	client->stats.sends += after.sends - before.sends;
+	client->stats.completed += after.notifications - before.notifications;
+	client->stats.copied += after.copied - before.copied;
+	client->stats.stalls += after.stalls - before.stalls;
+
 	if (ret == -1) {
-		ERROR("failed to connect(): %s", strerror(errno));
-		goto SOCKET_DESTROY;
+		ERROR("failed to uring_sender_send(): %s", uring_get_error());
+		return -1;
+	}
+
+	client->stats.bytes += client->size;
+
+	return 0;
+}
+
+static int client_send_pipelined(Client client, int sockfd)
+{
+	size_t chunk, offset, len;
+	int ret;
+
+	chunk = pipeline_get_chunk(client->pipeline);
+	client->sockfd = sockfd;
+
+	for (offset = 0; offset < client->size; offset += len) {
+		char *slot_mem;
+		int slot;
+
+		len = client->size - offset;
+		if (len > chunk)
+			len = chunk;
+
+		// only fails once the send stage did
+		slot = pipeline_acquire(client->pipeline, NULL, NULL);
+		if (slot == -1) {
+			ERROR("send stage failed: %s", client->stage_error);
+			goto DRAIN_PIPELINE;
+		}
+
+		slot_mem = pipeline_get_slot(client->pipeline, slot);
+
+		// copy chunk N+1 while the pipeline thread sends chunk N
+		ret = memory_provider_copy(
+			hp, slot_mem, ((char *) client->context) + offset, len
+		);
+		if (ret == -1) {
+			ERROR("failed to amdgpu_memory_provider->memcpy_from(): %s",
+			      memory_provider_get_error(hp));
+			goto DRAIN_PIPELINE;
+		}
+
+		if (memory_provider_wait(hp) == -1) {
+			ERROR("failed to memory_provider_wait(): %s",
+			      memory_provider_get_error(hp));
+			goto DRAIN_PIPELINE;
+		}
+
+		if (pipeline_submit(client->pipeline, slot, offset, len) == -1) {
+			ERROR("failed to pipeline_submit(): %s",
+			      pipeline_get_error());
+			goto DRAIN_PIPELINE;
+		}
 	}
 
-	if (memory_provider_allow_access(hp, gp, client->buffer) == -1)
+	if (pipeline_drain(client->pipeline) == -1) {
+		ERROR("send stage failed: %s", client->stage_error);
 		return -1;
+	}
+
+	return 0;
+
+DRAIN_PIPELINE:	(void) pipeline_drain(client->pipeline);
+		return -1;
+}
+
+static int client_send_buffered(Client client, int sockfd)
+{
+	size_t sendlen;
+	int ret;
+
+	if (memory_provider_allow_access(hp, gp, client->buffer) == -1) {
+		ERROR("failed to memory_provider_allow_access(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
+	}
 
 	ret = memory_provider_copy(hp, client->buffer,
 			     	   client->context, client->size);
-	if (ret == -1)
+	if (ret == -1) {
 		ERROR("failed to amdgpu_memory_provider->memcpy_from(): %s",
 		      memory_provider_get_error(gp));
+		return -1;
+	}
 
 	sendlen = 0;
 	while (sendlen < client->size) {
@@ -180,12 +518,87 @@ int client_run_as_tcp(Client client, char *address, int port)
 	     		   client->size - sendlen, 0);
 		if (ret == -1) {
 			ERROR("failed to send(): %s", strerror(errno));
-			goto SOCKET_DESTROY;
+			return -1;
 		}
 
 		sendlen += ret;
 	}
 
+	client->stats.bytes += sendlen;
+
+	return 0;
+}
+
+static int client_connect_tcp(Client client, char *address, int port)
+{
+	int sockfd;
+
+	sockfd = socket_create(client->address, ++client->port);
+	if (sockfd == -1) {
+		ERROR("failed to socket_create(): %s",
+		      socket_get_error());
+		return -1;
+	}
+
+	if (client_tune_socket(client, sockfd) == -1) {
+		(void) socket_destroy(sockfd);
+		return -1;
+	}
+
+	if (socket_connect(sockfd, address, port) == -1) {
+		ERROR("failed to connect(): %s", strerror(errno));
+		(void) socket_destroy(sockfd);
+		return -1;
+	}
+
+	return sockfd;
+}
+
+int client_run_as_tcp(Client client, char *address, int port)
+{
+	int ret;
+	int sockfd;
+
+	// a kept connection is opened by the first message only
+	if (client->conn_fd == -1) {
+		sockfd = client_connect_tcp(client, address, port);
+		if (sockfd == -1)
+			goto RETURN_ERROR;
+
+		if (client->persistent)
+			client->conn_fd = sockfd;
+	} else {
+		sockfd = client->conn_fd;
+	}
+
+	gettimeofday(&client->message_start, NULL);
+
+	if (client->persistent)
+		if (frame_send_header(sockfd, client->seq,
+				      client->offset, client->size) == -1) {
+			ERROR("failed to frame_send_header(): %s",
+			      frame_get_error());
+			goto SOCKET_DESTROY;
+		}
+
+	if (client->uring)
+		ret = client_send_uring(client, sockfd);
+	else if (client->pipeline)
+		ret = client_send_pipelined(client, sockfd);
+	else
+		ret = client_send_buffered(client, sockfd);
+
+	if (ret == -1)
+		goto SOCKET_DESTROY;
+
+	if (client->persistent) {
+		if (client_wait_ack(client, sockfd) == -1)
+			goto SOCKET_DESTROY;
+
+		client->seq++;
+		return 0;
+	}
+
 	if (socket_destroy(sockfd) == -1) {
 		ERROR("failed to socket_destroy(): %s", socket_get_error());
 		goto RETURN_ERROR;
@@ -194,25 +607,125 @@ int client_run_as_tcp(Client client, char *address, int port)
 	return 0;
 
 SOCKET_DESTROY:	socket_destroy(sockfd);
+		client->conn_fd = -1;
 RETURN_ERROR:	return -1;
 }
 
-int client_run_as_dma(Client client, Memory dmabuf, char *address, int port,
-		      char *interface, int dmabuf_id)
+static void client_add_zerocopy_stats(Client client,
+				      CompletionTracker tracker)
+{
+	struct completion_stats stats;
+
+	completion_tracker_get_stats(tracker, &stats);
+
+	client->stats.sends += stats.sends;
+	client->stats.completed += stats.completed;
+	client->stats.notifications += stats.notifications;
+	client->stats.ranges += stats.ranges;
+	client->stats.copied += stats.copied;
+	client->stats.stalls += stats.stalls;
+}
+
+// send dmabuf[base, base + len) as sendmsg() calls of up to MAX_IOV iovecs
+static int client_send_segment(Client client, CompletionTracker tracker,
+			       int sockfd, int dmabuf_id,
+			       size_t base, size_t len, uint32_t *last_id)
 {
 	char ctrl_data[CTRL_DATA_SIZE];
 	struct iovec iov[MAX_IOV];
+	size_t sendlen;
+	int ret;
 
-	int sockfd;
-	int ret, opt;
+	sendlen = 0;
+	while (sendlen < len) {
+		struct msghdr msg = { 0 };
+		struct cmsghdr *cmsg;
+		size_t offset;
+		int niov;
 
-	size_t sendlen;
+		// only block when the window of in-flight sends is full
+		if (completion_tracker_reserve(tracker) == -1) {
+			ERROR("failed to completion_tracker_reserve(): %s",
+			      completion_get_error());
+			return -1;
+		}
+
+		// iov_base is an offset into the dmabuf bound to the socket
+		offset = sendlen;
+		for (niov = 0; niov < MAX_IOV && offset < len; niov++) {
+			iov[niov].iov_base = (void *) (base + offset);
+			iov[niov].iov_len = len - offset;
+			if (iov[niov].iov_len > client->iov_len)
+				iov[niov].iov_len = client->iov_len;
+
+			offset += iov[niov].iov_len;
+		}
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = niov;
+		
+		msg.msg_control = ctrl_data;
+		msg.msg_controllen = CTRL_DATA_SIZE;
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_DEVMEM_DMABUF;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+
+		*((uint32_t *) CMSG_DATA(cmsg)) = dmabuf_id;
+
+		ret = sendmsg(sockfd, &msg, MSG_ZEROCOPY);
+		if (ret == -1) {
+			ERROR("failed to sendmsg(): %s", strerror(errno));
+			return -1;
+		}
+
+		*last_id = completion_tracker_sent(tracker);
+
+		sendlen += ret;
+	}
+
+	return 0;
+}
+
+// start copying context[offset, offset + len) into `slot` of the dmabuf
+static int client_stage_segment(Client client, CompletionTracker tracker,
+				Memory dmabuf, size_t slot_size, int slot,
+				size_t offset, size_t len)
+{
+	struct tx_slot *tx_slot = &client->slots[slot];
+	int ret;
 
-	if (client->size > IOV_LEN * MAX_IOV) {
-		ERROR("buffer is too long to send at once!");
+	// the NIC may still be reading the slot's previous segment
+	if (tx_slot->busy) {
+		if (completion_tracker_wait(tracker, tx_slot->id) == -1) {
+			ERROR("failed to completion_tracker_wait(): %s",
+			      completion_get_error());
+			return -1;
+		}
+
+		tx_slot->busy = false;
+	}
+
+	ret = memory_provider_copy(
+		gp, ((char *) dmabuf) + client->base + slot * slot_size,
+		((char *) client->context) + offset, len
+	);
+	if (ret == -1) {
+		ERROR("failed to amdgpu_memory_provider->memmove_to(): %s",
+		      memory_provider_get_error(gp));
 		return -1;
 	}
 
+	return 0;
+}
+
+static int client_open_dma(Client client, char *address, int port,
+			   char *interface)
+{
+	int sockfd;
+	int ret, opt;
+
 	sockfd = socket_create(client->address, client->port);
 	if (sockfd == -1) {
 		ERROR("failed to socket_create(): %s",
@@ -240,68 +753,218 @@ int client_run_as_dma(Client client, Memory dmabuf, char *address, int port,
 		      strerror(errno));
 		goto DESTROY_SOCKET;
 	}
-	
+
+	if (client_tune_socket(client, sockfd) == -1)
+		goto DESTROY_SOCKET;
+
 	if (socket_connect(sockfd, address, port) == -1) {
 		ERROR("failed to socket_connect(): %s", socket_get_error());
 		goto DESTROY_SOCKET;
 	}
 
-	ret = memory_provider_copy(
-		gp, dmabuf, client->context, client->size
-	);
-	if (ret == -1) {
-		ERROR("failed to amdgpu_memory_provider->memmove_to(): %s",
-		      memory_provider_get_error(gp));
+	client->tracker = completion_tracker_create(sockfd,
+						    client->zerocopy_window);
+	if (client->tracker == NULL) {
+		ERROR("failed to completion_tracker_create(): %s",
+		      completion_get_error());
 		goto DESTROY_SOCKET;
 	}
 
-	sendlen = 0;
-	while (sendlen < client->size) {
-		struct msghdr msg;
-		struct cmsghdr *cmsg;
+	client->conn_fd = sockfd;
 
-		iov[0].iov_base = (void *) sendlen;
-		iov[0].iov_len = client->size - sendlen;
+	return 0;
 
-		msg.msg_iov = iov;
-		msg.msg_iovlen = 1;
-		
-		msg.msg_control = ctrl_data;
-		msg.msg_controllen = CTRL_DATA_SIZE;
+DESTROY_SOCKET:	(void) socket_destroy(sockfd);
+RETURN_ERROR:	return -1;
+}
 
-		cmsg = CMSG_FIRSTHDR(&msg);
-		cmsg->cmsg_level = SOL_SOCKET;
-		cmsg->cmsg_type = SCM_DEVMEM_DMABUF;
-		cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+static int client_close_dma(Client client, bool flush)
+{
+	int ret = 0;
+
+	// the dmabuf is rewritten by the next run, so everything must be out
+	if (flush && completion_tracker_flush(client->tracker) == -1) {
+		ERROR("failed to completion_tracker_flush(): %s",
+		      completion_get_error());
+		flush = false;
+		ret = -1;
+	}
 
-		*((uint32_t *) CMSG_DATA(cmsg)) = dmabuf_id;
+	client_add_zerocopy_stats(client, client->tracker);
+	completion_tracker_destroy(client->tracker);
+	client->tracker = NULL;
 
-		ret = sendmsg(sockfd, &msg, MSG_ZEROCOPY);
-		if (ret == -1) {
-			ERROR("failed to sendmsg(): %s", strerror(errno));
-			goto DESTROY_SOCKET;
+	// completion ids belong to the socket, which is gone after this
+	if (flush) {
+		for (int i = 0; i < client->nslot; i++)
+			client->slots[i].busy = false;
+	} else {
+		client_reset_slots(client);
+	}
+
+	if (socket_destroy(client->conn_fd) == -1 && ret == 0) {
+		ERROR("failed to socket_destroy(): %s", socket_get_error());
+		ret = -1;
+	}
+
+	client->conn_fd = -1;
+
+	return ret;
+}
+
+int client_run_as_dma(Client client, Memory dmabuf, char *address, int port,
+		      char *interface, int dmabuf_id)
+{
+	CompletionTracker tracker;
+
+	size_t region, slot_size, offset, len;
+	int sockfd;
+	int ret;
+
+	region = client->region ? client->region : client->size;
+
+	slot_size = region / client->nslot;
+	if (slot_size > client->size)
+		slot_size = client->size;
+
+	if (slot_size == 0) {
+		ERROR("dmabuf is too small for %d slots", client->nslot);
+		return -1;
+	}
+
+	if (client->conn_fd == -1)
+		if (client_open_dma(client, address, port, interface) == -1)
+			return -1;
+
+	sockfd = client->conn_fd;
+	tracker = client->tracker;
+
+	gettimeofday(&client->message_start, NULL);
+
+	// the header is tiny, so it goes out of host memory
+	if (client->persistent)
+		if (frame_send_header(sockfd, client->seq,
+				      client->offset, client->size) == -1) {
+			ERROR("failed to frame_send_header(): %s",
+			      frame_get_error());
+			goto CLOSE_CONN;
 		}
 
-		sendlen += ret;
+	// the context may be larger than the dmabuf; cycle through its slots
+	for (offset = 0; offset < client->size; offset += len) {
+		struct tx_slot *tx_slot = &client->slots[client->slot];
+		size_t next, next_len;
+
+		len = client->size - offset;
+		if (len > slot_size)
+			len = slot_size;
+
+		if ( !client->staged) {
+			ret = client_stage_segment(client, tracker, dmabuf,
+						   slot_size, client->slot,
+						   offset, len);
+			if (ret == -1)
+				goto CLOSE_CONN;
+		}
 
-		wait_compl(sockfd);
+		if (memory_provider_wait(gp) == -1) {
+			ERROR("failed to memory_provider_wait(): %s",
+			      memory_provider_get_error(gp));
+			goto CLOSE_CONN;
+		}
+
+		client->staged = false;
+
+		ret = client_send_segment(client, tracker, sockfd, dmabuf_id,
+					  client->base + client->slot * slot_size,
+					  len,
+					  &tx_slot->id);
+		if (ret == -1)
+			goto CLOSE_CONN;
+
+		tx_slot->busy = true;
+		client->slot = (client->slot + 1) % client->nslot;
+
+		client->stats.bytes += len;
+
+		if (client->nslot == 1)
+			continue;
+
+		// copy the following segment while this one is on the wire;
+		// past the end, that is the first segment of the next run
+		next = offset + len;
+		if (next >= client->size)
+			next = 0;
+
+		next_len = client->size - next;
+		if (next_len > slot_size)
+			next_len = slot_size;
+
+		ret = client_stage_segment(client, tracker, dmabuf, slot_size,
+					   client->slot, next, next_len);
+		if (ret == -1)
+			goto CLOSE_CONN;
+
+		client->staged = true;
 	}
 
-	if (socket_destroy(sockfd) == -1) {
+	// a kept connection reuses the slots once their sends complete
+	if (client->persistent) {
+		if (client_wait_ack(client, sockfd) == -1)
+			goto CLOSE_CONN;
+
+		client->seq++;
+		return 0;
+	}
+
+	return client_close_dma(client, true);
+
+CLOSE_CONN:	(void) client_close_dma(client, false);
+		return -1;
+}
+
+int client_disconnect(Client client)
+{
+	int ret;
+
+	if (client->conn_fd == -1)
+		return 0;
+
+	if (client->tracker)
+		return client_close_dma(client, true);
+
+	ret = socket_destroy(client->conn_fd);
+	client->conn_fd = -1;
+	if (ret == -1) {
 		ERROR("failed to socket_destroy(): %s", socket_get_error());
 		return -1;
 	}
 
 	return 0;
+}
 
-DESTROY_SOCKET:	(void) socket_destroy(sockfd);
-RETURN_ERROR:	return -1;
+void client_get_stats(Client client, struct client_stats *stats)
+{
+	*stats = client->stats;
 }
 
 
 void client_cleanup(Client client)
 {
+	(void) client_disconnect(client);
+
+	// don't free the slots under a copy staged for a run that never came
+	client_reset_slots(client);
+
+	if (client->pipeline)
+		pipeline_destroy(client->pipeline);
+
+	if (client->uring)
+		uring_sender_destroy(client->uring);
+
 	memory_provider_free(hp, client->buffer);
+	free(client->latencies);
+	free(client->slots);
 	free(client);
 }
 
@@ -0,0 +1,224 @@
+#include "completion.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// bool, true, false
+#include <stdlib.h>	// malloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <sys/socket.h>	// recvmsg()
+#include <sys/poll.h>	// poll()
+#include <netinet/in.h>	// IP_RECVERR, IPV6_RECVERR
+
+#include <linux/errqueue.h>	// struct sock_extended_err
+
+#define WAITTIME_MS	100
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct completion_tracker {
+	int fd;
+	int window;
+
+	uint32_t next_id;	// id the kernel gives to the next send
+	uint32_t completed;	// sends known to be complete
+
+	bool merging;
+	uint32_t range_hi;
+
+	struct completion_stats stats;
+};
+
+static __thread char error[BUFSIZ];
+
+CompletionTracker completion_tracker_create(int fd, int window)
+{
+	CompletionTracker tracker;
+
+	tracker = malloc(sizeof(struct completion_tracker));
+	if (tracker == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return NULL;
+	}
+
+	tracker->fd = fd;
+	tracker->window = window > 0 ? window : 1;
+
+	tracker->next_id = 0;
+	tracker->completed = 0;
+
+	tracker->merging = false;
+	tracker->range_hi = 0;
+
+	tracker->stats = (struct completion_stats) { 0 };
+
+	return tracker;
+}
+
+static uint32_t completion_tracker_outstanding(CompletionTracker tracker)
+{
+	return tracker->next_id - tracker->completed;
+}
+
+static int completion_tracker_parse(CompletionTracker tracker,
+				    struct msghdr *msg)
+{
+	struct sock_extended_err *serr;
+	uint32_t lo, hi;
+
+	if (msg->msg_flags & MSG_CTRUNC) {
+		ERROR("truncated completion notification");
+		return -1;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+	     cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+	{
+		if (!(cmsg->cmsg_level == IPPROTO_IP
+		   && cmsg->cmsg_type == IP_RECVERR)
+		 && !(cmsg->cmsg_level == IPPROTO_IPV6
+		   && cmsg->cmsg_type == IPV6_RECVERR))
+			continue;
+
+		serr = (void *) CMSG_DATA(cmsg);
+		if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+			ERROR("wrong origin %u", serr->ee_origin);
+			return -1;
+		} if (serr->ee_errno != 0) {
+			ERROR("wrong errno %d", serr->ee_errno);
+			return -1;
+		}
+
+		lo = serr->ee_info;
+		hi = serr->ee_data;
+
+		// notifications are inclusive [lo, hi] id ranges
+		if (!tracker->merging || lo != tracker->range_hi + 1)
+			tracker->stats.ranges++;
+
+		tracker->merging = true;
+		tracker->range_hi = hi;
+
+		tracker->completed += hi - lo + 1;
+		tracker->stats.completed += hi - lo + 1;
+
+		if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			tracker->stats.copied += hi - lo + 1;
+	}
+
+	return 0;
+}
+
+// drain whatever sits in the error queue, waiting up to `timeout_ms` for it
+static int completion_tracker_harvest(CompletionTracker tracker,
+				      int timeout_ms)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err) + 64)];
+	int harvested;
+
+	if (timeout_ms != 0) {
+		struct pollfd pfd = { .fd = tracker->fd, .events = 0 };
+
+		if (poll(&pfd, 1, timeout_ms) == -1) {
+			ERROR("failed to poll(): %s", strerror(errno));
+			return -1;
+		}
+
+		if ( !(pfd.revents & POLLERR) )
+			return 0;
+	}
+
+	for (harvested = 0; true; harvested++) {
+		struct msghdr msg = { 0 };
+
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(tracker->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			ERROR("failed to recvmsg(): %s", strerror(errno));
+			return -1;
+		}
+
+		tracker->stats.notifications++;
+
+		if (completion_tracker_parse(tracker, &msg) == -1)
+			return -1;
+	}
+
+	return harvested;
+}
+
+static int completion_tracker_wait_outstanding(CompletionTracker tracker,
+					       uint32_t max)
+{
+	if (completion_tracker_outstanding(tracker) > max)
+		tracker->stats.stalls++;
+
+	while (completion_tracker_outstanding(tracker) > max) {
+		int ret = completion_tracker_harvest(tracker, WAITTIME_MS);
+		if (ret == -1)
+			return -1;
+
+		if (ret == 0) {
+			ERROR("did not receive tx completion");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int completion_tracker_reserve(CompletionTracker tracker)
+{
+	// reap in batches once half the window is in flight
+	if (completion_tracker_outstanding(tracker) >= tracker->window / 2)
+		if (completion_tracker_harvest(tracker, 0) == -1)
+			return -1;
+
+	return completion_tracker_wait_outstanding(tracker,
+					    	   tracker->window - 1);
+}
+
+uint32_t completion_tracker_sent(CompletionTracker tracker)
+{
+	tracker->stats.sends++;
+
+	return tracker->next_id++;
+}
+
+int completion_tracker_wait(CompletionTracker tracker, uint32_t id)
+{
+	// TCP completes sends in order, so ids below `completed` are done
+	if ((int32_t) (tracker->completed - id) > 0)
+		return 0;
+
+	return completion_tracker_wait_outstanding(
+		tracker, tracker->next_id - id - 1
+	);
+}
+
+int completion_tracker_flush(CompletionTracker tracker)
+{
+	return completion_tracker_wait_outstanding(tracker, 0);
+}
+
+void completion_tracker_get_stats(CompletionTracker tracker,
+				  struct completion_stats *stats)
+{
+	*stats = tracker->stats;
+}
+
+void completion_tracker_destroy(CompletionTracker tracker)
+{
+	free(tracker);
+}
+
+char *completion_get_error(void)
+{
+	return error;
+}
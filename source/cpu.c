@@ -0,0 +1,129 @@
+#include "cpu.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdlib.h>	// malloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <unistd.h>	// syscall(), read(), close()
+
+#include <sys/ioctl.h>		// ioctl()
+#include <sys/resource.h>	// getrusage()
+#include <sys/syscall.h>	// SYS_perf_event_open
+
+#include <linux/perf_event.h>	// struct perf_event_attr
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+#define GET_RUSAGE_TIME(RU)					\
+	(  (RU).ru_utime.tv_sec + (RU).ru_utime.tv_usec * 1e-6	\
+	 + (RU).ru_stime.tv_sec + (RU).ru_stime.tv_usec * 1e-6 )
+
+struct cpu_meter {
+	int perf_fd;		// -1 when only CPU time is measured
+	struct rusage start;
+};
+
+static __thread char error[BUFSIZ];
+
+static int cpu_open_cycles(void)
+{
+	struct perf_event_attr attr = { 0 };
+	int fd;
+
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled = 1;
+	attr.inherit = 1;	// threads created from now on count as well
+	attr.exclude_hv = 1;
+
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fd == -1)
+		ERROR("failed to perf_event_open(): %s", strerror(errno));
+
+	return fd;
+}
+
+// create before any thread that should be counted is started
+CpuMeter cpu_meter_create(void)
+{
+	CpuMeter meter;
+
+	meter = malloc(sizeof(struct cpu_meter));
+	if (meter == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return NULL;
+	}
+
+	// no PMU or perf_event_paranoid in the way: fall back to CPU time
+	meter->perf_fd = cpu_open_cycles();
+
+	return meter;
+}
+
+int cpu_meter_start(CpuMeter meter)
+{
+	if (meter->perf_fd != -1) {
+		if (ioctl(meter->perf_fd, PERF_EVENT_IOC_RESET, 0) == -1
+		 || ioctl(meter->perf_fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+			ERROR("failed to ioctl(): %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	if (getrusage(RUSAGE_SELF, &meter->start) == -1) {
+		ERROR("failed to getrusage(): %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int cpu_meter_stop(CpuMeter meter, struct cpu_usage *usage)
+{
+	struct rusage end;
+	uint64_t cycles;
+
+	*usage = (struct cpu_usage) { 0 };
+
+	if (meter->perf_fd != -1) {
+		if (ioctl(meter->perf_fd, PERF_EVENT_IOC_DISABLE, 0) == -1) {
+			ERROR("failed to ioctl(): %s", strerror(errno));
+			return -1;
+		}
+
+		if (read(meter->perf_fd, &cycles, sizeof(cycles))
+		    != sizeof(cycles)) {
+			ERROR("failed to read(): %s", strerror(errno));
+			return -1;
+		}
+
+		usage->has_cycles = true;
+		usage->cycles = cycles;
+	}
+
+	if (getrusage(RUSAGE_SELF, &end) == -1) {
+		ERROR("failed to getrusage(): %s", strerror(errno));
+		return -1;
+	}
+
+	usage->seconds = GET_RUSAGE_TIME(end) - GET_RUSAGE_TIME(meter->start);
+
+	return 0;
+}
+
+void cpu_meter_destroy(CpuMeter meter)
+{
+	if (meter->perf_fd != -1)
+		close(meter->perf_fd);
+
+	free(meter);
+}
+
+char *cpu_get_error(void)
+{
+	return error;
+}
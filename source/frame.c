@@ -0,0 +1,69 @@
+#include "frame.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// false
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+#include <endian.h>	// htobe64(), be64toh()
+
+#include <sys/socket.h>	// send(), recv()
+#include <arpa/inet.h>	// htonl(), ntohl()
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+static __thread char error[BUFSIZ];
+
+void frame_header_pack(struct frame_header *header, uint32_t seq,
+		       uint64_t offset, uint64_t length)
+{
+	header->magic = htonl(FRAME_MAGIC);
+	header->seq = htonl(seq);
+	header->offset = htobe64(offset);
+	header->length = htobe64(length);
+}
+
+int frame_header_unpack(struct frame_header *header, uint32_t seq,
+			uint64_t *offset, uint64_t *length)
+{
+	if (ntohl(header->magic) != FRAME_MAGIC) {
+		ERROR("bad frame magic 0x%08x", ntohl(header->magic));
+		return -1;
+	}
+
+	if (ntohl(header->seq) != seq) {
+		ERROR("expected message %u but got %u", seq, ntohl(header->seq));
+		return -1;
+	}
+
+	*offset = be64toh(header->offset);
+	*length = be64toh(header->length);
+
+	return 0;
+}
+
+int frame_send_header(int fd, uint32_t seq, uint64_t offset, uint64_t length)
+{
+	struct frame_header header;
+	size_t sendlen;
+	int ret;
+
+	frame_header_pack(&header, seq, offset, length);
+
+	for (sendlen = 0; sendlen < sizeof(header); sendlen += ret) {
+		ret = send(fd, ((char *) &header) + sendlen,
+			   sizeof(header) - sendlen, 0);
+		if (ret == -1) {
+			ERROR("failed to send(): %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+char *frame_get_error(void)
+{
+	return error;
+}
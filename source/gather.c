@@ -0,0 +1,142 @@
+#include "gather.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// false
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct gather_entry {
+	char *dst;
+	char *src;
+	size_t len;
+};
+
+struct gatherer {
+	MemoryProvider mp;
+
+	struct gather_entry *entries;
+	size_t capacity;
+	size_t count;
+
+	struct gather_stats stats;
+};
+
+static __thread char error[BUFSIZ];
+
+Gatherer gatherer_create(MemoryProvider mp, size_t capacity)
+{
+	Gatherer gatherer;
+
+	if (capacity == 0) {
+		ERROR("gather list needs room for at least one copy");
+		goto RETURN_NULL;
+	}
+
+	gatherer = malloc(sizeof(struct gatherer));
+	if (gatherer == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	gatherer->entries = calloc(capacity, sizeof(struct gather_entry));
+	if (gatherer->entries == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_GATHERER;
+	}
+
+	gatherer->mp = mp;
+	gatherer->capacity = capacity;
+	gatherer->count = 0;
+	gatherer->stats = (struct gather_stats) { 0 };
+
+	return gatherer;
+
+FREE_GATHERER:	free(gatherer);
+RETURN_NULL:	return NULL;
+}
+
+int gatherer_add(Gatherer gatherer, Memory dst, Memory src, size_t len)
+{
+	struct gather_entry *last;
+
+	if (len == 0)
+		return 0;
+
+	gatherer->stats.frags++;
+	gatherer->stats.bytes += len;
+
+	// frags the page pool handed out back to back become one copy
+	if (gatherer->count > 0) {
+		last = &gatherer->entries[gatherer->count - 1];
+
+		if (last->src + last->len == (char *) src
+		 && last->dst + last->len == (char *) dst) {
+			last->len += len;
+			return 0;
+		}
+	}
+
+	if (gatherer->count == gatherer->capacity)
+		if (gatherer_flush(gatherer) == -1)
+			return -1;
+
+	gatherer->entries[gatherer->count++] = (struct gather_entry) {
+		.dst = dst, .src = src, .len = len
+	};
+
+	return 0;
+}
+
+int gatherer_flush(Gatherer gatherer)
+{
+	size_t count = gatherer->count;
+
+	if (count == 0)
+		return 0;
+
+	gatherer->count = 0;
+
+	// queue the whole list, then wait once for all of it
+	for (size_t i = 0; i < count; i++) {
+		struct gather_entry *entry = &gatherer->entries[i];
+
+		if (memory_provider_copy(gatherer->mp, entry->dst,
+			   		 entry->src, entry->len) == -1) {
+			ERROR("failed to memory_provider_copy(): %s",
+			      memory_provider_get_error(gatherer->mp));
+			return -1;
+		}
+	}
+
+	if (memory_provider_wait(gatherer->mp) == -1) {
+		ERROR("failed to memory_provider_wait(): %s",
+		      memory_provider_get_error(gatherer->mp));
+		return -1;
+	}
+
+	gatherer->stats.copies += count;
+	gatherer->stats.batches++;
+
+	return 0;
+}
+
+void gatherer_get_stats(Gatherer gatherer, struct gather_stats *stats)
+{
+	*stats = gatherer->stats;
+}
+
+void gatherer_destroy(Gatherer gatherer)
+{
+	free(gatherer->entries);
+	free(gatherer);
+}
+
+char *gather_get_error(void)
+{
+	return error;
+}
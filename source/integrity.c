@@ -0,0 +1,504 @@
+#include "integrity.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// false
+#include <stdlib.h>	// malloc(), free()
+#include <string.h>	// memcpy(), strerror()
+#include <errno.h>	// errno
+#include <endian.h>	// htobe64(), be64toh()
+
+#include <pthread.h>	// pthread_once()
+
+#include <sys/socket.h>	// send(), recv(), listen(), accept()
+#include <arpa/inet.h>	// htonl(), ntohl()
+
+#include "socket.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>	// _mm_crc32_u64(), _mm_crc32_u8()
+#endif
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+#define CRC32C_POLY	0x82f63b78	// reflected
+
+// sent in network byte order ahead of the hashes, one uint32_t per block
+struct integrity_header {
+	uint32_t magic;
+	uint32_t reserved;
+	uint64_t size;
+	uint64_t block;
+} __attribute__((packed));
+
+struct integrity {
+	size_t size;
+	size_t block;
+	size_t nblock;
+
+	uint32_t *hashes;
+	Validator validator;
+
+	struct integrity_stats stats;
+};
+
+static __thread char error[BUFSIZ];
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static uint32_t table[256];
+static uint32_t (*crc32c)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *bytes,
+			     size_t len)
+{
+	while (len--)
+		crc = table[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *bytes,
+			     size_t len)
+{
+	uint64_t value, crc64 = crc;
+
+	for (; len >= sizeof(value); len -= sizeof(value)) {
+		memcpy(&value, bytes, sizeof(value));
+		crc64 = _mm_crc32_u64(crc64, value);
+		bytes += sizeof(value);
+	}
+
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *bytes++);
+
+	return crc;
+}
+#endif
+
+static void integrity_init(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+
+		table[i] = crc;
+	}
+
+	crc32c = crc32c_table;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c = crc32c_sse42;
+#endif
+}
+
+uint32_t integrity_crc32c(uint32_t crc, const void *buffer, size_t len)
+{
+	pthread_once(&once, integrity_init);
+
+	return ~crc32c(~crc, buffer, len);
+}
+
+size_t integrity_get_nblock(size_t size, size_t block)
+{
+	return (size + block - 1) / block;
+}
+
+void integrity_hash(const void *buffer, size_t len, size_t block,
+		    uint32_t *hashes)
+{
+	const char *bytes = buffer;
+
+	for (size_t pos = 0; pos < len; pos += block)
+		*hashes++ = integrity_crc32c(0, bytes + pos,
+					     len - pos < block
+					     ? len - pos : block);
+}
+
+size_t integrity_check(const void *buffer, size_t len, size_t block,
+		       const uint32_t *hashes)
+{
+	const char *bytes = buffer;
+
+	for (size_t pos = 0; pos < len; pos += block)
+		if (integrity_crc32c(0, bytes + pos,
+				     len - pos < block ? len - pos : block)
+		    != *hashes++)
+			return pos;
+
+	return INTEGRITY_OK;
+}
+
+static int integrity_send(int fd, const void *buffer, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t sent = 0; sent < len; sent += ret) {
+		ret = send(fd, (const char *) buffer + sent, len - sent, 0);
+		if (ret == -1) {
+			ERROR("failed to send(): %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int integrity_recv(int fd, void *buffer, size_t len)
+{
+	ssize_t ret;
+
+	for (size_t recvd = 0; recvd < len; recvd += ret) {
+		ret = recv(fd, (char *) buffer + recvd, len - recvd, 0);
+		if (ret == -1) {
+			ERROR("failed to recv(): %s", strerror(errno));
+			return -1;
+		}
+
+		if (ret == 0) {
+			ERROR("manifest cut short at %zu of %zu bytes",
+			      recvd, len);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int integrity_send_manifest(int fd, size_t size, size_t block,
+			    const uint32_t *hashes)
+{
+	struct integrity_header header;
+	uint32_t *wire;
+	size_t nblock;
+	int ret;
+
+	nblock = integrity_get_nblock(size, block);
+
+	wire = malloc(sizeof(uint32_t) * nblock);
+	if (wire == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	for (size_t i = 0; i < nblock; i++)
+		wire[i] = htonl(hashes[i]);
+
+	header = (struct integrity_header) {
+		.magic = htonl(INTEGRITY_MAGIC),
+		.size = htobe64(size), .block = htobe64(block)
+	};
+
+	ret = integrity_send(fd, &header, sizeof(header));
+	if (ret == 0)
+		ret = integrity_send(fd, wire, sizeof(uint32_t) * nblock);
+
+	free(wire);
+
+	return ret;
+}
+
+// the header comes off the wire, so check it before sizing anything by it
+static int integrity_recv_manifest(int fd, size_t size, size_t *block,
+			    uint32_t **hashes)
+{
+	struct integrity_header header;
+	uint64_t manifest_size, manifest_block;
+	size_t nblock;
+
+	if (integrity_recv(fd, &header, sizeof(header)) == -1)
+		return -1;
+
+	if (ntohl(header.magic) != INTEGRITY_MAGIC) {
+		ERROR("bad manifest magic 0x%08x", ntohl(header.magic));
+		return -1;
+	}
+
+	manifest_size = be64toh(header.size);
+	if (manifest_size != size) {
+		ERROR("manifest covers %llu bytes, the context %zu",
+		      (unsigned long long) manifest_size, size);
+		return -1;
+	}
+
+	manifest_block = be64toh(header.block);
+	if (manifest_block == 0 || manifest_block > SIZE_MAX) {
+		ERROR("manifest has a bad block size %llu",
+		      (unsigned long long) manifest_block);
+		return -1;
+	}
+
+	*block = manifest_block;
+	nblock = size / *block + (size % *block != 0);
+	if (nblock > SIZE_MAX / sizeof(uint32_t)) {
+		ERROR("manifest of %zu blocks is too large", nblock);
+		return -1;
+	}
+
+	*hashes = malloc(sizeof(uint32_t) * nblock);
+	if (*hashes == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	if (integrity_recv(fd, *hashes, sizeof(uint32_t) * nblock) == -1) {
+		free(*hashes);
+		return -1;
+	}
+
+	for (size_t i = 0; i < nblock; i++)
+		(*hashes)[i] = ntohl((*hashes)[i]);
+
+	return 0;
+}
+
+// the manifest goes over its own connection, ahead of any payload
+int integrity_push_manifest(char *bind_addr, char *address, int port,
+			    size_t size, size_t block, const uint32_t *hashes)
+{
+	int fd, ret;
+
+	fd = socket_create(bind_addr, 0);
+	if (fd == -1) {
+		ERROR("failed to socket_create(): %s", socket_get_error());
+		return -1;
+	}
+
+	if (socket_connect(fd, address, port) == -1) {
+		ERROR("failed to socket_connect(): %s", socket_get_error());
+		(void) socket_destroy(fd);
+		return -1;
+	}
+
+	ret = integrity_send_manifest(fd, size, block, hashes);
+
+	(void) socket_destroy(fd);
+
+	return ret;
+}
+
+int integrity_accept_manifest(char *address, int port,
+			      size_t size, size_t *block, uint32_t **hashes)
+{
+	int sockfd, fd, ret;
+
+	sockfd = socket_create(address, port);
+	if (sockfd == -1) {
+		ERROR("failed to socket_create(): %s", socket_get_error());
+		return -1;
+	}
+
+	if (listen(sockfd, 1) == -1) {
+		ERROR("failed to listen(): %s", strerror(errno));
+		(void) socket_destroy(sockfd);
+		return -1;
+	}
+
+	fd = accept(sockfd, NULL, 0);
+	if (fd == -1)
+		ERROR("failed to accept(): %s", strerror(errno));
+
+	(void) socket_destroy(sockfd);
+	if (fd == -1)
+		return -1;
+
+	ret = integrity_recv_manifest(fd, size, block, hashes);
+
+	(void) socket_destroy(fd);
+
+	return ret;
+}
+
+Integrity integrity_create(size_t size, size_t block, const uint32_t *hashes)
+{
+	Integrity integrity;
+
+	if (size == 0 || block == 0) {
+		ERROR("invalid manifest of %zu bytes in %zu byte blocks",
+		      size, block);
+		goto RETURN_NULL;
+	}
+
+	integrity = malloc(sizeof(struct integrity));
+	if (integrity == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	integrity->size = size;
+	integrity->block = block;
+	integrity->nblock = integrity_get_nblock(size, block);
+
+	integrity->hashes = malloc(sizeof(uint32_t) * integrity->nblock);
+	if (integrity->hashes == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_INTEGRITY;
+	}
+
+	memcpy(integrity->hashes, hashes, sizeof(uint32_t) * integrity->nblock);
+
+	integrity->validator = NULL;
+	integrity->stats = (struct integrity_stats) { 0 };
+
+	return integrity;
+
+FREE_INTEGRITY:	free(integrity);
+RETURN_NULL:	return NULL;
+}
+
+void integrity_set_validator(Integrity integrity, Validator validator)
+{
+	integrity->validator = validator;
+}
+
+static size_t integrity_block_len(Integrity integrity, size_t index)
+{
+	return index == integrity->nblock - 1
+	     ? integrity->size - index * integrity->block
+	     : integrity->block;
+}
+
+// `len` bytes of whole blocks from the block boundary `pos` on
+static int integrity_check_blocks(Integrity integrity, const char *bytes,
+				  size_t pos, size_t len)
+{
+	size_t index = pos / integrity->block;
+	const uint32_t *hashes = integrity->hashes + index;
+	size_t at, block_len;
+
+	at = integrity->validator
+	   ? validator_check(integrity->validator, bytes, len,
+	   		     integrity->block, hashes)
+	   : integrity_check(bytes, len, integrity->block, hashes);
+	if (at != INTEGRITY_OK) {
+		index += at / integrity->block;
+		block_len = integrity_block_len(integrity, index);
+
+		ERROR("block %zu (context offset %zu, %zu bytes)"
+		      ": CRC32C 0x%08x, manifest 0x%08x",
+		      index, index * integrity->block, block_len,
+		      integrity_crc32c(0, bytes + at, block_len),
+		      integrity->hashes[index]);
+		return -1;
+	}
+
+	integrity->stats.verified += integrity_get_nblock(len,
+							  integrity->block);
+	integrity->stats.bytes += len;
+
+	return 0;
+}
+
+// carry the stream's hash of a block over `part` more of its bytes
+static int integrity_hash_part(Integrity integrity,
+			       struct integrity_cursor *cursor,
+			       const char *bytes, size_t pos, size_t part)
+{
+	size_t index = pos / integrity->block;
+	size_t in = pos % integrity->block;
+	size_t block_len = integrity_block_len(integrity, index);
+
+	if (in == 0) {
+		cursor->crc = 0;
+		cursor->hashing = true;
+	} else if (cursor->next != pos) {
+		if (cursor->hashing || cursor->block != index)
+			integrity->stats.skipped++;
+
+		cursor->hashing = false;
+	}
+
+	cursor->block = index;
+
+	if ( !cursor->hashing)
+		return 0;
+
+	cursor->crc = integrity_crc32c(cursor->crc, bytes, part);
+	integrity->stats.bytes += part;
+
+	if (in + part < block_len)
+		return 0;
+
+	cursor->hashing = false;
+
+	if (cursor->crc != integrity->hashes[index]) {
+		ERROR("block %zu (context offset %zu, %zu bytes)"
+		      ": CRC32C 0x%08x, manifest 0x%08x",
+		      index, index * integrity->block, block_len,
+		      cursor->crc, integrity->hashes[index]);
+		return -1;
+	}
+
+	integrity->stats.verified++;
+
+	return 0;
+}
+
+// a block is hashed as the bytes of one stream come in, and checked once
+// it is whole; the whole blocks of a piece are checked in one go. A stream
+// joining a block anywhere but where it left off leaves the block unchecked
+int integrity_update(Integrity integrity, struct integrity_cursor *cursor,
+		     const void *src, size_t pos, size_t len)
+{
+	const char *bytes = src;
+
+	if (pos > integrity->size || len > integrity->size - pos) {
+		ERROR("%zu bytes at %zu are past the %zu byte manifest",
+		      len, pos, integrity->size);
+		return -1;
+	}
+
+	while (len > 0) {
+		size_t index = pos / integrity->block;
+		size_t in = pos % integrity->block;
+		size_t block_len = integrity_block_len(integrity, index);
+		size_t part;
+		int ret;
+
+		if (in == 0 && len >= block_len) {
+			part = pos + len == integrity->size
+			     ? len : len / integrity->block * integrity->block;
+
+			ret = integrity_check_blocks(integrity, bytes,
+						     pos, part);
+			cursor->hashing = false;
+		} else {
+			part = block_len - in < len ? block_len - in : len;
+
+			ret = integrity_hash_part(integrity, cursor,
+						  bytes, pos, part);
+		}
+
+		if (ret == -1)
+			return -1;
+
+		cursor->next = pos + part;
+		bytes += part;
+		pos += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+void integrity_get_stats(Integrity integrity, struct integrity_stats *stats)
+{
+	*stats = integrity->stats;
+}
+
+void integrity_destroy(Integrity integrity)
+{
+	free(integrity->hashes);
+	free(integrity);
+}
+
+char *integrity_get_error(void)
+{
+	return error;
+}
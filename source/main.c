@@ -1,6 +1,6 @@
 #include <stdbool.h>			// bool, true, false
-#include <stdlib.h>			// exit(), EXIT_FAILURE
-#include <string.h>			// strerror()
+#include <stdlib.h>			// exit(), EXIT_FAILURE, atoi()
+#include <string.h>			// strerror(), strcmp(), memset()
 #include <errno.h>			// errno
 
 #include <sys/time.h>			// struct timeval, gettimeofday()
@@ -12,12 +12,22 @@
 
 #include "client.h"
 #include "server.h"
+#include "worker.h"
+#include "stream.h"
 #include "memory.h"
+#include "affinity.h"
+#include "cpu.h"
+#include "pattern.h"
+#include "integrity.h"
 
 #define ARRAY_SIZE(ARR) (sizeof(ARR) / sizeof(*(ARR)))
 
+#define INTEGRITY_BLOCK	(1 << 20)
+
 #define BYTES_TO_GBPS(BYTES, SECONDS)				\
 	(((double)(BYTES) * 8.0) / ((double)(SECONDS) * 1e9))
+#define PER_GB(COUNT, BYTES)					\
+	((double)(COUNT) / ((double)(BYTES) / 1e9))
 #define GET_ELAPSED(START, END)					\
 	(  ((END).tv_sec - (START).tv_sec)			\
 	 + ((END).tv_usec - (START).tv_usec) * 1e-6 )
@@ -49,7 +59,52 @@ struct {
 
 	int ntimes;
 
-	struct argument_info info[12];
+	int token_batch;
+	int token_timeout;
+
+	int connections;
+	bool workers;
+
+	int chunk_size;
+	int pipeline_depth;
+
+	int zerocopy_window;
+	int iov_size;
+	int dmabuf_size;
+	int tx_slots;
+
+	bool persistent;
+	int streams;
+	bool frag_list;
+
+	int credit_tokens;
+	int credit_bytes;
+
+	int rcvlowat;
+
+	bool io_uring;
+	int uring_bufs;
+
+	bool tcp_zerocopy;
+
+	int busy_poll;
+	int busy_budget;
+	bool latency;
+
+	bool dispatch;
+	bool reuseport_bpf;
+
+	bool pattern_bench;
+
+	int validate_threads;
+	char *validate_node;
+
+	bool check_stream;
+
+	int integrity_block;
+	int manifest_port;
+
+	struct argument_info info[42];
 } static arguments = { .info = {
 	{	"bind-address", "a", "IP address to bind",
 		(ArgumentValue *) &arguments.bind_address,
@@ -87,6 +142,96 @@ struct {
 	}, {	"num-queue", "n", "Number of queue",
 		(ArgumentValue *) &arguments.num_queue,
 		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"token-batch", "t", "Frag tokens to release at once",
+		(ArgumentValue *) &arguments.token_batch,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"token-timeout", "T", "Max microseconds to hold a token",
+		(ArgumentValue *) &arguments.token_timeout,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"connections", "c", "Serve N connections at once with epoll",
+		(ArgumentValue *) &arguments.connections,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"workers", "w", "Run one server thread per RX queue",
+		(ArgumentValue *) &arguments.workers,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"chunk-size", "C", "Bytes per pipelined TCP copy",
+		(ArgumentValue *) &arguments.chunk_size,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"pipeline-depth", "D", "Staging buffers in flight (TCP)",
+		(ArgumentValue *) &arguments.pipeline_depth,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"zerocopy-window", "Z", "Zerocopy sends in flight (devmem TX, io_uring TX)",
+		(ArgumentValue *) &arguments.zerocopy_window,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"iov-size", "z", "Bytes per iovec entry (devmem TX) or SEND_ZC (io_uring TX)",
+		(ArgumentValue *) &arguments.iov_size,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"dmabuf-size", "B", "Half size of the GPU-DMA buffer (default: buffer-size)",
+		(ArgumentValue *) &arguments.dmabuf_size,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"tx-slots", "S", "GPU-DMA buffer slots staged ahead (devmem TX)",
+		(ArgumentValue *) &arguments.tx_slots,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"persistent", "k", "Send all N messages over one connection",
+		(ArgumentValue *) &arguments.persistent,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"streams", "m", "Stripe the buffer over N parallel connections",
+		(ArgumentValue *) &arguments.streams,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"frag-list", "L", "Hand devmem data out as frags, copy on demand",
+		(ArgumentValue *) &arguments.frag_list,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"credit-tokens", "K", "Max frag tokens held before recv stalls",
+		(ArgumentValue *) &arguments.credit_tokens,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"credit-bytes", "M", "Max frag bytes held before recv stalls",
+		(ArgumentValue *) &arguments.credit_bytes,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"rcvlowat", "l", "SO_RCVLOWAT of accepted sockets",
+		(ArgumentValue *) &arguments.rcvlowat,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"io-uring", "u", "Use io_uring for TCP (multishot recv, SEND_ZC)",
+		(ArgumentValue *) &arguments.io_uring,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"uring-bufs", "U", "Provided buffers in the io_uring ring (power of two)",
+		(ArgumentValue *) &arguments.uring_bufs,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"tcp-zerocopy", "x", "Receive TCP with TCP_ZEROCOPY_RECEIVE (mmap)",
+		(ArgumentValue *) &arguments.tcp_zerocopy,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"busy-poll", "e", "Busy poll receives for N us (SO_BUSY_POLL)",
+		(ArgumentValue *) &arguments.busy_poll,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"busy-budget", "E", "Packets per busy poll (SO_BUSY_POLL_BUDGET)",
+		(ArgumentValue *) &arguments.busy_budget,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"latency", "o", "Ack every message and report its round trip",
+		(ArgumentValue *) &arguments.latency,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"dispatch", "g", "Hand connections to the worker on their RX CPU",
+		(ArgumentValue *) &arguments.dispatch,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"reuseport-bpf", "R", "Steer SYNs to workers by CPU (implies -g)",
+		(ArgumentValue *) &arguments.reuseport_bpf,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"pattern-bench", "f", "Time the --validate kernels and exit",
+		(ArgumentValue *) &arguments.pattern_bench,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"validate-threads", "j", "Threads sharing --validate work",
+		(ArgumentValue *) &arguments.validate_threads,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"validate-node", "J", "NUMA node of them (default: NIC's, \"any\")",
+		(ArgumentValue *) &arguments.validate_node,
+		ARGUMENT_PARSER_TYPE_STRING
+	}, {	"check-stream", "V", "Check every fragment on arrival (server)",
+		(ArgumentValue *) &arguments.check_stream,
+		ARGUMENT_PARSER_TYPE_FLAG
+	}, {	"manifest-port", "O", "Exchange a CRC32C block manifest on this port",
+		(ArgumentValue *) &arguments.manifest_port,
+		ARGUMENT_PARSER_TYPE_INTEGER
+	}, {	"integrity-block", "I", "Bytes per manifest block (default 1 MiB)",
+		(ArgumentValue *) &arguments.integrity_block,
+		ARGUMENT_PARSER_TYPE_INTEGER
 	}
 }};
 
@@ -108,36 +253,324 @@ static void parse_argument(ArgumentParser parser, int argc, char *argv[])
 	INFO("do_validation: %s", arguments.do_validation ? "true" : "false");
 
 	INFO("server: %s", arguments.server ? "Server" : "Client");
+	if (arguments.server && arguments.connections > 0)
+		INFO("connections: %d", arguments.connections);
+	if (arguments.server)
+		INFO("workers: %s", arguments.workers ? "true" : "false");
+	if (arguments.server && arguments.workers)
+		INFO("dispatch: %s", arguments.reuseport_bpf ? "reuseport bpf"
+				   : arguments.dispatch ? "incoming cpu"
+				   : "none");
+	INFO("persistent: %s", arguments.persistent ? "true" : "false");
+	INFO("latency: %s", arguments.latency ? "true" : "false");
+	if (arguments.busy_poll > 0) {
+		INFO("busy poll: %d us", arguments.busy_poll);
+		if (arguments.busy_budget > 0)
+			INFO("busy poll budget: %d", arguments.busy_budget);
+	}
+	if (!arguments.server && arguments.streams > 1)
+		INFO("streams: %d", arguments.streams);
 	if (!arguments.server) {
 		INFO("connect-address: %s", arguments.address);
 		INFO("connect-port: %d", arguments.port);
 	}
 
 	INFO("devmem-tcp: %s", arguments.devmem_tcp ? "true" : "false");
+	if (arguments.server)
+		INFO("tcp-zerocopy: %s",
+		     arguments.tcp_zerocopy ? "true" : "false");
+	if (arguments.server && arguments.io_uring)
+		INFO("io_uring buffers: %d", arguments.uring_bufs > 0
+					     ? arguments.uring_bufs : 64);
+	if (!arguments.server && arguments.io_uring) {
+		INFO("io_uring sends in flight: %d",
+		     arguments.zerocopy_window > 0 ? arguments.zerocopy_window
+		     				   : 64);
+		INFO("io_uring send size: %d", arguments.iov_size > 0
+					       ? arguments.iov_size : 65536);
+	}
+	if (!arguments.devmem_tcp && arguments.pipeline_depth > 0) {
+		INFO("chunk size: %d", arguments.chunk_size);
+		INFO("pipeline depth: %d", arguments.pipeline_depth);
+	}
 	if (arguments.devmem_tcp) {
 		INFO("interface: %s", arguments.interface);
 		INFO("queue index: %d", arguments.queue_idx);
 		INFO("number of queue: %d", arguments.num_queue);
+		if (arguments.dmabuf_size > 0)
+			INFO("dmabuf size: %d", arguments.dmabuf_size);
+		if (!arguments.server && arguments.zerocopy_window > 0)
+			INFO("zerocopy window: %d", arguments.zerocopy_window);
+		if (!arguments.server && arguments.iov_size > 0)
+			INFO("iov size: %d", arguments.iov_size);
+		if (!arguments.server)
+			INFO("tx slots: %d", arguments.tx_slots > 0
+					     ? arguments.tx_slots : 2);
+		if (arguments.server)
+			INFO("frag list: %s",
+			     arguments.frag_list ? "true" : "false");
+		if (arguments.server && arguments.token_batch > 0) {
+			INFO("token batch: %d", arguments.token_batch);
+			INFO("token timeout: %d us", arguments.token_timeout);
+		}
+		if (arguments.server && arguments.credit_tokens > 0)
+			INFO("credit tokens: %d", arguments.credit_tokens);
+		if (arguments.server && arguments.credit_bytes > 0)
+			INFO("credit bytes: %d", arguments.credit_bytes);
+		if (arguments.server && arguments.rcvlowat > 0)
+			INFO("rcvlowat: %d", arguments.rcvlowat);
 	}
+
+	// the ack is sent per framed message
+	if (arguments.latency && !arguments.persistent)
+		ERROR("--latency needs --persistent");
+
+	if ((arguments.dispatch || arguments.reuseport_bpf)
+	 && !(arguments.server && arguments.workers))
+		ERROR("--dispatch and --reuseport-bpf need --server --workers");
+}
+
+static void log_layout(char *who, int queue, struct affinity_layout *layout)
+{
+	INFO("%s: queue %d on cpu %d, copy on cpu %d, NIC on node %d%s",
+	     who, queue, layout->io, layout->copy, layout->node,
+	     layout->spread ? " (no queue IRQ, spread over the node)" : "");
+}
+
+// pin the calling thread onto the CPU taking `queue`'s interrupts
+static void pin_to_queue(char *who, char *interface, int queue,
+			 struct affinity_layout *layout)
+{
+	*layout = (struct affinity_layout) { -1, -1, -1, false };
+
+	if (interface == NULL)
+		return;
+
+	if (affinity_get_layout(interface, queue, layout) == -1
+	 || affinity_pin(layout->io) == -1) {
+		WARN("%s: not pinned: %s", who, affinity_get_error());
+		layout->io = layout->copy = -1;
+		return;
+	}
+
+	log_layout(who, queue, layout);
+}
+
+// client: hash whatever the context holds and hand the server its manifest
+static void push_manifest(Memory context, size_t size,
+			  char *bind_addr, char *address)
+{
+	uint32_t *hashes;
+	size_t block, nblock;
+
+	block = arguments.integrity_block > 0 ? arguments.integrity_block
+					      : INTEGRITY_BLOCK;
+	nblock = integrity_get_nblock(size, block);
+
+	hashes = malloc(sizeof(uint32_t) * nblock);
+	if (hashes == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	if (memory_hash(context, size, block, hashes) == -1)
+		ERROR("failed to memory_hash(): %s", memory_get_error());
+
+	if (integrity_push_manifest(bind_addr, address, arguments.manifest_port,
+				    size, block, hashes) == -1)
+		ERROR("failed to integrity_push_manifest(): %s",
+		      integrity_get_error());
+
+	INFO("manifest: %zu blocks of %zu bytes", nblock, block);
+
+	free(hashes);
 }
 
-static void do_server(Memory context, size_t size, Memory dmabuf, char *address, int port)
+// server: one tracker per receiving server, all from the client's manifest
+static Integrity *accept_manifest(char *bind_addr, size_t size, int count)
+{
+	Integrity *trackers;
+	uint32_t *hashes;
+	size_t block;
+
+	INFO("wait for the manifest on port %d", arguments.manifest_port);
+	if (integrity_accept_manifest(bind_addr, arguments.manifest_port,
+				      size, &block, &hashes) == -1)
+		ERROR("failed to integrity_accept_manifest(): %s",
+		      integrity_get_error());
+
+	trackers = malloc(sizeof(Integrity) * count);
+	if (trackers == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	for (int i = 0; i < count; i++) {
+		trackers[i] = integrity_create(size, block, hashes);
+		if (trackers[i] == NULL)
+			ERROR("failed to integrity_create(): %s",
+			      integrity_get_error());
+
+		// whole blocks of large pieces go over the validation threads
+		integrity_set_validator(trackers[i], memory_get_validator());
+	}
+
+	INFO("manifest: %zu blocks of %zu bytes",
+	     integrity_get_nblock(size, block), block);
+
+	free(hashes);
+
+	return trackers;
+}
+
+static void report_integrity(Integrity *trackers, int count)
+{
+	struct integrity_stats stats, total = { 0 };
+
+	for (int i = 0; i < count; i++) {
+		integrity_get_stats(trackers[i], &stats);
+
+		total.verified += stats.verified;
+		total.skipped += stats.skipped;
+		total.bytes += stats.bytes;
+
+		integrity_destroy(trackers[i]);
+	}
+
+	INFO("manifest blocks: %zu verified, %zu out of order (unchecked), "
+	     "%zu bytes hashed", total.verified, total.skipped, total.bytes);
+
+	free(trackers);
+}
+
+static void do_server(Memory context, size_t size, Memory dmabuf,
+		      char *address, int port, char *interface)
 {
 	Server server;
+	struct server_stats stats;
+	struct server_conn_stats *conn_total;
+	struct affinity_layout layout;
 	struct timeval start, end;
+	Integrity *trackers;
+	int nrun;
+
+	// before the setup, so the buffers are first touched on the NIC's node
+	pin_to_queue("server", interface, arguments.queue_idx, &layout);
 
 	INFO("setup server");
 	server = server_setup(context, size, address, port);
 	if (server == NULL)
 		ERROR("failed to server_setup(): %s", server_get_error());
 
+	if (arguments.token_batch > 0)
+		if (server_set_token_release(server, arguments.token_batch,
+					     arguments.token_timeout) == -1)
+			ERROR("failed to server_set_token_release(): %s",
+			      server_get_error());
+
+	if (dmabuf == NULL && arguments.pipeline_depth > 0) {
+		if (server_set_pipeline(server, arguments.chunk_size,
+					arguments.pipeline_depth) == -1)
+			ERROR("failed to server_set_pipeline(): %s",
+			      server_get_error());
+
+		if (layout.copy != -1
+		 && server_pin_pipeline(server, layout.copy) == -1)
+			WARN("copy thread not pinned: %s", server_get_error());
+	}
+
+	server_set_persistent(server, arguments.persistent);
+	server_set_credit(server, arguments.credit_tokens,
+			  arguments.credit_bytes);
+	server_set_rcvlowat(server, arguments.rcvlowat);
+	server_set_busy_poll(server, arguments.busy_poll,
+			     arguments.busy_budget);
+	server_set_latency(server, arguments.latency);
+
+	if (server_set_check(server, arguments.check_stream) == -1)
+		ERROR("failed to server_set_check(): %s", server_get_error());
+
+	trackers = NULL;
+	if (arguments.manifest_port > 0) {
+		trackers = accept_manifest(address, size, 1);
+
+		if (server_set_integrity(server, trackers[0]) == -1)
+			ERROR("failed to server_set_integrity(): %s",
+			      server_get_error());
+	}
+
+	if (arguments.io_uring) {
+		if (dmabuf != NULL || arguments.connections > 0
+		 || arguments.persistent)
+			ERROR("io_uring engine runs plain TCP, one connection "
+			      "per message");
+
+		if (server_set_uring(server, arguments.uring_bufs) == -1)
+			ERROR("failed to server_set_uring(): %s",
+			      server_get_error());
+	}
+
+	if (arguments.tcp_zerocopy)
+		if (dmabuf != NULL || arguments.connections > 0
+		 || arguments.persistent || arguments.io_uring)
+			ERROR("TCP_ZEROCOPY_RECEIVE runs plain TCP, one "
+			      "connection per message");
+
+	conn_total = calloc(arguments.connections + 1,
+		     	    sizeof(struct server_conn_stats));
+	if (conn_total == NULL)
+		ERROR("failed to calloc(): %s", strerror(errno));
+
+	// kept connections carry every message in one pass of the event loop
+	nrun = arguments.persistent && arguments.connections > 0
+	     ? 1 : arguments.ntimes;
+
 	INFO("start server");
 	gettimeofday(&start, NULL);
-	for (int i = 0; i < arguments.ntimes; i++) {
-		if (dmabuf == NULL) {
+	for (int i = 0; i < nrun; i++) {
+		if (arguments.connections > 0) {
+			const struct server_conn_stats *conn_stats;
+			int nconn;
+
+			if (server_run_event_loop(server, dmabuf,
+			     			  arguments.connections) == -1)
+				ERROR("failed to server_run_event_loop(): %s",
+				      server_get_error());
+
+			conn_stats = server_get_conn_stats(server, &nconn);
+			for (int j = 0; j < nconn; j++) {
+				conn_total[j].bytes += conn_stats[j].bytes;
+				conn_total[j].elapsed += conn_stats[j].elapsed;
+			}
+		} else if (arguments.io_uring) {
+			if (server_run_as_uring(server) == -1)
+				ERROR("failed to server_run_as_uring(): %s",
+				      server_get_error());
+		} else if (arguments.tcp_zerocopy) {
+			if (server_run_as_zerocopy(server) == -1)
+				ERROR("failed to server_run_as_zerocopy(): %s",
+				      server_get_error());
+		} else if (dmabuf == NULL) {
 			if (server_run_as_tcp(server) == -1)
 				ERROR("failed to server_run_as_tcp(): %s",
 				      server_get_error());
+		} else if (arguments.frag_list) {
+			struct server_message message;
+
+			// the credit may cut a message into several pieces
+			do {
+				if (server_recv_dma_frags(server, dmabuf,
+							  &message) == -1)
+					ERROR("failed to server_recv_dma_frags(): %s",
+					      server_get_error());
+
+				// only validation needs the data in one piece
+				if (arguments.do_validation)
+					if (server_materialize(server, dmabuf,
+							       &message) == -1)
+						ERROR("failed to server_materialize(): %s",
+						      server_get_error());
+
+				if (server_release(server) == -1)
+					ERROR("failed to server_release(): %s",
+					      server_get_error());
+			} while (message.more);
 		} else {
 			if (server_run_as_dma(server, dmabuf) == -1)
 				ERROR("failed to server_run_as_dma(): %s",
@@ -150,16 +583,461 @@ static void do_server(Memory context, size_t size, Memory dmabuf, char *address,
 				      memory_get_error());
 	}
 	gettimeofday(&end, NULL);
+
+	server_get_stats(server, &stats);
 	
 	INFO("Elapsed time: %.6f seconds", GET_ELAPSED(start, end));
-	INFO("Total recieved: %.lf", (double) arguments.ntimes 
-      					    * arguments.buffer_size);
+	INFO("Total recieved: %zu", stats.bytes);
 	INFO("Bandwidth: %.6f Gbps",
-      	     BYTES_TO_GBPS((double) arguments.ntimes * arguments.buffer_size,
-	     GET_ELAPSED(start, end)));
+      	     BYTES_TO_GBPS(stats.bytes, GET_ELAPSED(start, end)));
+
+	for (int i = 0; i < arguments.connections; i++)
+		INFO("connection %d: %zu bytes, %.6f Gbps", i,
+		     conn_total[i].bytes,
+		     BYTES_TO_GBPS(conn_total[i].bytes, conn_total[i].elapsed));
+
+	free(conn_total);
+
+	INFO("messages: %zu, recv calls: %zu (%.2f per GB)", stats.messages,
+	     stats.recvs, PER_GB(stats.recvs, stats.bytes));
+	if (arguments.io_uring)
+		INFO("io_uring_enter calls: %zu (%.2f per GB)",
+		     stats.enters, PER_GB(stats.enters, stats.bytes));
+	if (arguments.tcp_zerocopy)
+		INFO("zero-copy received: %zu bytes (%.2f%%)", stats.zerocopy,
+		     stats.bytes ? stats.zerocopy * 100.0 / stats.bytes : 0.0);
+	if (arguments.busy_poll > 0)
+		INFO("busy-poll receives that found nothing: %zu", stats.spins);
+	if (arguments.check_stream)
+		INFO("checked on arrival: %zu bytes", stats.checked);
+	if (dmabuf != NULL) {
+		INFO("frags: %zu gathered in %zu copies",
+		     stats.frags, stats.copies);
+		INFO("tokens released: %zu in %zu ranges",
+		     stats.tokens, stats.ranges);
+		INFO("SO_DEVMEM_DONTNEED calls: %zu (%.2f per GB)",
+		     stats.dontneed, PER_GB(stats.dontneed, stats.bytes));
+		INFO("peak held: %zu tokens, %zu bytes",
+		     stats.peak_tokens, stats.peak_bytes);
+		INFO("throttled: %zu times, %.6f seconds",
+		     stats.throttles, stats.throttled);
+		INFO("frags per recvmsg: %.2f, control full: %zu (room for %zu)",
+		     stats.recvs ? (double) stats.frags / stats.recvs : 0.0,
+		     stats.ctrl_full, stats.ctrl_frags);
+		INFO("syscalls: %.2f per GB",
+		     PER_GB(stats.recvs + stats.dontneed, stats.bytes));
+	}
 
 	INFO("cleanup server");
 	server_cleanup(server);
+
+	if (trackers)
+		report_integrity(trackers, 1);
+}
+
+static void do_workers(Memory context, size_t size, Memory dmabuf,
+		       char *address, int port, char *interface)
+{
+	WorkerPool pool;
+	struct server_stats stats, total;
+	struct timeval start, end;
+	struct affinity_layout layout;
+	Integrity *trackers;
+	int nworker, nconn, nrun;
+	int *cpus;
+
+	if (arguments.io_uring || arguments.tcp_zerocopy)
+		ERROR("io_uring and TCP_ZEROCOPY_RECEIVE do not run in workers");
+
+	nworker = arguments.num_queue > 0 ? arguments.num_queue : 1;
+	nconn = arguments.connections > 0 ? arguments.connections : nworker;
+
+	cpus = malloc(sizeof(int) * nworker);
+	if (cpus == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	for (int i = 0; i < nworker; i++) {
+		int queue = arguments.queue_idx + i;
+
+		if (affinity_get_layout(interface, queue, &layout) == -1)
+			WARN("worker %d: not pinned: %s",
+			     i, affinity_get_error());
+		else
+			log_layout("worker", queue, &layout);
+
+		cpus[i] = layout.io;
+	}
+
+	INFO("setup %d workers", nworker);
+	pool = worker_pool_create(context, size, address, port, nworker, cpus);
+	if (pool == NULL)
+		ERROR("failed to worker_pool_create(): %s", worker_get_error());
+
+	free(cpus);
+
+	if (arguments.dispatch || arguments.reuseport_bpf)
+		if (worker_pool_set_dispatch(pool,
+					     arguments.reuseport_bpf) == -1)
+			ERROR("failed to worker_pool_set_dispatch(): %s",
+			      worker_get_error());
+
+	if (arguments.token_batch > 0)
+		for (int i = 0; i < nworker; i++)
+			if (server_set_token_release(
+				worker_pool_get_server(pool, i),
+				arguments.token_batch,
+				arguments.token_timeout) == -1)
+				ERROR("failed to server_set_token_release(): %s",
+				      server_get_error());
+
+	for (int i = 0; i < nworker; i++) {
+		Server server = worker_pool_get_server(pool, i);
+
+		server_set_persistent(server, arguments.persistent);
+		server_set_credit(server, arguments.credit_tokens,
+				  arguments.credit_bytes);
+		server_set_rcvlowat(server, arguments.rcvlowat);
+		server_set_busy_poll(server, arguments.busy_poll,
+				     arguments.busy_budget);
+		server_set_latency(server, arguments.latency);
+
+		if (server_set_check(server, arguments.check_stream) == -1)
+			ERROR("failed to server_set_check(): %s",
+			      server_get_error());
+	}
+
+	trackers = NULL;
+	if (arguments.manifest_port > 0) {
+		trackers = accept_manifest(address, size, nworker);
+
+		for (int i = 0; i < nworker; i++)
+			if (server_set_integrity(
+				worker_pool_get_server(pool, i),
+				trackers[i]) == -1)
+				ERROR("failed to server_set_integrity(): %s",
+				      server_get_error());
+	}
+
+	nrun = arguments.persistent ? 1 : arguments.ntimes;
+
+	INFO("start workers");
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < nrun; i++) {
+		if (worker_pool_run(pool, dmabuf, nconn) == -1)
+			ERROR("failed to worker_pool_run(): %s",
+			      worker_get_error());
+
+		if (arguments.do_validation)
+			if (memory_validate(context, size) == -1)
+				ERROR("failed to memory validation: %s",
+				      memory_get_error());
+	}
+	gettimeofday(&end, NULL);
+
+	total = (struct server_stats) { 0 };
+	for (int i = 0; i < nworker; i++) {
+		server_get_stats(worker_pool_get_server(pool, i), &stats);
+
+		INFO("worker %d: %zu bytes, %.6f Gbps", i, stats.bytes,
+		     BYTES_TO_GBPS(stats.bytes, GET_ELAPSED(start, end)));
+		if (arguments.dispatch || arguments.reuseport_bpf)
+			INFO("worker %d: %zu of %zu accepts on its cpu "
+			     "(%.1f%%), %zu handed off, %zu adopted",
+			     i, stats.local, stats.accepts,
+			     stats.accepts ? 100.0 * stats.local
+					     / stats.accepts : 0.0,
+			     stats.handoffs, stats.adopted);
+
+		total.bytes += stats.bytes;
+		total.recvs += stats.recvs;
+		total.frags += stats.frags;
+		total.copies += stats.copies;
+		total.dontneed += stats.dontneed;
+		total.tokens += stats.tokens;
+		total.ranges += stats.ranges;
+		total.messages += stats.messages;
+
+		// every worker has its own queue, so its own page pool
+		if (stats.peak_tokens > total.peak_tokens)
+			total.peak_tokens = stats.peak_tokens;
+		if (stats.peak_bytes > total.peak_bytes)
+			total.peak_bytes = stats.peak_bytes;
+		total.throttles += stats.throttles;
+		total.throttled += stats.throttled;
+
+		total.ctrl_full += stats.ctrl_full;
+		if (stats.ctrl_frags > total.ctrl_frags)
+			total.ctrl_frags = stats.ctrl_frags;
+
+		total.checked += stats.checked;
+
+		total.accepts += stats.accepts;
+		total.local += stats.local;
+		total.handoffs += stats.handoffs;
+	}
+
+	INFO("Elapsed time: %.6f seconds", GET_ELAPSED(start, end));
+	INFO("Total recieved: %zu", total.bytes);
+	INFO("Bandwidth: %.6f Gbps",
+	     BYTES_TO_GBPS(total.bytes, GET_ELAPSED(start, end)));
+
+	INFO("recv calls: %zu (%.2f per GB)",
+	     total.recvs, PER_GB(total.recvs, total.bytes));
+	if (arguments.check_stream)
+		INFO("checked on arrival: %zu bytes", total.checked);
+	if (arguments.dispatch || arguments.reuseport_bpf)
+		INFO("locality: %.1f%% of accepts on the worker's cpu, "
+		     "%zu handed off",
+		     total.accepts ? 100.0 * total.local / total.accepts : 0.0,
+		     total.handoffs);
+	if (dmabuf != NULL) {
+		INFO("frags: %zu gathered in %zu copies",
+		     total.frags, total.copies);
+		INFO("tokens released: %zu in %zu ranges",
+		     total.tokens, total.ranges);
+		INFO("SO_DEVMEM_DONTNEED calls: %zu (%.2f per GB)",
+		     total.dontneed, PER_GB(total.dontneed, total.bytes));
+		INFO("peak held per worker: %zu tokens, %zu bytes",
+		     total.peak_tokens, total.peak_bytes);
+		INFO("throttled: %zu times, %.6f seconds",
+		     total.throttles, total.throttled);
+		INFO("frags per recvmsg: %.2f, control full: %zu (room for %zu)",
+		     total.recvs ? (double) total.frags / total.recvs : 0.0,
+		     total.ctrl_full, total.ctrl_frags);
+		INFO("syscalls: %.2f per GB",
+		     PER_GB(total.recvs + total.dontneed, total.bytes));
+	}
+
+	INFO("cleanup workers");
+	worker_pool_destroy(pool);
+
+	if (trackers)
+		report_integrity(trackers, nworker);
+}
+
+// two halves by default, so the TX path can stage one while sending the other
+static size_t get_dmabuf_size(void)
+{
+	size_t size;
+
+	size = arguments.dmabuf_size > 0 ? arguments.dmabuf_size
+					 : arguments.buffer_size;
+
+	return size * 2;
+}
+
+static void do_streams(Memory context, size_t size, Memory dmabuf,
+		       char *bind_addr, int bind_port,
+		       char *address, int port,
+		       char *interface, int dmabuf_id)
+{
+	StreamPool pool;
+	struct client_stats stats;
+	struct timeval start, end;
+	size_t region, total;
+	struct affinity_layout *layouts;
+	int nstream;
+	int *cpus;
+	int ret;
+
+	nstream = arguments.streams;
+
+	cpus = malloc(sizeof(int) * nstream);
+	layouts = malloc(sizeof(struct affinity_layout) * nstream);
+	if (cpus == NULL || layouts == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	// XPS follows the CPU, so this also spreads the streams over TX queues
+	for (int i = 0; i < nstream; i++) {
+		int queue = arguments.queue_idx + i;
+
+		if (interface == NULL
+		 || affinity_get_layout(interface, queue, &layouts[i]) == -1)
+			layouts[i] = (struct affinity_layout) {
+				-1, -1, -1, false
+			};
+		else
+			log_layout("stream", queue, &layouts[i]);
+
+		cpus[i] = layouts[i].io;
+	}
+
+	INFO("setup %d streams", nstream);
+	pool = stream_pool_create(context, size, bind_addr, bind_port,
+				  nstream, cpus);
+	if (pool == NULL)
+		ERROR("failed to stream_pool_create(): %s", stream_get_error());
+
+	free(cpus);
+
+	// every stream stages into its own share of the GPU-DMA buffer
+	region = get_dmabuf_size() / nstream;
+	for (int i = 0; i < nstream; i++) {
+		Client client = stream_pool_get_client(pool, i);
+
+		if (arguments.zerocopy_window > 0)
+			client_set_zerocopy_window(client,
+						   arguments.zerocopy_window);
+
+		if (dmabuf == NULL && arguments.pipeline_depth > 0) {
+			if (client_set_pipeline(client, arguments.chunk_size,
+						arguments.pipeline_depth) == -1)
+				ERROR("failed to client_set_pipeline(): %s",
+				      client_get_error());
+
+			if (layouts[i].copy != -1
+			 && client_pin_pipeline(client, layouts[i].copy) == -1)
+				WARN("stream %d: copy thread not pinned: %s",
+				     i, client_get_error());
+		}
+
+		if (dmabuf == NULL)
+			continue;
+
+		client_set_dma_segment(client, arguments.iov_size,
+				       region * i, region);
+
+		ret = client_set_dma_slots(client, arguments.tx_slots > 0
+						   ? arguments.tx_slots : 2);
+		if (ret == -1)
+			ERROR("failed to client_set_dma_slots(): %s",
+			      client_get_error());
+	}
+
+	// the receiver checks the same pattern on arrival
+	if (arguments.do_validation || arguments.check_stream)
+		memory_initialize(context, size);
+
+	if (arguments.manifest_port > 0)
+		push_manifest(context, size, bind_addr, address);
+
+	INFO("start streams");
+	gettimeofday(&start, NULL);
+	if (stream_pool_run(pool, dmabuf, address, port,
+			    interface, dmabuf_id, arguments.ntimes) == -1)
+		ERROR("failed to stream_pool_run(): %s", stream_get_error());
+	gettimeofday(&end, NULL);
+
+	total = 0;
+	for (int i = 0; i < nstream; i++) {
+		client_get_stats(stream_pool_get_client(pool, i), &stats);
+
+		INFO("stream %d: %zu bytes, %.6f Gbps", i, stats.bytes,
+		     BYTES_TO_GBPS(stats.bytes,
+				   stream_pool_get_elapsed(pool, i)));
+
+		total += stats.bytes;
+	}
+
+	INFO("Elapsed time: %.6lf seconds", GET_ELAPSED(start, end));
+	INFO("Total sent: %zu", total);
+	INFO("Bandwidth: %.6lf Gbps",
+	     BYTES_TO_GBPS(total, GET_ELAPSED(start, end)));
+
+	INFO("cleanup streams");
+	stream_pool_destroy(pool);
+
+	free(layouts);
+}
+
+static void setup_validator(void)
+{
+	int node;
+
+	// next to the NIC, where the received data was written
+	if (arguments.validate_node == NULL)
+		node = arguments.interface
+		     ? affinity_get_numa_node(arguments.interface) : -1;
+	else if (strcmp(arguments.validate_node, "any") == 0)
+		node = -1;
+	else
+		node = atoi(arguments.validate_node);
+
+	if (memory_set_validator(arguments.validate_threads, node) == -1)
+		ERROR("failed to memory_set_validator(): %s",
+		      memory_get_error());
+
+	if (node == -1)
+		INFO("validation: %d threads", arguments.validate_threads);
+	else
+		INFO("validation: %d threads on node %d",
+		     arguments.validate_threads, node);
+}
+
+// fill and verify `size` host bytes `ntimes` over with every kernel
+static void do_pattern_bench(size_t size, int ntimes)
+{
+	const struct pattern_kernel *kernels;
+	struct timeval start, mid, end;
+	PatternPeriod period;
+	char *buffer;
+	int nkernel;
+
+	buffer = malloc(size);
+	if (buffer == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	// fault the pages in before anything is timed
+	memset(buffer, 0, size);
+
+	period = pattern_get_standard();
+	kernels = pattern_get_kernels(&nkernel);
+	for (int k = 0; k < nkernel; k++) {
+		gettimeofday(&start, NULL);
+		for (int i = 0; i < ntimes; i++)
+			kernels[k].fill(period, buffer, 0, size);
+		gettimeofday(&mid, NULL);
+		for (int i = 0; i < ntimes; i++)
+			if (kernels[k].verify(period, buffer, 0, size)
+			    != PATTERN_OK)
+				ERROR("%s: verify failed", kernels[k].name);
+		gettimeofday(&end, NULL);
+
+		INFO("%-8s fill: %.2f GB/s, verify: %.2f GB/s",
+		     kernels[k].name,
+		     (double) size * ntimes / 1e9 / GET_ELAPSED(start, mid),
+		     (double) size * ntimes / 1e9 / GET_ELAPSED(mid, end));
+	}
+
+	INFO("--validate uses %s", kernels[nkernel - 1].name);
+
+	free(buffer);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report_latency(Client client)
+{
+	const double *latencies;
+	double *sorted, sum;
+	size_t count;
+
+	latencies = client_get_latencies(client, &count);
+	if (count == 0)
+		return;
+
+	sorted = malloc(sizeof(double) * count);
+	if (sorted == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	memcpy(sorted, latencies, sizeof(double) * count);
+	qsort(sorted, count, sizeof(double), compare_double);
+
+	sum = 0;
+	for (size_t i = 0; i < count; i++)
+		sum += sorted[i];
+
+	INFO("message latency (us): p50 %.2f, p99 %.2f, mean %.2f, max %.2f",
+	     sorted[(count - 1) / 2] * 1e6,
+	     sorted[(size_t) ((count - 1) * 0.99)] * 1e6,
+	     sum / count * 1e6, sorted[count - 1] * 1e6);
+
+	free(sorted);
 }
 
 static void do_client(Memory context, size_t size, Memory dmabuf,
@@ -168,17 +1046,78 @@ static void do_client(Memory context, size_t size, Memory dmabuf,
 		      char *interface, int dmabuf_id)
 {
 	Client client;
+	CpuMeter meter;
+	struct client_stats stats;
+	struct cpu_usage usage;
+	struct affinity_layout layout;
 	struct timeval start, end;
+	double total;
+	int ret;
+
+	pin_to_queue("client", interface, arguments.queue_idx, &layout);
+
+	// before the client starts any thread, so its cycles are counted too
+	meter = cpu_meter_create();
+	if (meter == NULL)
+		ERROR("failed to cpu_meter_create(): %s", cpu_get_error());
 
 	INFO("setup client");
 	client = client_setup(context, size, bind_addr, bind_port);
 	if (client == NULL)
 		ERROR("failed to client_setup(): %s", client_get_error());
 
-	if (arguments.do_validation)
+	if (dmabuf == NULL && arguments.pipeline_depth > 0) {
+		if (client_set_pipeline(client, arguments.chunk_size,
+					arguments.pipeline_depth) == -1)
+			ERROR("failed to client_set_pipeline(): %s",
+			      client_get_error());
+
+		if (layout.copy != -1
+		 && client_pin_pipeline(client, layout.copy) == -1)
+			WARN("copy thread not pinned: %s", client_get_error());
+	}
+
+	if (arguments.zerocopy_window > 0)
+		client_set_zerocopy_window(client, arguments.zerocopy_window);
+
+	if (arguments.io_uring) {
+		if (dmabuf != NULL || arguments.pipeline_depth > 0)
+			ERROR("io_uring engine sends from the host staging "
+			      "buffer, without a pipeline");
+
+		if (client_set_uring(client, arguments.zerocopy_window,
+				     arguments.iov_size) == -1)
+			ERROR("failed to client_set_uring(): %s",
+			      client_get_error());
+	}
+
+	client_set_persistent(client, arguments.persistent);
+	client_set_busy_poll(client, arguments.busy_poll,
+			     arguments.busy_budget);
+	client_set_latency(client, arguments.latency);
+
+	if (dmabuf != NULL) {
+		client_set_dma_segment(client, arguments.iov_size,
+				       0, get_dmabuf_size());
+
+		ret = client_set_dma_slots(client, arguments.tx_slots > 0
+						   ? arguments.tx_slots : 2);
+		if (ret == -1)
+			ERROR("failed to client_set_dma_slots(): %s",
+			      client_get_error());
+	}
+
+	// the receiver checks the same pattern on arrival
+	if (arguments.do_validation || arguments.check_stream)
 		memory_initialize(context, size);
 
+	if (arguments.manifest_port > 0)
+		push_manifest(context, size, bind_addr, address);
+
 	INFO("start client");
+	if (cpu_meter_start(meter) == -1)
+		ERROR("failed to cpu_meter_start(): %s", cpu_get_error());
+
 	gettimeofday(&start, NULL);
 	for (int i = 0; i < arguments.ntimes; i++) {
 		if (dmabuf == NULL) {
@@ -193,8 +1132,15 @@ static void do_client(Memory context, size_t size, Memory dmabuf,
 	  			      client_get_error());
 		}
 	}
+
+	// a kept connection is only done once its last sends complete
+	if (client_disconnect(client) == -1)
+		ERROR("failed to client_disconnect(): %s", client_get_error());
 	gettimeofday(&end, NULL);
 
+	if (cpu_meter_stop(meter, &usage) == -1)
+		ERROR("failed to cpu_meter_stop(): %s", cpu_get_error());
+
 	INFO("Elapsed time: %.6lf seconds", GET_ELAPSED(start, end));
 	INFO("Total sent: %.0lf", (double) arguments.ntimes 
       					 * arguments.buffer_size);
@@ -202,6 +1148,33 @@ static void do_client(Memory context, size_t size, Memory dmabuf,
       	     BYTES_TO_GBPS((double) arguments.ntimes * arguments.buffer_size,
 	     GET_ELAPSED(start, end)));
 
+	total = (double) arguments.ntimes * arguments.buffer_size;
+	if (usage.has_cycles)
+		INFO("CPU: %.3f cycles per byte, %.6f seconds",
+		     usage.cycles / total, usage.seconds);
+	else
+		INFO("CPU: %.3f ns per byte, %.6f seconds (no cycles: %s)",
+		     usage.seconds * 1e9 / total, usage.seconds,
+		     cpu_get_error());
+
+	cpu_meter_destroy(meter);
+
+	if (arguments.latency)
+		report_latency(client);
+
+	client_get_stats(client, &stats);
+	if (dmabuf != NULL) {
+		INFO("sendmsg calls: %zu, completed: %zu, copied: %zu",
+		     stats.sends, stats.completed, stats.copied);
+		INFO("completion notifications: %zu (%zu ranges), stalls: %zu",
+		     stats.notifications, stats.ranges, stats.stalls);
+	} else if (arguments.io_uring) {
+		INFO("SEND_ZC requests: %zu, completed: %zu, copied: %zu",
+		     stats.sends, stats.completed, stats.copied);
+		INFO("io_uring_enter calls: %zu (%.2f per GB), stalls: %zu",
+		     stats.enters, PER_GB(stats.enters, total), stats.stalls);
+	}
+
 	INFO("cleanup client");
 	client_cleanup(client);
 }
@@ -211,6 +1184,7 @@ static Memory create_dmabuf(NetdevManager ndevmgr, char *interface,
 {
 	Memory dmabuf;
 	int ifindex;
+	size_t size = get_dmabuf_size();
 
 	int ret;
 
@@ -219,13 +1193,13 @@ static Memory create_dmabuf(NetdevManager ndevmgr, char *interface,
 		ERROR("failed to if_nametoindex(): %s", strerror(errno));
 	INFO("interface index: %d", ifindex);
 
-	INFO("allocate GPU-DMA buffer: %d", arguments.buffer_size);
-	dmabuf = memory_allocate(gp, arguments.buffer_size * 2);
+	INFO("allocate GPU-DMA buffer: %zu", size);
+	dmabuf = memory_allocate(gp, size);
 	if (dmabuf == NULL)
 		ERROR("failed to memory_allocate_dmabuf(): %s",
 		      memory_get_error());
 
-	*dmabuf_fd = memory_export(gp, dmabuf, arguments.buffer_size);
+	*dmabuf_fd = memory_export(gp, dmabuf, size);
 	if (*dmabuf_fd == -1)
 		ERROR("failed to memory_export(): %s", memory_get_error());
 
@@ -292,6 +1266,16 @@ int main(int argc, char *argv[])
 	INFO("parser arguments");
 	parse_argument(parser, argc, argv);	
 
+	// host only, no NIC or GPU needed
+	if (arguments.pattern_bench) {
+		do_pattern_bench(arguments.buffer_size, arguments.ntimes);
+
+		argument_parser_destroy(parser);
+		logger_destroy();
+
+		return 0;
+	}
+
 	INFO("create netdev manager");
 	ndevmgr = ndevmgr_create();
 	if (ndevmgr == NULL)
@@ -300,6 +1284,11 @@ int main(int argc, char *argv[])
 	if (memory_init() == -1)
 		ERROR("failed to memory_init(): %s", memory_get_error());
 
+	if ((arguments.do_validation || arguments.check_stream
+	  || arguments.manifest_port > 0)
+	 && arguments.validate_threads > 1)
+		setup_validator();
+
 	INFO("allocate GPU buffer: %d", arguments.buffer_size);
 	context = memory_allocate(gp, arguments.buffer_size);
 	if (context == NULL)
@@ -317,10 +1306,21 @@ int main(int argc, char *argv[])
 		dmabuf = NULL;
 	}
 
-	if (arguments.server) {
+	if (arguments.server && arguments.workers) {
+		do_workers(context, arguments.buffer_size, dmabuf,
+			   arguments.bind_address, arguments.bind_port,
+			   arguments.interface);
+	} else if (arguments.server) {
 		do_server(context,
 	    		  arguments.buffer_size, dmabuf,
-	    		  arguments.bind_address, arguments.bind_port);
+	    		  arguments.bind_address, arguments.bind_port,
+			  arguments.interface);
+	} else if (arguments.streams > 1) {
+		do_streams(context, arguments.buffer_size,
+			   dmabuf,
+			   arguments.bind_address, arguments.bind_port,
+			   arguments.address, arguments.port,
+			   arguments.interface, dmabuf_id);
 	} else {
 		do_client(context, arguments.buffer_size,
 	    		  dmabuf,
@@ -333,6 +1333,15 @@ int main(int argc, char *argv[])
 		destroy_dmabuf(ndevmgr, dmabuf,
 		 	       arguments.server ? false : true, dmabuf_fd);
 
+	if (arguments.do_validation) {
+		struct staging_stats staging;
+
+		memory_get_staging_stats(&staging);
+		INFO("staging buffers: %zu hits, %zu misses, %zu bytes held "
+		     "in %zu buffers", staging.hits, staging.misses,
+		     staging.held, staging.buffers);
+	}
+
 	INFO("free GPU buffer");
 	if (memory_free(gp, context) == -1)
 		ERROR("failed to memory_free(): %s", memory_get_error());
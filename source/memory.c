@@ -7,12 +7,14 @@
 #include <stdio.h>	// BUFSIZ, snprintf()
 
 #include "memory_provider.h"
+#include "staging.h"
+#include "pattern.h"
+#include "validator.h"
+#include "integrity.h"
 
 #include <hsa/hsa.h>
 #include <hsa/hsa_ext_amd.h>
 
-#define SEED	10
-
 #define ERROR(...) do {				\
 	snprintf(error, BUFSIZ, __VA_ARGS__);	\
 } while (false)
@@ -20,7 +22,13 @@
 MemoryProvider gp;
 MemoryProvider hp;
 
-static char error[BUFSIZ];
+static __thread char error[BUFSIZ];
+
+// host copies of the context, kept across --ntimes iterations
+static StagingPool staging;
+
+// splits the pattern work over threads, NULL to run it on the caller
+static Validator validator;
 
 Memory memory_allocate(MemoryProvider mp, size_t size)
 {
@@ -84,71 +92,139 @@ int memory_initialize(Memory memory, size_t size)
 	Memory buffer;
 	int ret;
 
-	buffer = memory_provider_alloc(hp, size);
+	buffer = staging_pool_get(staging, size);
 	if (buffer == NULL) {
-		ERROR("failed to malloc(): %s", strerror(errno));
+		ERROR("failed to staging_pool_get(): %s", staging_get_error());
 		goto RETURN_ERROR;
 	}
 
-	for (size_t i = 0; i < size; i++)
-		((char *) buffer)[i] = i % SEED;
-
-	if (memory_provider_allow_access(hp, gp, buffer) == -1) {
-		ERROR("failed to memory_provider_allow_access(): %s",
-		      memory_provider_get_error(hp));
-		goto FREE_BUFFER;
-	}
+	if (validator)
+		validator_fill(validator, buffer, 0, size);
+	else
+		pattern_fill(buffer, 0, size);
 
 	ret = memory_provider_copy(hp, memory, buffer, size);
 	if (ret == -1) {
 		ERROR("failed to amdgpu_memory_provider->memcpy_to(): %s",
 		      memory_provider_get_error(hp));
-		goto FREE_BUFFER;
+		goto PUT_BUFFER;
 	}
 
-	if (memory_provider_free(hp, buffer) == -1) {
-		ERROR("failed to memory_provider_free(): %s",
+	// the next caller may refill the buffer right away
+	if (memory_provider_wait(hp) == -1) {
+		ERROR("failed to memory_provider_wait(): %s",
 		      memory_provider_get_error(hp));
+		goto PUT_BUFFER;
+	}
+
+	if (staging_pool_put(staging, buffer) == -1) {
+		ERROR("failed to staging_pool_put(): %s", staging_get_error());
 		goto RETURN_ERROR;
 	}
 
 	return 0;
 
-FREE_BUFFER:	memory_provider_free(hp, buffer);
+PUT_BUFFER:	(void) staging_pool_put(staging, buffer);
 RETURN_ERROR:	return -1;
 }
 
 int memory_validate(Memory memory, size_t size)
 {
 	Memory buffer;
+	size_t i;
 
-	buffer = memory_provider_alloc(hp, size);
-	if (buffer == NULL)
+	buffer = staging_pool_get(staging, size);
+	if (buffer == NULL) {
+		ERROR("failed to staging_pool_get(): %s", staging_get_error());
 		return -1;
+	}
 
-	if (memory_provider_allow_access(hp, gp, buffer) == -1)
+	if (memory_provider_copy(hp, buffer, memory, size) == -1
+	 || memory_provider_wait(hp) == -1) {
+		ERROR("failed to copy the context back: %s",
+		      memory_provider_get_error(hp));
+		(void) staging_pool_put(staging, buffer);
 		return -1;
+	}
 
-	if (memory_provider_copy(hp, buffer, memory, size) == -1) {
-		memory_provider_free(hp, buffer); 
+	i = validator ? validator_verify(validator, buffer, 0, size)
+		      : pattern_verify(buffer, 0, size);
+	if (i != PATTERN_OK) {
+		ERROR("invalid at %zu (expected %zu, but %d)",
+		      i, i % PATTERN_SEED, ((char *) buffer)[i]);
+		(void) staging_pool_put(staging, buffer);
 		return -1;
 	}
 
-	for (size_t i = 0; i < size; i++) {
-		if (((char *) buffer)[i] != i % SEED) {
-			ERROR("invalid at %zu (expected %zu, but %d)",
-			      i, i % SEED, ((char *) buffer)[i]);
-			memory_provider_free(hp, buffer);
-			return -1;
-		}
+	if (staging_pool_put(staging, buffer) == -1) {
+		ERROR("failed to staging_pool_put(): %s", staging_get_error());
+		return -1;
 	}
 
-	if (memory_provider_free(hp, buffer) == -1)
+	return 0;
+}
+
+// CRC32C of every `block` bytes of the context, for the manifest
+int memory_hash(Memory memory, size_t size, size_t block, uint32_t *hashes)
+{
+	Memory buffer;
+
+	buffer = staging_pool_get(staging, size);
+	if (buffer == NULL) {
+		ERROR("failed to staging_pool_get(): %s", staging_get_error());
+		return -1;
+	}
+
+	if (memory_provider_copy(hp, buffer, memory, size) == -1
+	 || memory_provider_wait(hp) == -1) {
+		ERROR("failed to copy the context back: %s",
+		      memory_provider_get_error(hp));
+		(void) staging_pool_put(staging, buffer);
 		return -1;
+	}
+
+	if (validator)
+		validator_hash(validator, buffer, size, block, hashes);
+	else
+		integrity_hash(buffer, size, block, hashes);
+
+	if (staging_pool_put(staging, buffer) == -1) {
+		ERROR("failed to staging_pool_put(): %s", staging_get_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+int memory_set_validator(int nthread, int node)
+{
+	Validator new_validator;
+
+	new_validator = validator_create(nthread, node);
+	if (new_validator == NULL) {
+		ERROR("failed to validator_create(): %s",
+		      validator_get_error());
+		return -1;
+	}
+
+	if (validator)
+		validator_destroy(validator);
+
+	validator = new_validator;
 
 	return 0;
 }
 
+Validator memory_get_validator(void)
+{
+	return validator;
+}
+
+void memory_get_staging_stats(struct staging_stats *stats)
+{
+	staging_pool_get_stats(staging, stats);
+}
+
 const char *memory_get_error(void)
 {
 	return error;
@@ -164,14 +240,28 @@ int memory_init(void)
 	if (hp == NULL)
 		goto DESTROY_MEMORY_PROVIDER;
 
+	staging = staging_pool_create(hp, gp);
+	if (staging == NULL) {
+		ERROR("failed to staging_pool_create(): %s",
+		      staging_get_error());
+		goto DESTROY_HOST_PROVIDER;
+	}
+
 	return 0;
 
-DESTROY_MEMORY_PROVIDER: memory_provider_destroy(hp);
+DESTROY_HOST_PROVIDER:	 memory_provider_destroy(hp);
+DESTROY_MEMORY_PROVIDER: memory_provider_destroy(gp);
 RETURN_ERR:		 return -1;
 }
 
 void memory_cleanup(void)
 {
+	if (validator)
+		validator_destroy(validator);
+
+	// buffers go back to `hp` before it is gone
+	staging_pool_destroy(staging);
+
 	memory_provider_destroy(gp);
 	memory_provider_destroy(hp);
 }
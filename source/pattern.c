@@ -0,0 +1,319 @@
+#include "pattern.h"
+
+#include <stdbool.h>	// bool, true, false
+#include <stdlib.h>	// malloc(), free()
+
+#include <pthread.h>	// pthread_once()
+
+#if defined(__x86_64__)
+#include <immintrin.h>	// _mm*_loadu_*(), _mm*_storeu_*(), ...
+#endif
+
+// a block of lcm(seed, vector width) bytes starts at the phase of the
+// block before it, so every block copies the same stretch of `table`
+#define PATTERN_SPAN(SEED)	((SEED) * 64)
+
+struct pattern_period {
+	size_t seed;
+	char *table;		// `seed` bytes of phase, then a whole span
+	size_t block16, block32, block64;
+};
+
+static char standard_table[PATTERN_SEED + PATTERN_SPAN(PATTERN_SEED)];
+static struct pattern_period standard;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static const struct pattern_kernel *best;
+
+static void fill_scalar(PatternPeriod period, void *buffer,
+			size_t offset, size_t len)
+{
+	char *bytes = buffer;
+	size_t value = offset % period->seed;
+
+	for (size_t i = 0; i < len; i++) {
+		bytes[i] = value;
+		if (++value == period->seed)
+			value = 0;
+	}
+}
+
+static size_t verify_scalar(PatternPeriod period, const void *buffer,
+			    size_t offset, size_t len)
+{
+	const char *bytes = buffer;
+	size_t value = offset % period->seed;
+
+	for (size_t i = 0; i < len; i++) {
+		if (bytes[i] != (char) value)
+			return i;
+
+		if (++value == period->seed)
+			value = 0;
+	}
+
+	return PATTERN_OK;
+}
+
+// a mismatch somewhere in the block at `i`: find the exact byte
+static size_t verify_block(PatternPeriod period, const char *buffer,
+			   size_t offset, size_t i, size_t len)
+{
+	size_t at;
+
+	at = verify_scalar(period, buffer + i, offset + i, len);
+
+	return at == PATTERN_OK ? PATTERN_OK : i + at;
+}
+
+#if defined(__x86_64__)
+static void fill_sse2(PatternPeriod period, void *buffer,
+		      size_t offset, size_t len)
+{
+	const char *base = period->table + offset % period->seed;
+	char *bytes = buffer;
+	size_t i;
+
+	for (i = 0; i + period->block16 <= len; i += period->block16)
+		for (size_t k = 0; k < period->block16; k += 16)
+			_mm_storeu_si128((__m128i *) (bytes + i + k),
+				_mm_loadu_si128((const __m128i *) (base + k)));
+
+	fill_scalar(period, bytes + i, offset + i, len - i);
+}
+
+static size_t verify_sse2(PatternPeriod period, const void *buffer,
+			  size_t offset, size_t len)
+{
+	const char *base = period->table + offset % period->seed;
+	const char *bytes = buffer;
+	size_t i;
+
+	for (i = 0; i + period->block16 <= len; i += period->block16) {
+		__m128i diff = _mm_setzero_si128();
+
+		for (size_t k = 0; k < period->block16; k += 16)
+			diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128((const __m128i *) (bytes + i + k)),
+				_mm_loadu_si128((const __m128i *) (base + k))));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+		    != 0xffff)
+			return verify_block(period, bytes, offset, i,
+					    period->block16);
+	}
+
+	return verify_block(period, bytes, offset, i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(PatternPeriod period, void *buffer,
+		      size_t offset, size_t len)
+{
+	const char *base = period->table + offset % period->seed;
+	char *bytes = buffer;
+	size_t i;
+
+	for (i = 0; i + period->block32 <= len; i += period->block32)
+		for (size_t k = 0; k < period->block32; k += 32)
+			_mm256_storeu_si256((__m256i *) (bytes + i + k),
+				_mm256_loadu_si256((const __m256i *) (base + k)));
+
+	fill_scalar(period, bytes + i, offset + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t verify_avx2(PatternPeriod period, const void *buffer,
+			  size_t offset, size_t len)
+{
+	const char *base = period->table + offset % period->seed;
+	const char *bytes = buffer;
+	size_t i;
+
+	for (i = 0; i + period->block32 <= len; i += period->block32) {
+		__m256i diff = _mm256_setzero_si256();
+
+		for (size_t k = 0; k < period->block32; k += 32)
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256((const __m256i *) (bytes + i + k)),
+				_mm256_loadu_si256((const __m256i *) (base + k))));
+
+		if ( !_mm256_testz_si256(diff, diff))
+			return verify_block(period, bytes, offset, i,
+					    period->block32);
+	}
+
+	return verify_block(period, bytes, offset, i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void fill_avx512(PatternPeriod period, void *buffer,
+			size_t offset, size_t len)
+{
+	const char *base = period->table + offset % period->seed;
+	char *bytes = buffer;
+	size_t i;
+
+	for (i = 0; i + period->block64 <= len; i += period->block64)
+		for (size_t k = 0; k < period->block64; k += 64)
+			_mm512_storeu_si512(bytes + i + k,
+					    _mm512_loadu_si512(base + k));
+
+	fill_scalar(period, bytes + i, offset + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t verify_avx512(PatternPeriod period, const void *buffer,
+			    size_t offset, size_t len)
+{
+	const char *base = period->table + offset % period->seed;
+	const char *bytes = buffer;
+	size_t i;
+
+	for (i = 0; i + period->block64 <= len; i += period->block64) {
+		__m512i diff = _mm512_setzero_si512();
+
+		for (size_t k = 0; k < period->block64; k += 64)
+			diff = _mm512_or_si512(diff, _mm512_xor_si512(
+				_mm512_loadu_si512(bytes + i + k),
+				_mm512_loadu_si512(base + k)));
+
+		if (_mm512_test_epi8_mask(diff, diff))
+			return verify_block(period, bytes, offset, i,
+					    period->block64);
+	}
+
+	return verify_block(period, bytes, offset, i, len - i);
+}
+#endif
+
+static struct pattern_kernel kernels[] = {
+	{ "scalar", fill_scalar, verify_scalar },
+#if defined(__x86_64__)
+	{ "sse2", fill_sse2, verify_sse2 },
+	{ "avx2", fill_avx2, verify_avx2 },
+	{ "avx512bw", fill_avx512, verify_avx512 },
+#endif
+};
+
+static int nkernel;
+
+static size_t pattern_block(size_t seed, size_t width)
+{
+	size_t a = seed, b = width;
+
+	while (b) {
+		size_t t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return seed / a * width;
+}
+
+static void pattern_set_period(PatternPeriod period, size_t seed, char *table)
+{
+	period->seed = seed;
+	period->table = table;
+
+	for (size_t i = 0; i < seed + PATTERN_SPAN(seed); i++)
+		table[i] = i % seed;
+
+	period->block16 = pattern_block(seed, 16);
+	period->block32 = pattern_block(seed, 32);
+	period->block64 = pattern_block(seed, 64);
+}
+
+static void pattern_init(void)
+{
+	pattern_set_period(&standard, PATTERN_SEED, standard_table);
+
+	nkernel = 1;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+
+	// SSE2 is part of x86-64; the rest is probed in order
+	nkernel = 2;
+	if (__builtin_cpu_supports("avx2"))
+		nkernel = 3;
+	if (nkernel == 3 && __builtin_cpu_supports("avx512bw"))
+		nkernel = 4;
+#endif
+
+	best = kernels + nkernel - 1;
+}
+
+PatternPeriod pattern_period_create(size_t seed)
+{
+	PatternPeriod period;
+	char *table;
+
+	if (seed == 0 || seed > 256)
+		return NULL;
+
+	period = malloc(sizeof(struct pattern_period));
+	if (period == NULL)
+		return NULL;
+
+	table = malloc(seed + PATTERN_SPAN(seed));
+	if (table == NULL) {
+		free(period);
+		return NULL;
+	}
+
+	pattern_set_period(period, seed, table);
+
+	return period;
+}
+
+void pattern_period_destroy(PatternPeriod period)
+{
+	free(period->table);
+	free(period);
+}
+
+void pattern_period_fill(PatternPeriod period, void *buffer,
+			 size_t offset, size_t len)
+{
+	pthread_once(&once, pattern_init);
+
+	best->fill(period, buffer, offset, len);
+}
+
+size_t pattern_period_verify(PatternPeriod period, const void *buffer,
+			     size_t offset, size_t len)
+{
+	pthread_once(&once, pattern_init);
+
+	return best->verify(period, buffer, offset, len);
+}
+
+void pattern_fill(void *buffer, size_t offset, size_t len)
+{
+	pthread_once(&once, pattern_init);
+
+	best->fill(&standard, buffer, offset, len);
+}
+
+size_t pattern_verify(const void *buffer, size_t offset, size_t len)
+{
+	pthread_once(&once, pattern_init);
+
+	return best->verify(&standard, buffer, offset, len);
+}
+
+PatternPeriod pattern_get_standard(void)
+{
+	pthread_once(&once, pattern_init);
+
+	return &standard;
+}
+
+const struct pattern_kernel *pattern_get_kernels(int *count)
+{
+	pthread_once(&once, pattern_init);
+
+	*count = nkernel;
+
+	return kernels;
+}
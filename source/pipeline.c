@@ -0,0 +1,291 @@
+#include "pipeline.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// bool, true, false
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_create(), pthread_mutex_lock(), ...
+
+#include "affinity.h"
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_ACQUIRED,
+	SLOT_QUEUED
+};
+
+struct slot {
+	enum slot_state state;
+
+	size_t offset;
+	size_t len;
+};
+
+struct pipeline {
+	Memory base;
+	size_t chunk;
+	int depth;
+
+	PipelineStage stage;
+	void *arg;
+
+	struct slot *slots;
+	int head;
+
+	int *queue;
+	int queue_head;
+	int queue_count;
+
+	int busy;
+	bool failed;
+	bool stop;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+static __thread char error[BUFSIZ];
+
+static void *pipeline_main(void *arg)
+{
+	Pipeline pipeline = arg;
+
+	pthread_mutex_lock(&pipeline->lock);
+	while (true) {
+		struct slot *slot;
+		bool failed;
+		int index, ret;
+
+		while (pipeline->queue_count == 0 && !pipeline->stop)
+			pthread_cond_wait(&pipeline->work, &pipeline->lock);
+
+		if (pipeline->queue_count == 0)
+			break;
+
+		index = pipeline->queue[pipeline->queue_head];
+		pipeline->queue_head = (pipeline->queue_head + 1)
+				     % pipeline->depth;
+		pipeline->queue_count--;
+
+		slot = pipeline->slots + index;
+		failed = pipeline->failed;
+		pthread_mutex_unlock(&pipeline->lock);
+
+		// after a failure only drain the queue, the caller bails out
+		ret = failed ? -1 : pipeline->stage(
+			pipeline->arg, pipeline_get_slot(pipeline, index),
+			slot->offset, slot->len
+		);
+
+		pthread_mutex_lock(&pipeline->lock);
+		if (ret == -1)
+			pipeline->failed = true;
+
+		slot->state = SLOT_FREE;
+		pipeline->busy--;
+
+		pthread_cond_broadcast(&pipeline->done);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return NULL;
+}
+
+Pipeline pipeline_create(Memory base, size_t chunk, int depth,
+			 PipelineStage stage, void *arg)
+{
+	Pipeline pipeline;
+	int ret;
+
+	pipeline = malloc(sizeof(struct pipeline));
+	if (pipeline == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	pipeline->slots = calloc(depth, sizeof(struct slot));
+	if (pipeline->slots == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_PIPELINE;
+	}
+
+	pipeline->queue = calloc(depth, sizeof(int));
+	if (pipeline->queue == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_SLOTS;
+	}
+
+	pipeline->base = base;
+	pipeline->chunk = chunk;
+	pipeline->depth = depth;
+
+	pipeline->stage = stage;
+	pipeline->arg = arg;
+
+	pipeline->head = 0;
+	pipeline->queue_head = pipeline->queue_count = 0;
+
+	pipeline->busy = 0;
+	pipeline->failed = pipeline->stop = false;
+
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->work, NULL);
+	pthread_cond_init(&pipeline->done, NULL);
+
+	ret = pthread_create(&pipeline->thread, NULL, pipeline_main, pipeline);
+	if (ret != 0) {
+		ERROR("failed to pthread_create(): %s", strerror(ret));
+		goto DESTROY_LOCK;
+	}
+
+	return pipeline;
+
+DESTROY_LOCK:	pthread_cond_destroy(&pipeline->done);
+		pthread_cond_destroy(&pipeline->work);
+		pthread_mutex_destroy(&pipeline->lock);
+		free(pipeline->queue);
+FREE_SLOTS:	free(pipeline->slots);
+FREE_PIPELINE:	free(pipeline);
+RETURN_NULL:	return NULL;
+}
+
+int pipeline_acquire(Pipeline pipeline, size_t *offset, size_t *len)
+{
+	struct slot *slot;
+	int index;
+
+	pthread_mutex_lock(&pipeline->lock);
+
+	// slots are handed out in ring order, so wait for the oldest one
+	index = pipeline->head;
+	slot = pipeline->slots + index;
+	while (slot->state != SLOT_FREE && !pipeline->failed)
+		pthread_cond_wait(&pipeline->done, &pipeline->lock);
+
+	if (pipeline->failed) {
+		pthread_mutex_unlock(&pipeline->lock);
+		ERROR("pipeline stage failed");
+		return -1;
+	}
+
+	slot->state = SLOT_ACQUIRED;
+	pipeline->head = (pipeline->head + 1) % pipeline->depth;
+
+	// report the job that last ran in this slot, if any
+	if (offset)
+		*offset = slot->offset;
+	if (len)
+		*len = slot->len;
+
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return index;
+}
+
+int pipeline_submit(Pipeline pipeline, int index, size_t offset, size_t len)
+{
+	struct slot *slot;
+	int tail;
+
+	pthread_mutex_lock(&pipeline->lock);
+
+	slot = pipeline->slots + index;
+	if (slot->state != SLOT_ACQUIRED) {
+		pthread_mutex_unlock(&pipeline->lock);
+		ERROR("slot %d is not acquired", index);
+		return -1;
+	}
+
+	slot->state = SLOT_QUEUED;
+	slot->offset = offset;
+	slot->len = len;
+
+	tail = (pipeline->queue_head + pipeline->queue_count) % pipeline->depth;
+	pipeline->queue[tail] = index;
+	pipeline->queue_count++;
+	pipeline->busy++;
+
+	pthread_cond_signal(&pipeline->work);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	return 0;
+}
+
+int pipeline_drain(Pipeline pipeline)
+{
+	int ret;
+
+	pthread_mutex_lock(&pipeline->lock);
+
+	while (pipeline->busy > 0)
+		pthread_cond_wait(&pipeline->done, &pipeline->lock);
+
+	// hand every slot back so the next round starts from a clean ring
+	for (int i = 0; i < pipeline->depth; i++) {
+		pipeline->slots[i].state = SLOT_FREE;
+		pipeline->slots[i].offset = pipeline->slots[i].len = 0;
+	}
+	pipeline->head = 0;
+
+	ret = pipeline->failed ? -1 : 0;
+	pipeline->failed = false;
+
+	pthread_mutex_unlock(&pipeline->lock);
+
+	if (ret == -1)
+		ERROR("pipeline stage failed");
+
+	return ret;
+}
+
+Memory pipeline_get_slot(Pipeline pipeline, int index)
+{
+	return (Memory) (((char *) pipeline->base) + pipeline->chunk * index);
+}
+
+size_t pipeline_get_chunk(Pipeline pipeline)
+{
+	return pipeline->chunk;
+}
+
+int pipeline_pin(Pipeline pipeline, int cpu)
+{
+	if (affinity_pin_thread(pipeline->thread, cpu) == -1) {
+		ERROR("failed to affinity_pin_thread(): %s",
+		      affinity_get_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+void pipeline_destroy(Pipeline pipeline)
+{
+	pthread_mutex_lock(&pipeline->lock);
+	pipeline->stop = true;
+	pthread_cond_signal(&pipeline->work);
+	pthread_mutex_unlock(&pipeline->lock);
+
+	pthread_join(pipeline->thread, NULL);
+
+	pthread_cond_destroy(&pipeline->done);
+	pthread_cond_destroy(&pipeline->work);
+	pthread_mutex_destroy(&pipeline->lock);
+
+	free(pipeline->queue);
+	free(pipeline->slots);
+	free(pipeline);
+}
+
+char *pipeline_get_error(void)
+{
+	return error;
+}
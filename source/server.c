@@ -3,36 +3,202 @@
 #include <stdio.h>	// BUFSIZ
 #include <stdbool.h>	// true, false
 #include <stdlib.h>	// malloc()
+#include <stdint.h>	// SIZE_MAX
 #include <string.h>	// strerror()
 #include <errno.h>	// errno
 
 #include <unistd.h>
 
+#include <poll.h>	// poll()
+
+#include <sys/time.h>	// gettimeofday()
+#include <sys/epoll.h>	// epoll_create1(), epoll_ctl(), epoll_wait()
+#include <sys/ioctl.h>	// ioctl()
+#include <sys/mman.h>	// mmap(), munmap()
+
 #define __iovec_defined	// do not define `struct iovec`
 #include <sys/socket.h>	// accept(), recv(), send(), etc.
 
+#include <netinet/in.h>	// IPPROTO_TCP
+
 #include <linux/uio.h>	// struct iovec, struct dmabuf_cmsg
+#include <linux/tcp.h>	// struct tcp_zerocopy_receive (with copybuf)
 
 #include "socket.h"
+#include "token.h"
+#include "pipeline.h"
+#include "frame.h"
+#include "gather.h"
+#include "uring.h"
+#include "pattern.h"
+#include "integrity.h"
+#include "staging.h"
+#include "check.h"
 
 #include "memory_provider.h"
 
 #define CTRL_DATA_SIZE	CMSG_SPACE(sizeof(int) * 100)
-#define BACKLOG		15
+#define CTRL_SPACE(N)	(CMSG_SPACE(sizeof(struct dmabuf_cmsg)) * (N))
+#define CTRL_FRAGS	256	// frags per recvmsg() to start with
+#define CTRL_MAX_FRAGS	16384
+#define BACKLOG		SOMAXCONN
+#define MAX_EVENTS	64
+#define SHARED_WAIT_MS	100
+#define INBOX_EVENT	UINT64_MAX	// epoll data of the hand-off pipe
+#define CONN_STAGING	(4UL << 20)	// host window of an event-loop conn
+
+#ifndef ETOOSMALL
+#define ETOOSMALL	524	// kernel-internal, not in the uapi errno.h
+#endif
+
+#ifndef EPIOCSPARAMS		// Linux 6.9, not in every libc's sys/epoll.h
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+
+#define EPIOCSPARAMS	_IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#define TOKEN_BATCH		128
+#define TOKEN_TIMEOUT	1000	// microseconds
+
+#define GATHER_CAPACITY	64
+
+#define URING_BUFS	64
+
+#define ZEROCOPY_REGION	(2 << 20)	// socket pages mapped per receive
+
+#define PROBE_SIZE	(8 << 20)	// per half, host copies of frags to check
+#define PROBE_FRAGS	4096
+#define CHECK_DEPTH	(PROBE_FRAGS * 2)	// jobs of both probe halves
 
 #define ERROR(...) do {					\
 	snprintf(error, BUFSIZ, __VA_ARGS__);		\
 } while(false)
 
+#define GET_ELAPSED(START, END)					\
+	(  ((END).tv_sec - (START).tv_sec)			\
+	 + ((END).tv_usec - (START).tv_usec) * 1e-6 )
+
+struct server_conn {
+	int fd;
+	size_t recvlen;
+	struct timeval start;
+
+	// TCP bytes not yet in the context, ending at the stream position
+	Memory staging;
+	size_t staged;
+
+	struct integrity_cursor cursor;	// of the manifest's blocks
+
+	// framing state of a persistent connection
+	struct frame_header header;
+	size_t header_len;
+	uint32_t seq;
+	size_t offset;		// context offset of the current message
+	size_t pos;		// context offset of the next payload byte
+	size_t left;		// payload bytes left in the current message
+};
+
+// a frag copied to the host, checked once the copy has landed
+struct server_probe {
+	size_t pos;		// context offset it belongs at
+	size_t len;
+	size_t offset;		// in the dmabuf, SIZE_MAX if linear
+	uint32_t token;
+	size_t at;		// in the current half of the probe buffer
+};
+
+// received bytes for the check stage, left alone until it is drained
+struct server_check_job {
+	const char *src;
+	size_t pos;
+	size_t len;
+	struct integrity_cursor *cursor;	// of the stream they belong to
+	size_t offset;		// in the dmabuf, SIZE_MAX for host bytes
+	uint32_t token;
+	const char *what;
+};
+
 struct server {
 	Memory context;
 	Memory buffer;
 	size_t size;
 
+	StagingPool staging;	// windows of the event loop's connections
+
 	int sockfd;
+
+	TokenReleaser releaser;
+	Gatherer gatherer;
+	Pipeline pipeline;
+	Checker checker;
+	char stage_error[BUFSIZ];	// why the copy or check stage failed
+	UringReceiver uring;
+	struct server_stats stats;
+
+	// control buffer of the payload recvmsg(), grown on MSG_CTRUNC
+	char *ctrl;
+	size_t ctrl_size;
+	int rcvlowat;
+
+	int busy_poll;		// SO_BUSY_POLL and user space spin, in us
+	int busy_budget;
+	bool spin;		// off in the event loop, epoll_wait() polls
+	bool latency;		// ack every framed message
+
+	struct server_conn_stats *conn_stats;
+	int nconn;
+
+	// connections arriving on another CPU go to the server owning it
+	int cpu;
+	ServerDispatch dispatch;
+	void *dispatch_arg;
+	int inbox[2];		// pipe of fds handed over by other listeners
+
+	bool persistent;
+	struct server_conn conn;	// kept connection of server_run_as_*()
+
+	// message held by server_recv_dma_frags() until server_release()
+	struct server_frag *frags;
+	size_t nfrag, frag_capacity;
+	size_t frag_len;
+	size_t linear_len;
+	int frag_fd;
+
+	// message being handed out, possibly over several credit windows
+	int frag_src;
+	bool frag_more;
+	size_t frag_pos;	// context offset of the next piece
+	size_t frag_left;	// bytes left, SIZE_MAX until EOF
+
+	// cap on the frags kept from the page pool, 0 for no cap
+	size_t credit_tokens, credit_bytes;
+	size_t held_tokens, held_bytes;	// by the frag list
+	bool throttling;
+	struct timeval throttle_start;
+
+	// inspect every piece as it arrives: against the pattern, the
+	// manifest of block CRCs, or both
+	bool check;
+	bool pattern;
+	Integrity integrity;
+	struct integrity_cursor *cursor;	// of the stream being received
+	Memory probe_buf;
+	struct server_probe *probes;
+	size_t nprobe, probe_len;
+
+	// one half is filled while the check stage reads the other
+	int probe_half;
+	unsigned long probe_mark[2];	// checker_mark() after each half
 };
 
-static char error[BUFSIZ];
+
+// per thread, as the workers and the pipeline's copy stage all call in here
+static __thread char error[BUFSIZ];
 extern MemoryProvider gp, hp;
 
 Server server_setup(Memory context, size_t size, char *address, int port)
@@ -65,158 +231,2587 @@ Server server_setup(Memory context, size_t size, char *address, int port)
 		goto SOCKET_DESTROY;
 	}
 
+	server->releaser = token_releaser_create(TOKEN_BATCH, TOKEN_TIMEOUT);
+	if (server->releaser == NULL) {
+		ERROR("failed to token_releaser_create(): %s",
+		      token_get_error());
+		goto FREE_BUFFER;
+	}
+
+	// linear devmem data is gathered out of the host staging buffer
+	if (memory_provider_allow_access(hp, gp, server->buffer) == -1) {
+		ERROR("failed to memory_provider_allow_access(): %s",
+		      memory_provider_get_error(hp));
+		goto DESTROY_RELEASER;
+	}
+
+	server->gatherer = gatherer_create(gp, GATHER_CAPACITY);
+	if (server->gatherer == NULL) {
+		ERROR("failed to gatherer_create(): %s", gather_get_error());
+		goto DESTROY_RELEASER;
+	}
+
+	server->staging = staging_pool_create(hp, gp);
+	if (server->staging == NULL) {
+		ERROR("failed to staging_pool_create(): %s",
+		      staging_get_error());
+		goto DESTROY_GATHERER;
+	}
+
+	server->ctrl_size = CTRL_SPACE(CTRL_FRAGS);
+	server->ctrl = malloc(server->ctrl_size);
+	if (server->ctrl == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto DESTROY_STAGING;
+	}
+
+	server->rcvlowat = 0;
+	server->busy_poll = server->busy_budget = 0;
+	server->spin = true;
+	server->latency = false;
+	server->pipeline = NULL;
+	server->checker = NULL;
+	server->uring = NULL;
+	server->stats = (struct server_stats) { 0 };
+
+	server->conn_stats = NULL;
+	server->nconn = 0;
+
+	server->cpu = -1;
+	server->dispatch = NULL;
+	server->inbox[0] = server->inbox[1] = -1;
+
+	server->persistent = false;
+	server->conn.fd = -1;
+	server->conn.staging = NULL;
+	server->conn.cursor = (struct integrity_cursor) INTEGRITY_CURSOR_INIT;
+
+	server->frags = NULL;
+	server->nfrag = server->frag_capacity = 0;
+	server->frag_fd = -1;
+	server->frag_src = -1;
+	server->frag_more = false;
+
+	server->credit_tokens = server->credit_bytes = 0;
+	server->held_tokens = server->held_bytes = 0;
+	server->throttling = false;
+
+	server->check = server->pattern = false;
+	server->integrity = NULL;
+	server->cursor = &server->conn.cursor;
+	server->probe_buf = NULL;
+	server->probes = NULL;
+	server->nprobe = server->probe_len = 0;
+	server->probe_half = 0;
+	server->probe_mark[0] = server->probe_mark[1] = 0;
+
 	return server;
 
+DESTROY_STAGING:	staging_pool_destroy(server->staging);
+DESTROY_GATHERER:	gatherer_destroy(server->gatherer);
+DESTROY_RELEASER:	token_releaser_destroy(server->releaser);
+FREE_BUFFER:		memory_provider_free(hp, server->buffer);
 SOCKET_DESTROY:		(void) socket_destroy(server->sockfd);
-FREE_SERVER:		memory_provider_free(hp, server->buffer);
+FREE_SERVER:		free(server);
 RETURN_NULL:		return NULL;
 }
 
-int server_run_as_tcp(Server server)
+int server_set_token_release(Server server, size_t batch, int timeout_us)
 {
-	int clnt_fd;
-	size_t recvlen;
-	Memory context;
-	int ret;
+	TokenReleaser releaser;
 
-	context = server->context;
-	
-	clnt_fd = accept(server->sockfd, NULL, 0);
-	if (clnt_fd == -1) {
-		ERROR("failed to accept(): %s", strerror(errno));
-		goto RETURN_ERROR;
+	releaser = token_releaser_create(batch, timeout_us);
+	if (releaser == NULL) {
+		ERROR("failed to token_releaser_create(): %s",
+		      token_get_error());
+		return -1;
 	}
 
-	recvlen = 0;
-	while (true) {
-		int ret = recv(clnt_fd, ((char *) server->buffer) + recvlen, 
-		 			server->size - recvlen, 0);
-		if (ret == -1) {
-			ERROR("failed to recv(): %s", strerror(errno));
-			goto SOCKET_DESTROY;
-		}
+	token_releaser_destroy(server->releaser);
+	server->releaser = releaser;
 
-		if (ret == 0)
-			break;
+	return 0;
+}
+
+void server_set_persistent(Server server, bool persistent)
+{
+	server->persistent = persistent;
+}
+
+void server_set_credit(Server server, size_t tokens, size_t bytes)
+{
+	server->credit_tokens = tokens;
+	server->credit_bytes = bytes;
+}
+
+void server_set_rcvlowat(Server server, int bytes)
+{
+	server->rcvlowat = bytes;
+}
 
-		recvlen += ret;
+void server_set_busy_poll(Server server, int usecs, int budget)
+{
+	server->busy_poll = usecs;
+	server->busy_budget = budget;
+}
+
+void server_set_latency(Server server, bool latency)
+{
+	server->latency = latency;
+}
+
+// accept a connection and apply the per-socket receive options
+static int server_accept(Server server)
+{
+	int fd;
+
+	fd = accept(server->sockfd, NULL, 0);
+	if (fd == -1) {
+		ERROR("failed to accept(): %s", strerror(errno));
+		return -1;
 	}
 
-	if (memory_provider_allow_access(hp, gp, server->buffer) == -1)
+	// fewer, fuller recvmsg() calls; EOF still wakes a short read up
+	if (server->rcvlowat > 0
+	 && socket_set_rcvlowat(fd, server->rcvlowat) == -1) {
+		ERROR("failed to socket_set_rcvlowat(): %s",
+		      socket_get_error());
+		(void) socket_destroy(fd);
 		return -1;
+	}
 
-	ret = memory_provider_copy(
-		gp, context, server->buffer, server->size
-	);
-	if (ret == -1) {
-		ERROR("failed to amdgpu_memory_provider->memcpy_to(): %s",
-		       memory_provider_get_error(gp));
-		goto SOCKET_DESTROY;
+	if (server->busy_poll > 0
+	 && socket_set_busy_poll(fd, server->busy_poll,
+				 server->busy_budget) == -1) {
+		ERROR("failed to socket_set_busy_poll(): %s",
+		      socket_get_error());
+		(void) socket_destroy(fd);
+		return -1;
 	}
 
-	if (socket_destroy(clnt_fd) == -1)
-		goto RETURN_ERROR;
+	return fd;
+}
+
+// under busy polling, spin on non-blocking receives (each one polls the
+// NAPI context) for up to `busy_poll` us before sleeping in a blocking one
+static int server_recvmsg(Server server, int fd, struct msghdr *msg,
+			  int flags)
+{
+	struct timeval start, now;
+	int ret;
+
+	if (server->busy_poll > 0 && server->spin) {
+		gettimeofday(&start, NULL);
+		do {
+			ret = recvmsg(fd, msg, flags | MSG_DONTWAIT);
+			if (ret != -1 || errno != EAGAIN)
+				return ret;
+
+			server->stats.spins++;
+			gettimeofday(&now, NULL);
+		} while (GET_ELAPSED(start, now) * 1e6 < server->busy_poll);
+	}
+
+	return recvmsg(fd, msg, flags);
+}
+
+static int server_recv(Server server, int fd, void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+
+	return server_recvmsg(server, fd, &msg, 0);
+}
+
+// one byte back per framed message lets the sender time the round trip
+static int server_ack(Server server, int fd)
+{
+	char ack = 0;
+
+	if ( !server->latency)
+		return 0;
+
+	if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+		ERROR("failed to send(): %s", strerror(errno));
+		return -1;
+	}
 
 	return 0;
+}
 
-SOCKET_DESTROY:	(void) socket_destroy(clnt_fd);
-RETURN_ERROR:	return -1;
+static int server_grow_ctrl(Server server)
+{
+	size_t size;
+	char *ctrl;
+
+	size = server->ctrl_size * 2;
+	if (size > CTRL_SPACE(CTRL_MAX_FRAGS))
+		return 0;
+
+	ctrl = realloc(server->ctrl, size);
+	if (ctrl == NULL) {
+		ERROR("failed to realloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	server->ctrl = ctrl;
+	server->ctrl_size = size;
+
+	return 0;
 }
 
-int server_run_as_dma(Server server, Memory dmabuf)
+// the kernel stops at the first frag whose cmsg does not fit and leaves
+// it queued, so only the batch is cut short, mostly without MSG_CTRUNC;
+// a buffer with no room left for another cmsg is what gives it away
+static int server_check_ctrl(Server server, struct msghdr *msg)
 {
-	char ctrl_data[CTRL_DATA_SIZE];
+	if ( !(msg->msg_flags & MSG_CTRUNC)
+	 && server->ctrl_size - msg->msg_controllen >= CTRL_SPACE(1))
+		return 0;
 
-	int clnt_fd;
-	size_t recvlen;
+	server->stats.ctrl_full++;
+
+	return server_grow_ctrl(server);
+}
+
+// a devmem recvmsg() into the control buffer; when not even one cmsg fits
+// the kernel fails it with ETOOSMALL and consumes nothing, so grow and retry
+static int server_recvmsg_dma(Server server, int fd, struct msghdr *msg)
+{
 	int ret;
 
-	int last_token;
+	while (true) {
+		msg->msg_control = server->ctrl;
+		msg->msg_controllen = server->ctrl_size;
 
-	clnt_fd = accept(server->sockfd, NULL, 0);
-	if (clnt_fd == -1) {
-		ERROR("failed to accept(): %s", strerror(errno));
-		goto RETURN_ERROR;
+		ret = server_recvmsg(server, fd, msg, MSG_SOCK_DEVMEM);
+		if (ret != -1) {
+			server->stats.recvs++;
+			return ret;
+		}
+
+		if (errno != ETOOSMALL
+		 || server->ctrl_size >= CTRL_SPACE(CTRL_MAX_FRAGS)) {
+			ERROR("failed to recvmsg(): %s", strerror(errno));
+			return -1;
+		}
+
+		server->stats.ctrl_full++;
+
+		if (server_grow_ctrl(server) == -1)
+			return -1;
 	}
+}
 
-	recvlen = 0;
-	while (true) {
-		struct iovec iov;
-		struct dmabuf_cmsg *dmabuf_cmsg;
-		struct msghdr msg;
-		struct dmabuf_token token;
+// frags kept from the page pool, plus `tokens`/`bytes` still in flight
+static void server_note_held(Server server, size_t tokens, size_t bytes)
+{
+	size_t pending_tokens, pending_bytes;
 
-		iov = (struct iovec) {
-			.iov_base = server->buffer,
-			.iov_len = server->size 
-		};
+	token_releaser_get_pending(server->releaser,
+				   &pending_tokens, &pending_bytes);
 
-		msg.msg_iov = &iov;
-		msg.msg_iovlen = 1;
-		msg.msg_control = ctrl_data;
-		msg.msg_controllen = CTRL_DATA_SIZE;
+	tokens += pending_tokens + server->held_tokens;
+	bytes += pending_bytes + server->held_bytes;
 
-		ret = recvmsg(clnt_fd, &msg, MSG_SOCK_DEVMEM);
-		if (ret == -1) {
-			ERROR("failed to recvmsg(): %s", strerror(errno));
-			goto SOCKET_DESTROY;
+	if (tokens > server->stats.peak_tokens)
+		server->stats.peak_tokens = tokens;
+
+	if (bytes > server->stats.peak_bytes)
+		server->stats.peak_bytes = bytes;
+}
+
+// bytes the next recvmsg() may take without overdrawing the credit
+static size_t server_credit(Server server)
+{
+	size_t tokens, bytes;
+
+	token_releaser_get_pending(server->releaser, &tokens, &bytes);
+
+	tokens += server->held_tokens;
+	bytes += server->held_bytes;
+
+	if (server->credit_tokens > 0 && tokens >= server->credit_tokens)
+		return 0;
+
+	if (server->credit_bytes == 0)
+		return SIZE_MAX;
+
+	if (bytes >= server->credit_bytes)
+		return 0;
+
+	return server->credit_bytes - bytes;
+}
+
+// hold recvmsg() back until the held frags fit the credit again; `*room`
+// stays 0 if only the caller can give frags back, by server_release()
+static int server_wait_credit(Server server, size_t *room)
+{
+	struct timeval end;
+
+	*room = server_credit(server);
+	if (*room == 0) {
+		if ( !server->throttling) {
+			gettimeofday(&server->throttle_start, NULL);
+			server->throttling = true;
+			server->stats.throttles++;
 		}
 
-		if (ret == 0)
-			break;
+		// batched tokens are the ones the server can give back itself
+		if (token_releaser_flush(server->releaser) == -1) {
+			ERROR("failed to token_releaser_flush(): %s",
+			      token_get_error());
+			return -1;
+		}
 
-		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-		     cmsg;
-		     cmsg = CMSG_NXTHDR(&msg, cmsg))
-		{
-			if (cmsg->cmsg_type != SCM_DEVMEM_DMABUF) {
-				ERROR("cmsg_type is not SCM_DEVMEM_DMABUF");
-				goto SOCKET_DESTROY;
-			}
+		*room = server_credit(server);
+	}
 
-			dmabuf_cmsg = (struct dmabuf_cmsg *) CMSG_DATA(cmsg);
+	if (*room > 0 && server->throttling) {
+		gettimeofday(&end, NULL);
+		server->stats.throttled += GET_ELAPSED(server->throttle_start,
+						       end);
+		server->throttling = false;
+	}
 
-			/*
-			ret = memory_provider_copy(
-				gp, (Memory) (((char *) server->context) + recvlen),
-				(Memory) (((char *) dmabuf) + dmabuf_cmsg->frag_offset),
-				dmabuf_cmsg->frag_size
-			);
-			if (ret == -1) {
-				ERROR("failed to amdgpu_memory_provider->"
-	  			      "memmove_to(): %s",
-				      memory_provider_get_error(gp));
-				goto SOCKET_DESTROY;
-			}
-			*/
-			token.token_count = 1;
-			if (setsockopt(clnt_fd, SOL_SOCKET, SO_DEVMEM_DONTNEED,
-				       &token, sizeof(token)) == -1) {
-				ERROR("failed to setsockopt(): %s",
-	  			      strerror(errno));
-				goto SOCKET_DESTROY;
-			}
-			
-			recvlen += dmabuf_cmsg->frag_size;
+	return 0;
+}
+
+// `len` received host bytes at `src` that belong at context offset `pos`
+static int server_check(Server server, struct integrity_cursor *cursor,
+			const char *src, size_t pos, size_t len,
+			const char *what)
+{
+	server->stats.checked += len;
+
+	while (len > 0) {
+		size_t offset = pos % server->size;
+		size_t part = server->size - offset < len
+			    ? server->size - offset : len;
+		size_t at;
+
+		at = server->pattern ? pattern_verify(src, offset, part)
+				     : PATTERN_OK;
+		if (at != PATTERN_OK) {
+			ERROR("%s: context offset %zu got %d, expected %zu",
+			      what, offset + at, src[at],
+			      (offset + at) % PATTERN_SEED);
+			return -1;
 		}
+
+		if (server->integrity
+		 && integrity_update(server->integrity, cursor,
+		 		     src, offset, part) == -1) {
+			ERROR("%s: %s", what, integrity_get_error());
+			return -1;
+		}
+
+		src += part;
+		pos += part;
+		len -= part;
 	}
 
-	if (socket_destroy(clnt_fd) == -1)
-		goto RETURN_ERROR;
+	return 0;
+}
+
+// on the check stage, while the receiving thread moves on
+static int server_check_job(void *arg, void *job)
+{
+	Server server = arg;
+	struct server_check_job *check = job;
+	char what[BUFSIZ];
+
+	if (check->offset == SIZE_MAX)
+		snprintf(what, sizeof(what), "%s", check->what);
+	else
+		snprintf(what, sizeof(what),
+			 "frag at dmabuf offset %zu (token %u, %zu bytes)",
+			 check->offset, check->token, check->len);
+
+	if (server_check(server, check->cursor, check->src,
+			 check->pos, check->len, what) == -1) {
+		// `error` is this thread's own, so hand it to the receiving one
+		snprintf(server->stage_error, BUFSIZ, "%s", error);
+		return -1;
+	}
+
+	return 0;
+}
 
-	/*
-	if (memory_provider_wait(gp) == -1)
+static int server_queue_check(Server server, struct server_check_job *job)
+{
+	// only fails once the check stage did
+	if (checker_submit(server->checker, job) == -1) {
+		ERROR("check stage failed: %s", server->stage_error);
 		return -1;
-	*/
+	}
 
 	return 0;
+}
 
-SOCKET_DESTROY:	(void) socket_destroy(clnt_fd);
-RETURN_ERROR:	return -1;
+// `len` host bytes at `src`, left alone until server_drain_check()
+static int server_check_later(Server server, const char *src,
+			      size_t pos, size_t len, const char *what)
+{
+	struct server_check_job job = {
+		.src = src, .pos = pos, .len = len, .cursor = server->cursor,
+		.offset = SIZE_MAX, .what = what
+	};
+
+	return server_queue_check(server, &job);
 }
 
-void server_cleanup(Server server)
+// wait for the check stage before the bytes handed to it are reused
+static int server_drain_check(Server server)
+{
+	if (server->checker == NULL)
+		return 0;
+
+	if (checker_drain(server->checker) == -1) {
+		ERROR("check stage failed: %s", server->stage_error);
+		return -1;
+	}
+
+	return 0;
+}
+
+// drop what is left of a failed stream, keeping the error it failed with
+static void server_reset_check(Server server)
+{
+	if (server->checker)
+		(void) checker_drain(server->checker);
+
+	server->nprobe = server->probe_len = 0;
+}
+
+static char *server_probe_half(Server server)
+{
+	return (char *) server->probe_buf + PROBE_SIZE * server->probe_half;
+}
+
+// hand the probes to the check stage once their copies landed, and fill
+// the other half of the probe buffer while it works through them
+static int server_submit_probes(Server server)
+{
+	struct server_check_job job;
+	char *half;
+
+	if (server->nprobe == 0)
+		return 0;
+
+	if (memory_provider_wait(hp) == -1) {
+		ERROR("failed to memory_provider_wait(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
+	}
+
+	half = server_probe_half(server);
+	for (size_t i = 0; i < server->nprobe; i++) {
+		struct server_probe *probe = server->probes + i;
+
+		job = (struct server_check_job) {
+			.src = half + probe->at, .pos = probe->pos,
+			.len = probe->len, .cursor = server->cursor,
+			.offset = probe->offset, .token = probe->token,
+			.what = "linear frag"
+		};
+
+		if (server_queue_check(server, &job) == -1)
+			return -1;
+	}
+
+	server->probe_mark[server->probe_half] = checker_mark(server->checker);
+	server->probe_half ^= 1;
+	server->nprobe = server->probe_len = 0;
+
+	// the stage may still be reading the batch before out of this half
+	if (checker_wait(server->checker,
+			 server->probe_mark[server->probe_half]) == -1) {
+		ERROR("check stage failed: %s", server->stage_error);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int server_probe_room(Server server, size_t len)
 {
+	if (server->probe_len + len > PROBE_SIZE
+	 || server->nprobe == PROBE_FRAGS)
+		return server_submit_probes(server);
+
+	return 0;
+}
+
+// copy a dmabuf frag to the host; server_submit_probes() checks it
+static int server_probe(Server server, Memory dmabuf, size_t offset,
+			size_t len, uint32_t token, size_t pos)
+{
+	if (len > PROBE_SIZE) {
+		ERROR("frag of %zu bytes does not fit the probe buffer", len);
+		return -1;
+	}
+
+	if (server_probe_room(server, len) == -1)
+		return -1;
+
+	if (memory_provider_copy(hp, server_probe_half(server)
+				     + server->probe_len,
+				 (char *) dmabuf + offset, len) == -1) {
+		ERROR("failed to memory_provider_copy(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
+	}
+
+	server->probes[server->nprobe++] = (struct server_probe) {
+		.pos = pos, .len = len, .offset = offset,
+		.token = token, .at = server->probe_len
+	};
+	server->probe_len += len;
+
+	return 0;
+}
+
+// linear bytes are overwritten by the next recvmsg(), and queue up with
+// the dmabuf frags so the check stage sees the stream in order
+static int server_probe_linear(Server server, const char *src,
+			       size_t len, size_t pos)
+{
+	while (len > 0) {
+		size_t part = len < PROBE_SIZE ? len : PROBE_SIZE;
+
+		if (server_probe_room(server, part) == -1)
+			return -1;
+
+		memcpy(server_probe_half(server) + server->probe_len,
+		       src, part);
+
+		server->probes[server->nprobe++] = (struct server_probe) {
+			.pos = pos, .len = part, .offset = SIZE_MAX,
+			.at = server->probe_len
+		};
+		server->probe_len += part;
+
+		src += part;
+		pos += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+// received bytes are inspected on the check stage, dmabuf frags through
+// host copies
+static int server_enable_check(Server server)
+{
+	if (server->probe_buf == NULL) {
+		server->probe_buf = memory_provider_alloc(hp, PROBE_SIZE * 2);
+		if (server->probe_buf == NULL) {
+			ERROR("failed to memory_provider_alloc(): %s",
+			      memory_provider_get_error(hp));
+			return -1;
+		}
+
+		if (memory_provider_allow_access(hp, gp,
+						 server->probe_buf) == -1) {
+			ERROR("failed to memory_provider_allow_access(): %s",
+			      memory_provider_get_error(hp));
+			return -1;
+		}
+
+		server->probes = malloc(sizeof(struct server_probe)
+					* PROBE_FRAGS);
+		if (server->probes == NULL) {
+			ERROR("failed to malloc(): %s", strerror(errno));
+			return -1;
+		}
+	}
+
+	if (server->checker == NULL) {
+		server->checker = checker_create(
+			sizeof(struct server_check_job), CHECK_DEPTH,
+			server_check_job, server
+		);
+		if (server->checker == NULL) {
+			ERROR("failed to checker_create(): %s",
+			      check_get_error());
+			return -1;
+		}
+	}
+
+	server->check = true;
+
+	return 0;
+}
+
+int server_set_check(Server server, bool check)
+{
+	if (check && server_enable_check(server) == -1)
+		return -1;
+
+	server->pattern = check;
+	server->check = server->pattern || server->integrity;
+
+	return 0;
+}
+
+// `integrity` stays the caller's, and must outlive the server's use of it
+int server_set_integrity(Server server, Integrity integrity)
+{
+	if (integrity && server_enable_check(server) == -1)
+		return -1;
+
+	server->integrity = integrity;
+	server->check = server->pattern || server->integrity;
+
+	return 0;
+}
+
+static int server_copy_slot(Server server, Memory slot,
+			    size_t offset, size_t len)
+{
+	int ret;
+
+	if (len == 0)
+		return 0;
+
+	// on the copy thread, while the next chunk is being received
+	if (server->check && server_check(server, server->cursor, slot,
+					  offset, len, "chunk") == -1)
+		return -1;
+
+	ret = memory_provider_copy(
+		gp, (Memory) (((char *) server->context) + offset), slot, len
+	);
+	if (ret == -1) {
+		ERROR("failed to amdgpu_memory_provider->memcpy_to(): %s",
+		       memory_provider_get_error(gp));
+		return -1;
+	}
+
+	if (memory_provider_wait(gp) == -1) {
+		ERROR("failed to memory_provider_wait(): %s",
+		      memory_provider_get_error(gp));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int server_copy_chunk(void *arg, Memory slot, size_t offset, size_t len)
+{
+	Server server = arg;
+
+	if (server_copy_slot(server, slot, offset, len) == -1) {
+		// `error` is this thread's own, so hand it to the receiving one
+		snprintf(server->stage_error, BUFSIZ, "%s", error);
+		return -1;
+	}
+
+	return 0;
+}
+
+int server_set_pipeline(Server server, size_t chunk, int depth)
+{
+	Pipeline pipeline;
+
+	if (depth < 1) {
+		ERROR("invalid pipeline depth %d", depth);
+		return -1;
+	}
+
+	// every slot lives in the host staging buffer
+	if (chunk == 0 || chunk * depth > server->size)
+		chunk = server->size / depth;
+
+	if (chunk == 0) {
+		ERROR("staging buffer is too small for %d slots", depth);
+		return -1;
+	}
+
+	if (memory_provider_allow_access(hp, gp, server->buffer) == -1) {
+		ERROR("failed to memory_provider_allow_access(): %s",
+		      memory_provider_get_error(hp));
+		return -1;
+	}
+
+	pipeline = pipeline_create(server->buffer, chunk, depth,
+			    	   server_copy_chunk, server);
+	if (pipeline == NULL) {
+		ERROR("failed to pipeline_create(): %s", pipeline_get_error());
+		return -1;
+	}
+
+	if (server->pipeline)
+		pipeline_destroy(server->pipeline);
+
+	server->pipeline = pipeline;
+
+	return 0;
+}
+
+// the copy thread belongs next to the one driving the socket
+int server_pin_pipeline(Server server, int cpu)
+{
+	if (server->pipeline == NULL) {
+		ERROR("no pipeline to pin");
+		return -1;
+	}
+
+	if (pipeline_pin(server->pipeline, cpu) == -1) {
+		ERROR("failed to pipeline_pin(): %s", pipeline_get_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+// receive `limit` bytes into context + offset or, with SIZE_MAX, a whole stream
+static int server_recv_pipelined(Server server, int fd,
+				 size_t offset, size_t limit)
+{
+	size_t chunk, recvlen;
+	bool eof;
+	int ret;
+
+	chunk = pipeline_get_chunk(server->pipeline);
+
+	recvlen = 0;
+	eof = false;
+	while ( !eof && recvlen < limit) {
+		size_t filled, want, len, pos;
+		char *slot_mem;
+		int slot;
+
+		// only fails once the copy stage did
+		slot = pipeline_acquire(server->pipeline, NULL, NULL);
+		if (slot == -1) {
+			ERROR("copy stage failed: %s", server->stage_error);
+			goto DRAIN_PIPELINE;
+		}
+
+		slot_mem = pipeline_get_slot(server->pipeline, slot);
+
+		want = limit - recvlen < chunk ? limit - recvlen : chunk;
+
+		// fill a whole chunk so each copy is as large as configured
+		for (filled = 0; filled < want; filled += ret) {
+			ret = server_recv(server, fd, slot_mem + filled,
+					  want - filled);
+			if (ret == -1) {
+				ERROR("failed to recv(): %s", strerror(errno));
+				goto DRAIN_PIPELINE;
+			}
+
+			server->stats.recvs++;
+
+			if (ret == 0) {
+				eof = true;
+				break;
+			}
+		}
+
+		server->stats.bytes += filled;
+
+		// anything past the context is received but not delivered
+		pos = offset + recvlen;
+		len = pos < server->size ? server->size - pos : 0;
+		if (len > filled)
+			len = filled;
+
+		if (pipeline_submit(server->pipeline, slot, pos, len) == -1) {
+			ERROR("failed to pipeline_submit(): %s",
+			      pipeline_get_error());
+			goto DRAIN_PIPELINE;
+		}
+
+		recvlen += filled;
+	}
+
+	if (eof && limit != SIZE_MAX) {
+		ERROR("connection closed %zu bytes into a %zu byte message",
+		      recvlen, limit);
+		goto DRAIN_PIPELINE;
+	}
+
+	if (pipeline_drain(server->pipeline) == -1) {
+		ERROR("copy stage failed: %s", server->stage_error);
+		return -1;
+	}
+
+	return 0;
+
+DRAIN_PIPELINE:	(void) pipeline_drain(server->pipeline);
+		return -1;
+}
+
+static int server_recv_tcp(Server server, int fd, size_t *recvlen,
+			   size_t limit)
+{
+	size_t offset, len;
+	int ret;
+
+	// a sender may push more than `size`, so wrap around the staging buffer
+	offset = *recvlen % server->size;
+
+	len = server->size - offset;
+	if (len > limit)
+		len = limit;
+
+	// wrapping around reuses bytes the check stage may still be reading
+	if (offset == 0 && *recvlen > 0 && server_drain_check(server) == -1)
+		return -1;
+
+	ret = server_recv(server, fd, ((char *) server->buffer) + offset, len);
+	if (ret == -1) {
+		ERROR("failed to recv(): %s", strerror(errno));
+		return -1;
+	}
+
+	server->stats.recvs++;
+	server->stats.bytes += ret;
+
+	// checked on the check stage while the next recv() runs
+	if (server->check
+	 && server_check_later(server, ((char *) server->buffer) + offset,
+	 		       *recvlen, ret, "recv") == -1)
+		return -1;
+
+	*recvlen += ret;
+
+	return ret;
+}
+
+// copy `len` staged bytes of stream position `pos` on, wrapping over the
+// context like the staging buffer does
+static int server_deliver_tcp(Server server, char *src, size_t pos, size_t len)
+{
+	while (len > 0) {
+		size_t offset = pos % server->size;
+		size_t part = server->size - offset < len
+			    ? server->size - offset : len;
+
+		if (memory_provider_copy(gp, ((char *) server->context) + offset,
+					 src, part) == -1) {
+			ERROR("failed to memory_provider_copy(): %s",
+			      memory_provider_get_error(gp));
+			return -1;
+		}
+
+		src += part;
+		pos += part;
+		len -= part;
+	}
+
+	// the next message of a kept connection lands on the same bytes
+	if (memory_provider_wait(gp) == -1) {
+		ERROR("failed to memory_provider_wait(): %s",
+		      memory_provider_get_error(gp));
+		return -1;
+	}
+
+	// and so do the next receives, once the check stage is done
+	return server_drain_check(server);
+}
+
+// hand the staged bytes of `conn`, which end at stream position `pos`, to
+// the context, so no other connection's bytes ever mix with them
+static int server_flush_conn(Server server, struct server_conn *conn,
+			     size_t pos)
+{
+	if (conn->staged == 0)
+		return 0;
+
+	if (server_deliver_tcp(server, conn->staging,
+			       pos - conn->staged, conn->staged) == -1)
+		return -1;
+
+	conn->staged = 0;
+
+	return 0;
+}
+
+static size_t server_conn_window(Server server)
+{
+	return server->size < CONN_STAGING ? server->size : CONN_STAGING;
+}
+
+// receive into the connection's own window, flushed whenever it fills up
+static int server_recv_conn(Server server, struct server_conn *conn,
+			    size_t *pos, size_t limit)
+{
+	char *dst;
+	size_t len;
+	int ret;
+
+	if (conn->staging == NULL) {
+		conn->staging = staging_pool_get(server->staging,
+						 server_conn_window(server));
+		if (conn->staging == NULL) {
+			ERROR("failed to staging_pool_get(): %s",
+			      staging_get_error());
+			return -1;
+		}
+	}
+
+	dst = ((char *) conn->staging) + conn->staged;
+
+	len = server_conn_window(server) - conn->staged;
+	if (len > limit)
+		len = limit;
+
+	ret = server_recv(server, conn->fd, dst, len);
+	if (ret == -1) {
+		ERROR("failed to recv(): %s", strerror(errno));
+		return -1;
+	}
+
+	server->stats.recvs++;
+	server->stats.bytes += ret;
+
+	// the window is only reused after server_flush_conn() drained it
+	if (server->check
+	 && server_check_later(server, dst, *pos, ret, "recv") == -1)
+		return -1;
+
+	conn->staged += ret;
+	*pos += ret;
+
+	if (conn->staged == server_conn_window(server))
+		if (server_flush_conn(server, conn, *pos) == -1)
+			return -1;
+
+	return ret;
+}
+
+static void server_put_conn(Server server, struct server_conn *conn)
+{
+	if (conn->staging == NULL)
+		return;
+
+	(void) staging_pool_put(server->staging, conn->staging);
+	conn->staging = NULL;
+}
+
+// queue src for context + pos, wrapping like the TCP staging buffer does
+static int server_gather(Server server, char *src, size_t pos, size_t len)
+{
+	while (len > 0) {
+		size_t offset = pos % server->size;
+		size_t part = server->size - offset < len
+			    ? server->size - offset : len;
+
+		if (gatherer_add(server->gatherer,
+		   		 ((char *) server->context) + offset,
+		   		 src, part) == -1) {
+			ERROR("failed to gatherer_add(): %s", gather_get_error());
+			return -1;
+		}
+
+		src += part;
+		pos += part;
+		len -= part;
+	}
+
+	return 0;
+}
+
+static int server_recv_dma(Server server, Memory dmabuf,
+			   int fd, size_t *recvlen, size_t limit)
+{
+	struct iovec iov;
+	struct dmabuf_cmsg *dmabuf_cmsg;
+	struct msghdr msg = { 0 };
+
+	size_t linear, room;
+	size_t held_tokens, held_bytes;
+	int ret;
+
+	if (server_wait_credit(server, &room) == -1)
+		return -1;
+
+	if (room == 0) {
+		ERROR("credit is used up by frags held by the caller");
+		return -1;
+	}
+
+	if (limit > room)
+		limit = room;
+
+	// the iovec length also caps the bytes handed out as frags
+	iov = (struct iovec) {
+		.iov_base = server->buffer,
+		.iov_len = server->size < limit ? server->size : limit
+	};
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ret = server_recvmsg_dma(server, fd, &msg);
+	if (ret == -1)
+		return -1;
+
+	// one gather list per batch, copied before any token goes back
+	linear = 0;
+	held_tokens = held_bytes = 0;
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	     cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		char *src;
+
+		if (cmsg->cmsg_type != SCM_DEVMEM_DMABUF
+		 && cmsg->cmsg_type != SCM_DEVMEM_LINEAR) {
+			ERROR("cmsg_type is not SCM_DEVMEM_DMABUF");
+			return -1;
+		}
+
+		dmabuf_cmsg = (struct dmabuf_cmsg *) CMSG_DATA(cmsg);
+
+		// bytes that were not steered into the dmabuf sit in the iovec
+		if (cmsg->cmsg_type == SCM_DEVMEM_LINEAR) {
+			src = ((char *) server->buffer) + linear;
+			linear += dmabuf_cmsg->frag_size;
+
+			if (server->check
+			 && server_probe_linear(server, src,
+			 			dmabuf_cmsg->frag_size,
+						*recvlen) == -1)
+				return -1;
+		} else {
+			src = ((char *) dmabuf) + dmabuf_cmsg->frag_offset;
+			server->stats.frags++;
+
+			held_tokens++;
+			held_bytes += dmabuf_cmsg->frag_size;
+
+			if (server->check
+			 && server_probe(server, dmabuf,
+			 		 dmabuf_cmsg->frag_offset,
+					 dmabuf_cmsg->frag_size,
+					 dmabuf_cmsg->frag_token,
+					 *recvlen) == -1)
+				return -1;
+		}
+
+		if (server_gather(server, src, *recvlen,
+				  dmabuf_cmsg->frag_size) == -1)
+			return -1;
+
+		*recvlen += dmabuf_cmsg->frag_size;
+		server->stats.bytes += dmabuf_cmsg->frag_size;
+	}
+
+	server_note_held(server, held_tokens, held_bytes);
+
+	if (gatherer_flush(server->gatherer) == -1) {
+		ERROR("failed to gatherer_flush(): %s", gather_get_error());
+		return -1;
+	}
+
+	// the probe copies ran next to the gather, and must land before
+	// any token goes back to the page pool; the check stage goes through
+	// them while the next batch is received
+	if (server_submit_probes(server) == -1)
+		return -1;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	     cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_type != SCM_DEVMEM_DMABUF)
+			continue;
+
+		dmabuf_cmsg = (struct dmabuf_cmsg *) CMSG_DATA(cmsg);
+
+		if (token_releaser_add(server->releaser, fd,
+			 	       dmabuf_cmsg->frag_token,
+				       dmabuf_cmsg->frag_size) == -1) {
+			ERROR("failed to token_releaser_add(): %s",
+  			      token_get_error());
+			return -1;
+		}
+	}
+
+	if (server_check_ctrl(server, &msg) == -1)
+		return -1;
+
+	return ret;
+}
+
+static int server_deliver_dma(Server server)
+{
+	if (token_releaser_flush(server->releaser) == -1) {
+		ERROR("failed to token_releaser_flush(): %s",
+		      token_get_error());
+		return -1;
+	}
+
+	// the stream only counts as received once all of it was checked
+	return server_drain_check(server);
+}
+
+static int server_recv_buffered(Server server, int fd,
+				size_t offset, size_t limit)
+{
+	size_t recvlen;
+	int ret;
+
+	// the staging buffer mirrors the context, so a stripe keeps its place
+	recvlen = offset;
+	do {
+		ret = server_recv_tcp(server, fd, &recvlen,
+				      limit - (recvlen - offset));
+		if (ret == -1)
+			return -1;
+	} while (ret > 0 && recvlen - offset < limit);
+
+	// once the stream wrapped, every staged byte is its latest one
+	if (limit == SIZE_MAX)
+		return server_deliver_tcp(server, server->buffer, 0,
+					  recvlen < server->size
+					  ? recvlen : server->size);
+
+	if (ret == 0) {
+		ERROR("connection closed %zu bytes into a %zu byte message",
+		      recvlen - offset, limit);
+		return -1;
+	}
+
+	return server_deliver_tcp(server,
+				  ((char *) server->buffer) + offset,
+				  offset, limit);
+}
+
+// gather a frame header, resuming where an EAGAIN left `*header_len`;
+// 1 once complete, 0 if the peer closed between messages, -1 on error
+static int server_recv_header(Server server, Memory dmabuf, int fd,
+			      struct frame_header *header, size_t *header_len)
+{
+	char linear[sizeof(struct frame_header)];
+
+	while (*header_len < sizeof(struct frame_header)) {
+		char ctrl_data[CTRL_DATA_SIZE];
+		char *dst = ((char *) header) + *header_len;
+		size_t want = sizeof(struct frame_header) - *header_len;
+		struct iovec iov;
+		struct msghdr msg = { 0 };
+		size_t consumed;
+		int ret;
+
+		if (dmabuf == NULL) {
+			ret = server_recv(server, fd, dst, want);
+		} else {
+			// the header may land in the dmabuf like any payload
+			iov = (struct iovec) {
+				.iov_base = linear, .iov_len = want
+			};
+
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = ctrl_data;
+			msg.msg_controllen = CTRL_DATA_SIZE;
+
+			ret = server_recvmsg(server, fd, &msg,
+					     MSG_SOCK_DEVMEM);
+		}
+
+		if (ret == -1) {
+			if (errno != EAGAIN)
+				ERROR("failed to %s(): %s",
+				      dmabuf ? "recvmsg" : "recv",
+				      strerror(errno));
+			return -1;
+		}
+
+		server->stats.recvs++;
+
+		if (ret == 0) {
+			if (*header_len == 0)
+				return 0;
+
+			ERROR("connection closed inside a frame header");
+			return -1;
+		}
+
+		if (dmabuf == NULL) {
+			*header_len += ret;
+			continue;
+		}
+
+		consumed = 0;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		     cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			struct dmabuf_cmsg *dmabuf_cmsg;
+
+			dmabuf_cmsg = (struct dmabuf_cmsg *) CMSG_DATA(cmsg);
+			dst = ((char *) header) + *header_len;
+
+			if (cmsg->cmsg_type == SCM_DEVMEM_LINEAR) {
+				memcpy(dst, linear + consumed,
+				       dmabuf_cmsg->frag_size);
+				consumed += dmabuf_cmsg->frag_size;
+				*header_len += dmabuf_cmsg->frag_size;
+				continue;
+			}
+
+			if (cmsg->cmsg_type != SCM_DEVMEM_DMABUF) {
+				ERROR("cmsg_type is not SCM_DEVMEM_DMABUF");
+				return -1;
+			}
+
+			ret = memory_provider_copy(
+				hp, dst,
+				((char *) dmabuf) + dmabuf_cmsg->frag_offset,
+				dmabuf_cmsg->frag_size
+			);
+			if (ret == -1 || memory_provider_wait(hp) == -1) {
+				ERROR("failed to memory_provider_copy(): %s",
+				      memory_provider_get_error(hp));
+				return -1;
+			}
+
+			if (token_releaser_add(server->releaser, fd,
+				 	       dmabuf_cmsg->frag_token,
+					       dmabuf_cmsg->frag_size) == -1) {
+				ERROR("failed to token_releaser_add(): %s",
+	  			      token_get_error());
+				return -1;
+			}
+
+			*header_len += dmabuf_cmsg->frag_size;
+			server->stats.frags++;
+		}
+	}
+
+	return 1;
+}
+
+static int server_open_frame(Server server, struct server_conn *conn)
+{
+	uint64_t offset, length;
+
+	if (frame_header_unpack(&conn->header, conn->seq,
+				&offset, &length) == -1) {
+		ERROR("failed to frame_header_unpack(): %s", frame_get_error());
+		return -1;
+	}
+
+	if (offset > server->size || length > server->size - offset) {
+		ERROR("message %u [%zu, +%zu) is outside the context",
+		      conn->seq, (size_t) offset, (size_t) length);
+		return -1;
+	}
+
+	conn->header_len = 0;
+	conn->seq++;
+	conn->offset = offset;
+	conn->pos = offset;
+	conn->left = length;
+
+	return 0;
+}
+
+static int server_close_frame(Server server, Memory dmabuf,
+			      struct server_conn *conn)
+{
+	int ret;
+
+	if (dmabuf == NULL)
+		ret = server_flush_conn(server, conn, conn->pos);
+	else
+		ret = server_deliver_dma(server);
+
+	if (ret == -1)
+		return -1;
+
+	server->stats.messages++;
+
+	return server_ack(server, conn->fd);
+}
+
+// make progress on a framed connection without blocking; >0 on progress,
+// 0 once the peer closed between messages, -1 on error or EAGAIN
+static int server_recv_framed(Server server, Memory dmabuf,
+			      struct server_conn *conn)
+{
+	size_t pos;
+	int ret;
+
+	if (conn->left == 0) {
+		ret = server_recv_header(server, dmabuf, conn->fd,
+					 &conn->header, &conn->header_len);
+		if (ret <= 0)
+			return ret;
+
+		if (server_open_frame(server, conn) == -1)
+			return -1;
+
+		if (conn->left == 0)
+			if (server_close_frame(server, dmabuf, conn) == -1)
+				return -1;
+
+		return 1;
+	}
+
+	pos = conn->pos;
+
+	if (dmabuf == NULL)
+		ret = server_recv_conn(server, conn, &conn->pos, conn->left);
+	else
+		ret = server_recv_dma(server, dmabuf, conn->fd,
+				      &conn->pos, conn->left);
+
+	if (ret == -1)
+		return -1;
+
+	if (ret == 0) {
+		ERROR("connection closed with %zu bytes of message %u left",
+		      conn->left, conn->seq - 1);
+		return -1;
+	}
+
+	conn->recvlen += conn->pos - pos;
+	conn->left -= conn->pos - pos;
+
+	if (conn->left == 0)
+		if (server_close_frame(server, dmabuf, conn) == -1)
+			return -1;
+
+	return ret;
+}
+
+// read the next frame header on the kept connection, accepting it first
+static int server_next_frame(Server server, Memory dmabuf)
+{
+	struct server_conn *conn = &server->conn;
+	int ret;
+
+	if (conn->fd == -1) {
+		conn->fd = server_accept(server);
+		if (conn->fd == -1)
+			return -1;
+
+		conn->header_len = 0;
+		conn->seq = 0;
+		conn->left = 0;
+	}
+
+	ret = server_recv_header(server, dmabuf, conn->fd,
+				 &conn->header, &conn->header_len);
+	if (ret == -1)
+		goto CLOSE_CONN;
+
+	if (ret == 0) {
+		ERROR("connection closed before message %u", conn->seq);
+		goto CLOSE_CONN;
+	}
+
+	if (server_open_frame(server, conn) == -1)
+		goto CLOSE_CONN;
+
+	return 0;
+
+CLOSE_CONN:	(void) token_releaser_flush(server->releaser);
+		(void) socket_destroy(conn->fd);
+		conn->fd = -1;
+		return -1;
+}
+
+// receive one framed message over the kept connection
+static int server_recv_message(Server server, Memory dmabuf)
+{
+	struct server_conn *conn = &server->conn;
+	int ret;
+
+	if (server_next_frame(server, dmabuf) == -1)
+		return -1;
+
+	if (dmabuf == NULL) {
+		if (server->pipeline)
+			ret = server_recv_pipelined(server, conn->fd,
+						    conn->offset, conn->left);
+		else
+			ret = server_recv_buffered(server, conn->fd,
+						   conn->offset, conn->left);
+
+		if (ret == -1)
+			goto CLOSE_CONN;
+
+		server->stats.messages++;
+		conn->left = 0;
+
+		if (server_ack(server, conn->fd) == -1)
+			goto CLOSE_CONN;
+
+		return 0;
+	}
+
+	while (conn->left > 0) {
+		ret = server_recv_framed(server, dmabuf, conn);
+		if (ret == -1)
+			goto CLOSE_CONN;
+	}
+
+	return 0;
+
+CLOSE_CONN:	(void) token_releaser_flush(server->releaser);
+		(void) socket_destroy(conn->fd);
+		conn->fd = -1;
+		server_reset_check(server);
+		return -1;
+}
+
+int server_run_as_tcp(Server server)
+{
+	int clnt_fd;
+	int ret;
+
+	if (server->persistent)
+		return server_recv_message(server, NULL);
+
+	clnt_fd = server_accept(server);
+	if (clnt_fd == -1)
+		goto RETURN_ERROR;
+
+	if (server->pipeline)
+		ret = server_recv_pipelined(server, clnt_fd, 0, SIZE_MAX);
+	else
+		ret = server_recv_buffered(server, clnt_fd, 0, SIZE_MAX);
+
+	if (ret == -1)
+		goto SOCKET_DESTROY;
+
+	if (socket_destroy(clnt_fd) == -1)
+		goto RETURN_ERROR;
+
+	server->stats.messages++;
+
+	return 0;
+
+SOCKET_DESTROY:	(void) socket_destroy(clnt_fd);
+		server_reset_check(server);
+RETURN_ERROR:	return -1;
+}
+
+struct server_uring_recv {
+	Server server;
+	size_t recvlen;
+	bool failed;		// the error is in the server, not in the ring
+};
+
+static int server_uring_data(void *arg, void *buffer, size_t len)
+{
+	struct server_uring_recv *recv = arg;
+	Server server = recv->server;
+
+	if (server->check
+	 && server_check(server, server->cursor, buffer, recv->recvlen,
+	 		 len, "io_uring buffer") == -1) {
+		recv->failed = true;
+		return -1;
+	}
+
+	if (server_gather(server, buffer, recv->recvlen, len) == -1) {
+		recv->failed = true;
+		return -1;
+	}
+
+	recv->recvlen += len;
+	server->stats.recvs++;
+	server->stats.bytes += len;
+
+	return 0;
+}
+
+static int server_uring_flush(void *arg)
+{
+	struct server_uring_recv *recv = arg;
+
+	if (gatherer_flush(recv->server->gatherer) == -1) {
+		ERROR("failed to gatherer_flush(): %s", gather_get_error());
+		recv->failed = true;
+		return -1;
+	}
+
+	return 0;
+}
+
+int server_set_uring(Server server, unsigned nbuf)
+{
+	UringReceiver uring;
+
+	if (nbuf == 0)
+		nbuf = URING_BUFS;
+
+	// provided buffers are slices of the staging buffer the GPU reads
+	uring = uring_receiver_create(server->buffer, nbuf, server->size / nbuf);
+	if (uring == NULL) {
+		ERROR("failed to uring_receiver_create(): %s",
+		      uring_get_error());
+		return -1;
+	}
+
+	if (server->uring)
+		uring_receiver_destroy(server->uring);
+
+	server->uring = uring;
+
+	return 0;
+}
+
+int server_run_as_uring(Server server)
+{
+	struct server_uring_recv recv;
+	struct uring_consumer consumer;
+	int clnt_fd;
+
+	if (server->uring == NULL) {
+		ERROR("io_uring engine is not set up");
+		goto RETURN_ERROR;
+	}
+
+	if (server->persistent) {
+		ERROR("io_uring engine does not read framed messages");
+		goto RETURN_ERROR;
+	}
+
+	clnt_fd = server_accept(server);
+	if (clnt_fd == -1)
+		goto RETURN_ERROR;
+
+	recv = (struct server_uring_recv) { .server = server };
+	consumer = (struct uring_consumer) {
+		.data = server_uring_data,
+		.flush = server_uring_flush,
+		.arg = &recv
+	};
+
+	if (uring_receiver_run(server->uring, clnt_fd, &consumer) == -1) {
+		if ( !recv.failed)
+			ERROR("failed to uring_receiver_run(): %s",
+			      uring_get_error());
+		goto SOCKET_DESTROY;
+	}
+
+	if (socket_destroy(clnt_fd) == -1)
+		goto RETURN_ERROR;
+
+	server->stats.messages++;
+
+	return 0;
+
+SOCKET_DESTROY:	(void) socket_destroy(clnt_fd);
+RETURN_ERROR:	return -1;
+}
+
+// map whole pages at `region`, have the kernel copy a short tail into the
+// staging buffer and read what it says to skip; 0 if nothing was queued
+static int server_zerocopy_once(Server server, int fd, char *region,
+				size_t *recvlen)
+{
+	struct tcp_zerocopy_receive zc;
+	socklen_t zc_len;
+	size_t mapped, copied;
+	int ret;
+
+	copied = server->size < ZEROCOPY_REGION ? server->size
+						: ZEROCOPY_REGION;
+
+	zc = (struct tcp_zerocopy_receive) {
+		.address = (uintptr_t) region,
+		.length = ZEROCOPY_REGION,
+		.copybuf_address = (uintptr_t) server->buffer,
+		.copybuf_len = copied
+	};
+	zc_len = sizeof(zc);
+
+	ret = getsockopt(fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc, &zc_len);
+	server->stats.recvs++;
+	if (ret == -1) {
+		// an empty socket that saw the FIN reports EIO
+		if (errno == EIO)
+			return 0;
+
+		ERROR("failed to getsockopt(TCP_ZEROCOPY_RECEIVE): %s",
+		      strerror(errno));
+		return -1;
+	}
+
+	if (zc.copybuf_len < 0) {
+		ERROR("TCP_ZEROCOPY_RECEIVE failed to copy: %s",
+		      strerror(-zc.copybuf_len));
+		return -1;
+	}
+
+	mapped = zc.length;
+	copied = zc.copybuf_len;
+
+	if (server->check
+	 && (server_check(server, server->cursor, region, *recvlen,
+	  		  mapped, "mapped pages") == -1
+	  || server_check(server, server->cursor, server->buffer,
+			  *recvlen + mapped, copied, "copybuf") == -1))
+		return -1;
+
+	if (server_gather(server, region, *recvlen, mapped) == -1)
+		return -1;
+
+	if (server_gather(server, server->buffer,
+			  *recvlen + mapped, copied) == -1)
+		return -1;
+
+	// kernels without copybuf leave the tail to a plain recv()
+	if (zc.recv_skip_hint > 0 && copied < server->size) {
+		size_t want = server->size - copied;
+
+		if (want > zc.recv_skip_hint)
+			want = zc.recv_skip_hint;
+
+		ret = recv(fd, ((char *) server->buffer) + copied, want, 0);
+		if (ret == -1) {
+			ERROR("failed to recv(): %s", strerror(errno));
+			return -1;
+		}
+
+		server->stats.recvs++;
+
+		if (server->check
+		 && server_check(server, server->cursor,
+				 ((char *) server->buffer) + copied,
+				 *recvlen + mapped + copied, ret,
+				 "recv") == -1)
+			return -1;
+
+		if (server_gather(server, ((char *) server->buffer) + copied,
+				  *recvlen + mapped + copied, ret) == -1)
+			return -1;
+
+		copied += ret;
+	}
+
+	// the next TCP_ZEROCOPY_RECEIVE unmaps what this one mapped
+	if (gatherer_flush(server->gatherer) == -1) {
+		ERROR("failed to gatherer_flush(): %s", gather_get_error());
+		return -1;
+	}
+
+	*recvlen += mapped + copied;
+	server->stats.bytes += mapped + copied;
+	server->stats.zerocopy += mapped;
+
+	return mapped + copied;
+}
+
+static int server_recv_zerocopy(Server server, int fd, char *region,
+				size_t *recvlen)
+{
+	struct pollfd pfd;
+	size_t pos;
+	int ret;
+
+	ret = server_zerocopy_once(server, fd, region, recvlen);
+	if (ret != 0)
+		return ret;
+
+	// nothing queued: sleep until data or the FIN arrives
+	pfd = (struct pollfd) { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, -1) == -1) {
+		ERROR("failed to poll(): %s", strerror(errno));
+		return -1;
+	}
+
+	ret = server_zerocopy_once(server, fd, region, recvlen);
+	if (ret != 0)
+		return ret;
+
+	// still nothing, so it was the FIN; recv() tells apart EOF and errors
+	pos = *recvlen;
+	ret = server_recv_tcp(server, fd, recvlen, SIZE_MAX);
+	if (ret <= 0)
+		return ret;
+
+	if (server_gather(server, ((char *) server->buffer) + pos % server->size,
+			  pos, ret) == -1)
+		return -1;
+
+	if (gatherer_flush(server->gatherer) == -1) {
+		ERROR("failed to gatherer_flush(): %s", gather_get_error());
+		return -1;
+	}
+
+	return ret;
+}
+
+int server_run_as_zerocopy(Server server)
+{
+	char *region;
+	size_t recvlen;
+	int clnt_fd;
+	int ret;
+
+	if (server->persistent) {
+		ERROR("TCP_ZEROCOPY_RECEIVE does not stop at message bounds");
+		goto RETURN_ERROR;
+	}
+
+	clnt_fd = server_accept(server);
+	if (clnt_fd == -1)
+		goto RETURN_ERROR;
+
+	// socket pages are mapped into this window, one receive at a time
+	region = mmap(NULL, ZEROCOPY_REGION, PROT_READ, MAP_SHARED, clnt_fd, 0);
+	if (region == MAP_FAILED) {
+		ERROR("failed to mmap(): %s", strerror(errno));
+		goto SOCKET_DESTROY;
+	}
+
+	recvlen = 0;
+	do {
+		ret = server_recv_zerocopy(server, clnt_fd, region, &recvlen);
+		if (ret == -1)
+			goto MUNMAP_REGION;
+	} while (ret > 0);
+
+	munmap(region, ZEROCOPY_REGION);
+
+	if (socket_destroy(clnt_fd) == -1)
+		goto RETURN_ERROR;
+
+	server->stats.messages++;
+
+	return 0;
+
+MUNMAP_REGION:	munmap(region, ZEROCOPY_REGION);
+SOCKET_DESTROY:	(void) socket_destroy(clnt_fd);
+RETURN_ERROR:	return -1;
+}
+
+int server_run_as_dma(Server server, Memory dmabuf)
+{
+	int clnt_fd;
+	size_t recvlen;
+	int ret;
+
+	if (server->persistent)
+		return server_recv_message(server, dmabuf);
+
+	clnt_fd = server_accept(server);
+	if (clnt_fd == -1)
+		goto RETURN_ERROR;
+
+	recvlen = 0;
+	do {
+		ret = server_recv_dma(server, dmabuf, clnt_fd,
+				      &recvlen, SIZE_MAX);
+		if (ret == -1)
+			goto SOCKET_DESTROY;
+	} while (ret > 0);
+
+	if (server_deliver_dma(server) == -1)
+		goto SOCKET_DESTROY;
+
+	if (socket_destroy(clnt_fd) == -1)
+		goto RETURN_ERROR;
+
+	server->stats.messages++;
+
+	return 0;
+
+SOCKET_DESTROY:	(void) token_releaser_flush(server->releaser);
+		(void) socket_destroy(clnt_fd);
+		server_reset_check(server);
+RETURN_ERROR:	return -1;
+}
+
+static int server_add_frag(Server server, struct server_frag frag)
+{
+	struct server_frag *frags;
+	size_t capacity;
+
+	if (server->nfrag == server->frag_capacity) {
+		capacity = server->frag_capacity ? server->frag_capacity * 2
+						 : 256;
+
+		frags = realloc(server->frags,
+		  		sizeof(struct server_frag) * capacity);
+		if (frags == NULL) {
+			ERROR("failed to realloc(): %s", strerror(errno));
+			return -1;
+		}
+
+		server->frags = frags;
+		server->frag_capacity = capacity;
+	}
+
+	server->frags[server->nfrag++] = frag;
+	server->frag_len += frag.length;
+
+	return 0;
+}
+
+// like server_recv_dma(), but keep the frags instead of copying them
+static int server_collect_dma(Server server, int fd, size_t limit)
+{
+	struct iovec iov;
+	struct msghdr msg = { 0 };
+
+	size_t room;
+	int ret;
+
+	// linear bytes stay in the staging buffer until the message is released
+	room = server->size - server->linear_len;
+	if (room == 0) {
+		ERROR("staging buffer is full of linear data");
+		return -1;
+	}
+
+	iov = (struct iovec) {
+		.iov_base = ((char *) server->buffer) + server->linear_len,
+		.iov_len = room < limit ? room : limit
+	};
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ret = server_recvmsg_dma(server, fd, &msg);
+	if (ret == -1)
+		return -1;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	     cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		struct dmabuf_cmsg *dmabuf_cmsg;
+		struct server_frag frag;
+
+		dmabuf_cmsg = (struct dmabuf_cmsg *) CMSG_DATA(cmsg);
+
+		if (cmsg->cmsg_type == SCM_DEVMEM_LINEAR) {
+			frag = (struct server_frag) {
+				.offset = server->linear_len,
+				.length = dmabuf_cmsg->frag_size,
+				.linear = true
+			};
+
+			server->linear_len += dmabuf_cmsg->frag_size;
+		} else if (cmsg->cmsg_type == SCM_DEVMEM_DMABUF) {
+			frag = (struct server_frag) {
+				.offset = dmabuf_cmsg->frag_offset,
+				.length = dmabuf_cmsg->frag_size,
+				.token = dmabuf_cmsg->frag_token
+			};
+
+			server->held_tokens++;
+			server->held_bytes += frag.length;
+			server->stats.frags++;
+		} else {
+			ERROR("cmsg_type is not SCM_DEVMEM_DMABUF");
+			return -1;
+		}
+
+		if (server_add_frag(server, frag) == -1)
+			return -1;
+
+		server->stats.bytes += frag.length;
+	}
+
+	server_note_held(server, 0, 0);
+
+	if (server_check_ctrl(server, &msg) == -1)
+		return -1;
+
+	return ret;
+}
+
+// check the frags of a message on arrival, whether or not the caller
+// ever materializes them; server_release() waits for the check stage
+static int server_check_frags(Server server, Memory dmabuf)
+{
+	size_t pos;
+	int ret;
+
+	pos = server->frag_pos;
+	for (size_t i = 0; i < server->nfrag; i++) {
+		const struct server_frag *frag = &server->frags[i];
+
+		ret = frag->linear
+		    ? server_probe_linear(server,
+		    			  (char *) server->buffer
+					  + frag->offset,
+					  frag->length, pos)
+		    : server_probe(server, dmabuf, frag->offset,
+		    		   frag->length, frag->token, pos);
+		if (ret == -1)
+			return -1;
+
+		pos += frag->length;
+	}
+
+	return server_submit_probes(server);
+}
+
+int server_recv_dma_frags(Server server, Memory dmabuf,
+			  struct server_message *message)
+{
+	size_t room, want;
+	bool eof;
+	int ret;
+
+	if (server->frag_fd != -1) {
+		ERROR("previous message is not released yet");
+		return -1;
+	}
+
+	server->nfrag = 0;
+	server->frag_len = 0;
+	server->linear_len = 0;
+
+	if (server->frag_src == -1) {
+		if (server->persistent) {
+			if (server_next_frame(server, dmabuf) == -1)
+				return -1;
+
+			server->frag_src = server->conn.fd;
+			server->frag_left = server->conn.left;
+			server->frag_pos = server->conn.offset;
+		} else {
+			server->frag_src = server_accept(server);
+			if (server->frag_src == -1)
+				return -1;
+
+			server->frag_left = SIZE_MAX;
+			server->frag_pos = 0;
+		}
+	}
+
+	eof = false;
+	while (server->frag_len < server->frag_left) {
+		if (server_wait_credit(server, &room) == -1)
+			goto CLOSE_FD;
+
+		// hand out what fits, the caller's release makes room for more
+		if (room == 0 && server->nfrag > 0)
+			break;
+
+		if (room == 0) {
+			ERROR("credit does not leave room for a single frag");
+			goto CLOSE_FD;
+		}
+
+		want = server->frag_left - server->frag_len;
+		ret = server_collect_dma(server, server->frag_src,
+					 want < room ? want : room);
+		if (ret == -1)
+			goto CLOSE_FD;
+
+		if (ret == 0 && server->frag_left == SIZE_MAX) {
+			eof = true;
+			break;
+		}
+
+		if (ret == 0) {
+			ERROR("connection closed %zu bytes before the end of "
+			      "the message", server->frag_left - server->frag_len);
+			goto CLOSE_FD;
+		}
+	}
+
+	server->frag_more = !eof && server->frag_len < server->frag_left;
+
+	if (server->check && server_check_frags(server, dmabuf) == -1)
+		goto CLOSE_FD;
+
+	*message = (struct server_message) {
+		.frags = server->frags,
+		.nfrag = server->nfrag,
+		.offset = server->frag_pos,
+		.length = server->frag_len,
+		.linear = server->buffer,
+		.more = server->frag_more
+	};
+
+	server->frag_pos += server->frag_len;
+	if (server->frag_left != SIZE_MAX)
+		server->frag_left -= server->frag_len;
+
+	if (server->persistent) {
+		server->conn.pos += server->frag_len;
+		server->conn.left -= server->frag_len;
+	}
+
+	// the tokens belong to the socket, so it lives until the release
+	server->frag_fd = server->frag_src;
+	if ( !server->frag_more)
+		server->stats.messages++;
+
+	return 0;
+
+	// closing the socket hands every frag it holds back to the page pool
+CLOSE_FD:	(void) token_releaser_flush(server->releaser);
+		(void) socket_destroy(server->frag_src);
+		if (server->persistent)
+			server->conn.fd = -1;
+		server->frag_src = -1;
+		server->nfrag = 0;
+		server->held_tokens = server->held_bytes = 0;
+		server_reset_check(server);
+		return -1;
+}
+
+int server_materialize(Server server, Memory dmabuf,
+		       const struct server_message *message)
+{
+	size_t pos;
+
+	pos = message->offset;
+	for (size_t i = 0; i < message->nfrag; i++) {
+		const struct server_frag *frag = &message->frags[i];
+		char *src;
+
+		src = frag->linear ? (char *) message->linear + frag->offset
+				   : (char *) dmabuf + frag->offset;
+
+		if (server_gather(server, src, pos, frag->length) == -1)
+			return -1;
+
+		pos += frag->length;
+	}
+
+	if (gatherer_flush(server->gatherer) == -1) {
+		ERROR("failed to gatherer_flush(): %s", gather_get_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+int server_release(Server server)
+{
+	int ret = 0;
+
+	if (server->frag_fd == -1)
+		return 0;
+
+	for (size_t i = 0; i < server->nfrag && ret == 0; i++) {
+		if (server->frags[i].linear)
+			continue;
+
+		if (token_releaser_add(server->releaser, server->frag_fd,
+			 	       server->frags[i].token,
+				       server->frags[i].length) == -1) {
+			ERROR("failed to token_releaser_add(): %s",
+			      token_get_error());
+			ret = -1;
+		}
+	}
+
+	if (token_releaser_flush(server->releaser) == -1 && ret == 0) {
+		ERROR("failed to token_releaser_flush(): %s",
+		      token_get_error());
+		ret = -1;
+	}
+
+	server->held_tokens = server->held_bytes = 0;
+
+	// the check ran next to whatever the caller did with the frags
+	if (server->checker && checker_drain(server->checker) == -1
+	 && ret == 0) {
+		ERROR("check stage failed: %s", server->stage_error);
+		ret = -1;
+	}
+
+	// the consumer is done with a whole message once it releases it
+	if ( !server->frag_more && server->persistent
+	 && server_ack(server, server->frag_src) == -1)
+		ret = -1;
+
+	// a message cut short by the credit continues on the same socket
+	if ( !server->frag_more) {
+		if (server->frag_src != server->conn.fd)
+			(void) socket_destroy(server->frag_src);
+
+		server->frag_src = -1;
+	}
+
+	server->frag_fd = -1;
+	server->nfrag = 0;
+
+	return ret;
+}
+
+int server_set_dispatch(Server server, int cpu,
+			ServerDispatch dispatch, void *arg)
+{
+	if (server->inbox[0] == -1) {
+		if (pipe(server->inbox) == -1) {
+			ERROR("failed to pipe(): %s", strerror(errno));
+			return -1;
+		}
+
+		// drained until EAGAIN from the event loop
+		if (socket_set_nonblocking(server->inbox[0]) == -1) {
+			ERROR("failed to socket_set_nonblocking(): %s",
+			      socket_get_error());
+			return -1;
+		}
+	}
+
+	server->cpu = cpu;
+	server->dispatch = dispatch;
+	server->dispatch_arg = arg;
+
+	return 0;
+}
+
+// may be called from another server's thread; `fd` belongs to `server` now
+int server_hand_off(Server server, int fd)
+{
+	// fits in PIPE_BUF, so concurrent writers never interleave
+	if (write(server->inbox[1], &fd, sizeof(fd)) != sizeof(fd)) {
+		ERROR("failed to write(): %s", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+// the reuseport group is shared, so any one of its listeners will do
+int server_set_steering(Server server, const int *cpus, int ncpu)
+{
+	if (socket_attach_cpu_steering(server->sockfd, cpus, ncpu) == -1) {
+		ERROR("failed to socket_attach_cpu_steering(): %s",
+		      socket_get_error());
+		return -1;
+	}
+
+	return 0;
+}
+
+// 1 if the connection was handed to another server, 0 to serve it here
+static int server_dispatch(Server server, int fd)
+{
+	unsigned int napi_id;
+	int cpu, ret;
+
+	server->stats.accepts++;
+
+	if (server->dispatch == NULL)
+		return 0;
+
+	if (socket_get_incoming(fd, &cpu, &napi_id) == -1) {
+		ERROR("failed to socket_get_incoming(): %s",
+		      socket_get_error());
+		return -1;
+	}
+
+	if (cpu == server->cpu)
+		server->stats.local++;
+
+	ret = server->dispatch(server->dispatch_arg, fd, cpu, napi_id);
+	if (ret == 1)
+		server->stats.handoffs++;
+
+	return ret;
+}
+
+static int server_accept_conn(Server server, int epfd,
+			      struct server_conn *conn, int index, int fd)
+{
+	struct epoll_event event;
+
+	conn->fd = fd;
+
+	if (socket_set_nonblocking(conn->fd) == -1) {
+		ERROR("failed to socket_set_nonblocking(): %s",
+		      socket_get_error());
+		goto SOCKET_DESTROY;
+	}
+
+	conn->recvlen = 0;
+	gettimeofday(&conn->start, NULL);
+
+	conn->staging = NULL;
+	conn->staged = 0;
+	conn->cursor = (struct integrity_cursor) INTEGRITY_CURSOR_INIT;
+
+	conn->header_len = 0;
+	conn->seq = 0;
+	conn->left = 0;
+
+	// 0 is reserved for the listening socket
+	event = (struct epoll_event) {
+		.events = EPOLLIN, .data.u64 = index + 1
+	};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+		ERROR("failed to epoll_ctl(): %s", strerror(errno));
+		goto SOCKET_DESTROY;
+	}
+
+	return 0;
+
+SOCKET_DESTROY:	(void) socket_destroy(conn->fd);
+		conn->fd = -1;
+		return -1;
+}
+
+static int server_grow_conns(Server server, struct server_conn **conns,
+			     int *capacity)
+{
+	struct server_conn *new_conns;
+	struct server_conn_stats *conn_stats;
+	int new_capacity;
+
+	new_capacity = *capacity ? *capacity * 2 : 16;
+
+	new_conns = realloc(*conns, sizeof(struct server_conn) * new_capacity);
+	if (new_conns == NULL) {
+		ERROR("failed to realloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	*conns = new_conns;
+
+	conn_stats = realloc(server->conn_stats,
+		      	     sizeof(struct server_conn_stats) * new_capacity);
+	if (conn_stats == NULL) {
+		ERROR("failed to realloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	server->conn_stats = conn_stats;
+	*capacity = new_capacity;
+
+	return 0;
+}
+
+// take over `fd` as the connection at `index`, closing it on failure
+static int server_take_conn(Server server, int epfd, struct server_conn **conns,
+			    int *capacity, int index, int fd)
+{
+	// the check stage holds on to cursors of the connections moved here
+	if (index == *capacity
+	 && (server_drain_check(server) == -1
+	  || server_grow_conns(server, conns, capacity) == -1)) {
+		(void) socket_destroy(fd);
+		return -1;
+	}
+
+	return server_accept_conn(server, epfd, *conns + index, index, fd);
+}
+
+// one connection spinning would hold up every other ready one, so the
+// loop leaves the polling to epoll_wait(); older kernels fall back to the
+// net.core.busy_poll sysctl there
+static void server_busy_poll_epoll(Server server, int epfd)
+{
+	struct epoll_params params = {
+		.busy_poll_usecs = server->busy_poll,
+		.busy_poll_budget = server->busy_budget,
+		.prefer_busy_poll = 1
+	};
+
+	if (ioctl(epfd, EPIOCSPARAMS, &params) == -1)
+		ERROR("failed to ioctl(EPIOCSPARAMS): %s", strerror(errno));
+}
+
+static int server_serve(Server server, Memory dmabuf,
+			struct server_quota *quota, int timeout_ms)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event event;
+	struct server_conn *conns;
+
+	int epfd, fd;
+	int accepted, active, capacity;
+	bool listening;
+	int ret;
+
+	conns = NULL;
+	capacity = 0;
+	server->nconn = 0;
+
+	epfd = epoll_create1(0);
+	if (epfd == -1) {
+		ERROR("failed to epoll_create1(): %s", strerror(errno));
+		goto RETURN_ERROR;
+	}
+
+	if (server->busy_poll > 0)
+		server_busy_poll_epoll(server, epfd);
+
+	server->spin = false;
+
+	event = (struct epoll_event) { .events = EPOLLIN, .data.u64 = 0 };
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, server->sockfd, &event) == -1) {
+		ERROR("failed to epoll_ctl(): %s", strerror(errno));
+		goto CLOSE_EPOLL;
+	}
+
+	event = (struct epoll_event) {
+		.events = EPOLLIN, .data.u64 = INBOX_EVENT
+	};
+	if (server->inbox[0] != -1
+	 && epoll_ctl(epfd, EPOLL_CTL_ADD, server->inbox[0], &event) == -1) {
+		ERROR("failed to epoll_ctl(): %s", strerror(errno));
+		goto CLOSE_EPOLL;
+	}
+
+	listening = true;
+	accepted = active = 0;
+	while (active > 0 || atomic_load(&quota->finish) > 0) {
+		int nevents = epoll_wait(epfd, events, MAX_EVENTS, timeout_ms);
+		if (nevents == -1) {
+			if (errno == EINTR)
+				continue;
+
+			ERROR("failed to epoll_wait(): %s", strerror(errno));
+			goto CLOSE_CONNS;
+		}
+
+		for (int i = 0; i < nevents; i++) {
+			struct server_conn *conn;
+			struct timeval end;
+
+			if (events[i].data.u64 == 0) {
+				if (atomic_fetch_sub(&quota->accept, 1) <= 0) {
+					atomic_fetch_add(&quota->accept, 1);
+				} else {
+					fd = server_accept(server);
+					if (fd == -1)
+						goto CLOSE_CONNS;
+
+					ret = server_dispatch(server, fd);
+					if (ret == -1) {
+						(void) socket_destroy(fd);
+						goto CLOSE_CONNS;
+					}
+
+					if (ret == 0) {
+						if (server_take_conn(
+							server, epfd, &conns,
+							&capacity, accepted,
+							fd) == -1)
+							goto CLOSE_CONNS;
+
+						accepted++;
+						active++;
+					}
+				}
+
+				// leave the rest to the other listeners
+				if (listening
+				 && atomic_load(&quota->accept) <= 0) {
+					(void) epoll_ctl(epfd, EPOLL_CTL_DEL,
+		      					 server->sockfd, NULL);
+					listening = false;
+				}
+
+				continue;
+			}
+
+			if (events[i].data.u64 == INBOX_EVENT) {
+				ssize_t len;
+
+				while ((len = read(server->inbox[0], &fd,
+						   sizeof(fd))) == sizeof(fd)) {
+					if (server_take_conn(server, epfd,
+							     &conns, &capacity,
+							     accepted, fd) == -1)
+						goto CLOSE_CONNS;
+
+					accepted++;
+					active++;
+					server->stats.adopted++;
+				}
+
+				if (len == -1 && errno != EAGAIN) {
+					ERROR("failed to read(): %s",
+					      strerror(errno));
+					goto CLOSE_CONNS;
+				}
+
+				continue;
+			}
+
+			conn = conns + (events[i].data.u64 - 1);
+
+			// interleaved streams each carry their blocks on
+			server->cursor = &conn->cursor;
+
+			// framing errors must not pass for a stale EAGAIN
+			errno = 0;
+
+			if (server->persistent)
+				ret = server_recv_framed(server, dmabuf, conn);
+			else if (dmabuf == NULL)
+				ret = server_recv_conn(server, conn,
+						       &conn->recvlen,
+						       SIZE_MAX);
+			else	// gathered to the stream position batch by batch
+				ret = server_recv_dma(server, dmabuf, conn->fd,
+			  			      &conn->recvlen, SIZE_MAX);
+
+			if (ret == -1 && errno == EAGAIN)
+				continue;
+
+			if (ret == -1)
+				goto CLOSE_CONNS;
+
+			if (ret > 0)
+				continue;
+
+			// framed messages were delivered as they completed
+			if (server->persistent)
+				ret = 0;
+			else if (dmabuf == NULL)
+				ret = server_flush_conn(server, conn,
+							conn->recvlen);
+			else
+				ret = server_deliver_dma(server);
+
+			if (ret == -1)
+				goto CLOSE_CONNS;
+
+			gettimeofday(&end, NULL);
+			server->conn_stats[conn - conns] =
+			(struct server_conn_stats) {
+				.bytes = conn->recvlen,
+				.elapsed = GET_ELAPSED(conn->start, end)
+			};
+
+			server_put_conn(server, conn);
+
+			// close() also drops the fd from the epoll set
+			ret = socket_destroy(conn->fd);
+			conn->fd = -1;
+			if (ret == -1) {
+				ERROR("failed to socket_destroy(): %s",
+	  			      strerror(errno));
+				goto CLOSE_CONNS;
+			}
+
+			active--;
+			atomic_fetch_sub(&quota->finish, 1);
+			if ( !server->persistent)
+				server->stats.messages++;
+		}
+	}
+
+	server->nconn = accepted;
+	server->cursor = &server->conn.cursor;
+	server->spin = true;
+
+	close(epfd);
+	free(conns);
+
+	return 0;
+
+CLOSE_CONNS:	(void) token_releaser_flush(server->releaser);
+		server_reset_check(server);
+		for (int i = 0; i < accepted; i++) {
+			server_put_conn(server, &conns[i]);
+			if (conns[i].fd != -1)
+				(void) socket_destroy(conns[i].fd);
+		}
+		server->cursor = &server->conn.cursor;
+CLOSE_EPOLL:	server->spin = true;
+		close(epfd);
+		free(conns);
+RETURN_ERROR:	return -1;
+}
+
+int server_run_event_loop(Server server, Memory dmabuf, int nconn)
+{
+	struct server_quota quota;
+
+	atomic_init(&quota.accept, nconn);
+	atomic_init(&quota.finish, nconn);
+
+	return server_serve(server, dmabuf, &quota, -1);
+}
+
+int server_run_shared_loop(Server server, Memory dmabuf,
+			   struct server_quota *quota)
+{
+	// wake up now and then to notice other workers finishing the quota
+	return server_serve(server, dmabuf, quota, SHARED_WAIT_MS);
+}
+
+const struct server_conn_stats *server_get_conn_stats(Server server,
+						      int *nconn)
+{
+	*nconn = server->nconn;
+
+	return server->conn_stats;
+}
+
+void server_get_stats(Server server, struct server_stats *stats)
+{
+	struct token_stats token_stats;
+	struct gather_stats gather_stats;
+
+	token_releaser_get_stats(server->releaser, &token_stats);
+
+	gatherer_get_stats(server->gatherer, &gather_stats);
+
+	*stats = server->stats;
+	stats->copies = gather_stats.copies;
+	stats->dontneed = token_stats.syscalls;
+	stats->tokens = token_stats.tokens;
+	stats->ranges = token_stats.ranges;
+	stats->ctrl_frags = server->ctrl_size / CTRL_SPACE(1);
+
+	if (server->uring) {
+		struct uring_stats uring_stats;
+
+		uring_receiver_get_stats(server->uring, &uring_stats);
+		stats->enters = uring_stats.enters;
+	}
+}
+
+void server_cleanup(Server server)
+{
+	if (server->pipeline)
+		pipeline_destroy(server->pipeline);
+
+	if (server->uring)
+		uring_receiver_destroy(server->uring);
+
+	(void) server_release(server);
+	free(server->frags);
+
+	if (server->frag_src != -1 && server->frag_src != server->conn.fd)
+		(void) socket_destroy(server->frag_src);
+
+	if (server->conn.fd != -1)
+		(void) socket_destroy(server->conn.fd);
+
+	// connections handed over after this server stopped serving
+	if (server->inbox[0] != -1) {
+		int fd;
+
+		while (read(server->inbox[0], &fd, sizeof(fd)) == sizeof(fd))
+			(void) socket_destroy(fd);
+
+		close(server->inbox[0]);
+		close(server->inbox[1]);
+	}
+
+	if (server->checker)
+		checker_destroy(server->checker);
+
+	if (server->probe_buf)
+		memory_provider_free(hp, server->probe_buf);
+	free(server->probes);
+
+	free(server->conn_stats);
+	free(server->ctrl);
+	staging_pool_destroy(server->staging);
+	gatherer_destroy(server->gatherer);
+	token_releaser_destroy(server->releaser);
 	socket_destroy(server->sockfd);
 	memory_provider_free(hp, server->buffer);
 	free(server);
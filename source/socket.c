@@ -1,20 +1,41 @@
 #include "socket.h"
 
 #include <stdio.h>		// sprintf(), BUFSIZ
+#include <stdlib.h>		// malloc(), free()
 #include <string.h>		// memset(), strerror()
 #include <errno.h>		// errno
 
 #include <unistd.h>		// close()
+#include <fcntl.h>		// fcntl()
 
 #include <sys/socket.h>		// socket(), bind(), setsockopt() ...
 #include <arpa/inet.h>		// struct sockaddr_in
+#include <netinet/tcp.h>	// TCP_NODELAY
+
+#include <linux/filter.h>	// struct sock_fprog, SKF_AD_CPU
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET	70
+#endif
+
+#ifndef SO_INCOMING_NAPI_ID
+#define SO_INCOMING_NAPI_ID	56
+#endif
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF	51
+#endif
 
 #define ERROR(...) do {				\
 	snprintf(error, BUFSIZ, __VA_ARGS__);	\
 	return -1;				\
 } while (false)
 
-static char error[BUFSIZ];
+static __thread char error[BUFSIZ];
 
 static int socket_reuseaddr(int fd)
 {
@@ -94,6 +115,128 @@ int socket_connect(int fd, char *address, int port)
 	return 0;
 }
 
+int socket_set_nonblocking(int fd)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		ERROR("failed to fcntl(): %s", strerror(errno));
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		ERROR("failed to fcntl(): %s", strerror(errno));
+
+	return 0;
+}
+
+int socket_set_rcvlowat(int fd, int bytes)
+{
+	int ret;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &bytes, sizeof(bytes));
+	if (ret == -1)
+		ERROR("failed to setsockopt(): %s", strerror(errno));
+
+	return 0;
+}
+
+int socket_set_busy_poll(int fd, int usecs, int budget)
+{
+	int ret, opt;
+
+	ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs));
+	if (ret == -1)
+		ERROR("failed to setsockopt(SO_BUSY_POLL): %s", strerror(errno));
+
+	// keep the NAPI context out of softirq while the socket is polled
+	opt = 1;
+	ret = setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &opt, sizeof(opt));
+	if (ret == -1)
+		ERROR("failed to setsockopt(SO_PREFER_BUSY_POLL): %s",
+		      strerror(errno));
+
+	if (budget > 0) {
+		ret = setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET,
+				 &budget, sizeof(budget));
+		if (ret == -1)
+			ERROR("failed to setsockopt(SO_BUSY_POLL_BUDGET): %s",
+			      strerror(errno));
+	}
+
+	return 0;
+}
+
+int socket_set_nodelay(int fd)
+{
+	int ret, opt;
+
+	opt = 1;
+	ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	if (ret == -1)
+		ERROR("failed to setsockopt(TCP_NODELAY): %s", strerror(errno));
+
+	return 0;
+}
+
+// CPU and NAPI context (0 if unknown) the socket's packets came in on
+int socket_get_incoming(int fd, int *cpu, unsigned int *napi_id)
+{
+	socklen_t len;
+
+	len = sizeof(*cpu);
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, cpu, &len) == -1)
+		ERROR("failed to getsockopt(SO_INCOMING_CPU): %s",
+		      strerror(errno));
+
+	len = sizeof(*napi_id);
+	if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID,
+		       napi_id, &len) == -1)
+		*napi_id = 0;
+
+	return 0;
+}
+
+// pick the i-th socket of the SO_REUSEPORT group for SYNs handled on
+// cpus[i]; other CPUs fall through to the default hash
+int socket_attach_cpu_steering(int fd, const int *cpus, int ncpu)
+{
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	int len, ret;
+
+	code = malloc(sizeof(struct sock_filter) * (2 * ncpu + 2));
+	if (code == NULL)
+		ERROR("failed to malloc(): %s", strerror(errno));
+
+	len = 0;
+	code[len++] = (struct sock_filter)
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+
+	for (int i = 0; i < ncpu; i++) {
+		if (cpus[i] == -1)
+			continue;
+
+		code[len++] = (struct sock_filter)
+			BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+		code[len++] = (struct sock_filter)
+			BPF_STMT(BPF_RET | BPF_K, i);
+	}
+
+	// an index past the group makes the kernel hash instead
+	code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, ncpu);
+
+	prog = (struct sock_fprog) { .len = len, .filter = code };
+	ret = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+			 &prog, sizeof(prog));
+	free(code);
+
+	if (ret == -1)
+		ERROR("failed to setsockopt(SO_ATTACH_REUSEPORT_CBPF): %s",
+		      strerror(errno));
+
+	return 0;
+}
+
 char *socket_get_error(void)
 {
 	return error;
@@ -0,0 +1,210 @@
+#include "staging.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// bool, true, false
+#include <stdlib.h>	// malloc(), realloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_mutex_lock(), pthread_mutex_unlock()
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+#define STAGING_MIN	(64 * 1024)
+
+struct staging_buffer {
+	Memory memory;
+	size_t size;		// the size class, not the size asked for
+	bool busy;
+};
+
+struct staging_pool {
+	MemoryProvider host;
+	MemoryProvider device;	// gets access to every buffer
+
+	struct staging_buffer *buffers;
+	size_t nbuffer, capacity;
+
+	struct staging_stats stats;
+	pthread_mutex_t lock;
+};
+
+static __thread char error[BUFSIZ];
+
+// four classes per power of two keep the waste of a class under 25%
+static size_t staging_class(size_t size)
+{
+	size_t step;
+
+	if (size <= STAGING_MIN)
+		return STAGING_MIN;
+
+	step = (size_t) 1 << (63 - __builtin_clzl(size - 1) - 2);
+
+	return (size + step - 1) & ~(step - 1);
+}
+
+StagingPool staging_pool_create(MemoryProvider host, MemoryProvider device)
+{
+	StagingPool pool;
+
+	pool = malloc(sizeof(struct staging_pool));
+	if (pool == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return NULL;
+	}
+
+	pool->host = host;
+	pool->device = device;
+
+	pool->buffers = NULL;
+	pool->nbuffer = pool->capacity = 0;
+
+	pool->stats = (struct staging_stats) { 0 };
+	pthread_mutex_init(&pool->lock, NULL);
+
+	return pool;
+}
+
+static int staging_grow(StagingPool pool)
+{
+	struct staging_buffer *buffers;
+	size_t capacity;
+
+	capacity = pool->capacity ? pool->capacity * 2 : 8;
+
+	buffers = realloc(pool->buffers,
+			  sizeof(struct staging_buffer) * capacity);
+	if (buffers == NULL) {
+		ERROR("failed to realloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	pool->buffers = buffers;
+	pool->capacity = capacity;
+
+	return 0;
+}
+
+// allocated and registered with the device on a miss only
+static Memory staging_alloc(StagingPool pool, size_t size)
+{
+	Memory memory;
+
+	memory = memory_provider_alloc(pool->host, size);
+	if (memory == NULL) {
+		ERROR("failed to memory_provider_alloc(): %s",
+		      memory_provider_get_error(pool->host));
+		return NULL;
+	}
+
+	if (memory_provider_allow_access(pool->host, pool->device,
+					 memory) == -1) {
+		ERROR("failed to memory_provider_allow_access(): %s",
+		      memory_provider_get_error(pool->host));
+		(void) memory_provider_free(pool->host, memory);
+		return NULL;
+	}
+
+	return memory;
+}
+
+Memory staging_pool_get(StagingPool pool, size_t size)
+{
+	struct staging_buffer *buffer;
+	Memory memory;
+
+	size = staging_class(size);
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (size_t i = 0; i < pool->nbuffer; i++) {
+		buffer = pool->buffers + i;
+
+		if (buffer->busy || buffer->size != size)
+			continue;
+
+		buffer->busy = true;
+		pool->stats.hits++;
+		pool->stats.idle -= size;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		return buffer->memory;
+	}
+
+	if (pool->nbuffer == pool->capacity && staging_grow(pool) == -1)
+		goto UNLOCK;
+
+	memory = staging_alloc(pool, size);
+	if (memory == NULL)
+		goto UNLOCK;
+
+	pool->buffers[pool->nbuffer++] = (struct staging_buffer) {
+		.memory = memory, .size = size, .busy = true
+	};
+
+	pool->stats.misses++;
+	pool->stats.buffers++;
+	pool->stats.held += size;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return memory;
+
+UNLOCK:	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+// the caller must have waited for any copy still using `memory`
+int staging_pool_put(StagingPool pool, Memory memory)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (size_t i = 0; i < pool->nbuffer; i++) {
+		struct staging_buffer *buffer = pool->buffers + i;
+
+		if (buffer->memory != memory || !buffer->busy)
+			continue;
+
+		buffer->busy = false;
+		pool->stats.idle += buffer->size;
+		ret = 0;
+		break;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (ret == -1)
+		ERROR("%p is not a staging buffer in use", memory);
+
+	return ret;
+}
+
+void staging_pool_get_stats(StagingPool pool, struct staging_stats *stats)
+{
+	pthread_mutex_lock(&pool->lock);
+	*stats = pool->stats;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void staging_pool_destroy(StagingPool pool)
+{
+	for (size_t i = 0; i < pool->nbuffer; i++)
+		(void) memory_provider_free(pool->host,
+					    pool->buffers[i].memory);
+
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->buffers);
+	free(pool);
+}
+
+char *staging_get_error(void)
+{
+	return error;
+}
@@ -0,0 +1,238 @@
+#include "stream.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// true, false
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_create(), pthread_join()
+#include <sys/time.h>	// gettimeofday()
+
+#include "affinity.h"
+
+#define STRIPE_ALIGN	4096
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+#define GET_ELAPSED(START, END)					\
+	(  ((END).tv_sec - (START).tv_sec)			\
+	 + ((END).tv_usec - (START).tv_usec) * 1e-6 )
+
+struct stream {
+	pthread_t thread;
+	StreamPool pool;
+
+	Client client;
+	int cpu;
+
+	double elapsed;
+
+	int ret;
+	char error[BUFSIZ];
+};
+
+struct stream_pool {
+	struct stream *streams;
+	int nstream;
+
+	Memory dmabuf;
+	char *address;
+	int port;
+	char *interface;
+	int dmabuf_id;
+	int ntimes;
+};
+
+static __thread char error[BUFSIZ];
+
+StreamPool stream_pool_create(Memory context, size_t size,
+			      char *address, int port,
+			      int nstream, int *cpus)
+{
+	StreamPool pool;
+	size_t stripe;
+	int i;
+
+	if (nstream < 1) {
+		ERROR("invalid number of streams %d", nstream);
+		goto RETURN_NULL;
+	}
+
+	// keep stripe boundaries page aligned for the copies on both ends
+	stripe = (size + nstream - 1) / nstream;
+	stripe = (stripe + STRIPE_ALIGN - 1) & ~((size_t) STRIPE_ALIGN - 1);
+
+	if (stripe * (nstream - 1) >= size) {
+		ERROR("%zu bytes are too few for %d streams", size, nstream);
+		goto RETURN_NULL;
+	}
+
+	pool = malloc(sizeof(struct stream_pool));
+	if (pool == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	pool->streams = calloc(nstream, sizeof(struct stream));
+	if (pool->streams == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_POOL;
+	}
+
+	// every stream binds its own port and carries one stripe
+	for (i = 0; i < nstream; i++) {
+		struct stream *stream = pool->streams + i;
+		size_t offset = stripe * i;
+		size_t len = size - offset < stripe ? size - offset : stripe;
+
+		stream->client = client_setup(
+			((char *) context) + offset, len, address, port + i
+		);
+		if (stream->client == NULL) {
+			ERROR("failed to client_setup(): %s",
+			      client_get_error());
+			goto CLEANUP_CLIENTS;
+		}
+
+		// the header tells the receiver where the stripe belongs
+		client_set_persistent(stream->client, true);
+		client_set_offset(stream->client, offset);
+
+		stream->pool = pool;
+		stream->cpu = cpus ? cpus[i] : -1;
+	}
+
+	pool->nstream = nstream;
+	pool->dmabuf = NULL;
+
+	return pool;
+
+CLEANUP_CLIENTS:	while (--i >= 0)
+				client_cleanup(pool->streams[i].client);
+			free(pool->streams);
+FREE_POOL:		free(pool);
+RETURN_NULL:		return NULL;
+}
+
+static void *stream_main(void *arg)
+{
+	struct stream *stream = arg;
+	StreamPool pool = stream->pool;
+	struct timeval start, end;
+
+	stream->ret = 0;
+	stream->elapsed = 0;
+
+	if (stream->cpu != -1 && affinity_pin(stream->cpu) == -1) {
+		snprintf(stream->error, BUFSIZ, "failed to affinity_pin(): %s",
+	   		 affinity_get_error());
+		stream->ret = -1;
+		return NULL;
+	}
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < pool->ntimes; i++) {
+		if (pool->dmabuf == NULL)
+			stream->ret = client_run_as_tcp(
+				stream->client, pool->address, pool->port
+			);
+		else
+			stream->ret = client_run_as_dma(
+				stream->client, pool->dmabuf,
+				pool->address, pool->port,
+				pool->interface, pool->dmabuf_id
+			);
+
+		if (stream->ret == -1) {
+			snprintf(stream->error, BUFSIZ,
+				 "failed to client_run_as_%s(): %s",
+				 pool->dmabuf ? "dma" : "tcp",
+				 client_get_error());
+			return NULL;
+		}
+	}
+
+	stream->ret = client_disconnect(stream->client);
+	if (stream->ret == -1) {
+		snprintf(stream->error, BUFSIZ,
+			 "failed to client_disconnect(): %s",
+			 client_get_error());
+		return NULL;
+	}
+
+	gettimeofday(&end, NULL);
+	stream->elapsed = GET_ELAPSED(start, end);
+
+	return NULL;
+}
+
+int stream_pool_run(StreamPool pool, Memory dmabuf, char *address, int port,
+		    char *interface, int dmabuf_id, int ntimes)
+{
+	int started;
+	int ret;
+
+	pool->dmabuf = dmabuf;
+	pool->address = address;
+	pool->port = port;
+	pool->interface = interface;
+	pool->dmabuf_id = dmabuf_id;
+	pool->ntimes = ntimes;
+
+	ret = 0;
+	for (started = 0; started < pool->nstream; started++) {
+		struct stream *stream = pool->streams + started;
+
+		ret = pthread_create(&stream->thread, NULL, stream_main, stream);
+		if (ret != 0) {
+			ERROR("failed to pthread_create(): %s", strerror(ret));
+			ret = -1;
+			break;
+		}
+	}
+
+	// a stream that is left behind fails on its own once the peer gives up
+	for (int i = 0; i < started; i++) {
+		struct stream *stream = pool->streams + i;
+
+		pthread_join(stream->thread, NULL);
+		if (stream->ret == -1 && ret == 0) {
+			ERROR("stream %d: %s", i, stream->error);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int stream_pool_get_size(StreamPool pool)
+{
+	return pool->nstream;
+}
+
+Client stream_pool_get_client(StreamPool pool, int stream)
+{
+	return pool->streams[stream].client;
+}
+
+double stream_pool_get_elapsed(StreamPool pool, int stream)
+{
+	return pool->streams[stream].elapsed;
+}
+
+void stream_pool_destroy(StreamPool pool)
+{
+	for (int i = 0; i < pool->nstream; i++)
+		client_cleanup(pool->streams[i].client);
+
+	free(pool->streams);
+	free(pool);
+}
+
+char *stream_get_error(void)
+{
+	return error;
+}
@@ -0,0 +1,215 @@
+#include "token.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// false
+#include <stdlib.h>	// malloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#define __iovec_defined	// do not define `struct iovec`
+#include <sys/socket.h>	// setsockopt()
+#include <sys/time.h>	// gettimeofday()
+
+#include <linux/uio.h>	// struct dmabuf_token
+
+/* limits of a single setsockopt(SO_DEVMEM_DONTNEED) in net/core/sock.c */
+#define MAX_DONTNEED_TOKENS	128
+#define MAX_DONTNEED_FRAGS	1024
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct token_releaser {
+	uint32_t *ring;
+	size_t batch;
+	size_t count;
+	size_t bytes;		// frag bytes behind the pending tokens
+
+	struct dmabuf_token *ranges;
+
+	int fd;
+	int timeout_us;
+	uint64_t oldest;
+
+	struct token_stats stats;
+};
+
+static __thread char error[BUFSIZ];
+
+static uint64_t gettimeofday_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000ULL) + tv.tv_usec;
+}
+
+TokenReleaser token_releaser_create(size_t batch, int timeout_us)
+{
+	TokenReleaser tr;
+
+	if (batch == 0)
+		batch = 1;
+
+	tr = malloc(sizeof(struct token_releaser));
+	if (tr == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	tr->ring = malloc(sizeof(uint32_t) * batch);
+	if (tr->ring == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_RELEASER;
+	}
+
+	tr->ranges = malloc(sizeof(struct dmabuf_token) * batch);
+	if (tr->ranges == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto FREE_RING;
+	}
+
+	tr->batch = batch;
+	tr->count = 0;
+	tr->bytes = 0;
+	tr->fd = -1;
+	tr->timeout_us = timeout_us;
+	tr->oldest = 0;
+	tr->stats = (struct token_stats) { 0 };
+
+	return tr;
+
+FREE_RING:	free(tr->ring);
+FREE_RELEASER:	free(tr);
+RETURN_NULL:	return NULL;
+}
+
+static int token_releaser_dontneed(TokenReleaser tr,
+				   struct dmabuf_token *tokens, size_t ntokens,
+				   size_t nfrags)
+{
+	int ret;
+
+	ret = setsockopt(tr->fd, SOL_SOCKET, SO_DEVMEM_DONTNEED,
+		  	 tokens, sizeof(struct dmabuf_token) * ntokens);
+	tr->stats.syscalls++;
+	if (ret == -1) {
+		ERROR("failed to setsockopt(SO_DEVMEM_DONTNEED): %s",
+		      strerror(errno));
+		return -1;
+	}
+
+	if (ret != nfrags) {
+		ERROR("SO_DEVMEM_DONTNEED released %d of %zu tokens",
+		      ret, nfrags);
+		return -1;
+	}
+
+	tr->stats.tokens += nfrags;
+	tr->stats.ranges += ntokens;
+
+	return 0;
+}
+
+int token_releaser_flush(TokenReleaser tr)
+{
+	size_t nranges;
+	int ret;
+
+	if (tr->count == 0)
+		return 0;
+
+	// merge consecutive tokens into a single start/count range
+	nranges = 0;
+	for (size_t i = 0; i < tr->count; i++) {
+		struct dmabuf_token *last = &tr->ranges[nranges ? nranges - 1 : 0];
+
+		if (nranges > 0
+		 && last->token_start + last->token_count == tr->ring[i]
+		 && last->token_count < MAX_DONTNEED_FRAGS) {
+			last->token_count++;
+			continue;
+		}
+
+		tr->ranges[nranges++] = (struct dmabuf_token) {
+			.token_start = tr->ring[i], .token_count = 1
+		};
+	}
+
+	// pending tokens are gone either way; the caller decides what to do
+	tr->count = 0;
+	tr->bytes = 0;
+
+	ret = 0;
+	for (size_t start = 0, end; start < nranges; start = end) {
+		size_t nfrags = 0;
+
+		for (end = start; end < nranges; end++) {
+			if (end - start == MAX_DONTNEED_TOKENS)
+				break;
+
+			if (nfrags + tr->ranges[end].token_count
+			    > MAX_DONTNEED_FRAGS)
+				break;
+
+			nfrags += tr->ranges[end].token_count;
+		}
+
+		ret = token_releaser_dontneed(
+			tr, tr->ranges + start, end - start, nfrags
+		);
+		if (ret == -1)
+			break;
+	}
+
+	return ret;
+}
+
+int token_releaser_add(TokenReleaser tr, int fd, uint32_t token, size_t size)
+{
+	// tokens belong to a socket, so never mix them in a single call
+	if (tr->count > 0 && tr->fd != fd)
+		if (token_releaser_flush(tr) == -1)
+			return -1;
+
+	if (tr->count == 0)
+		tr->oldest = gettimeofday_us();
+
+	tr->fd = fd;
+	tr->ring[tr->count++] = token;
+	tr->bytes += size;
+
+	if (tr->count >= tr->batch)
+		return token_releaser_flush(tr);
+
+	if (tr->timeout_us > 0
+	 && gettimeofday_us() - tr->oldest >= tr->timeout_us)
+		return token_releaser_flush(tr);
+
+	return 0;
+}
+
+void token_releaser_get_pending(TokenReleaser tr,
+				size_t *tokens, size_t *bytes)
+{
+	*tokens = tr->count;
+	*bytes = tr->bytes;
+}
+
+void token_releaser_get_stats(TokenReleaser tr, struct token_stats *stats)
+{
+	*stats = tr->stats;
+}
+
+void token_releaser_destroy(TokenReleaser tr)
+{
+	free(tr->ranges);
+	free(tr->ring);
+	free(tr);
+}
+
+char *token_get_error(void)
+{
+	return error;
+}
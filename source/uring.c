@@ -0,0 +1,552 @@
+#include "uring.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// bool, true, false
+#include <stdint.h>	// uint64_t
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// EINTR, ENOBUFS
+
+#include <sys/socket.h>	// MSG_WAITALL
+#include <sys/uio.h>	// struct iovec
+
+#include <liburing.h>	// io_uring_*()
+
+#define URING_ENTRIES	64
+#define BUF_GROUP	0
+#define FILE_INDEX	0	// the one slot of the registered file table
+
+#define URING_RECV	1	// user_data of the multishot recv
+#define URING_CANCEL	2
+#define URING_SEND_CANCEL UINT64_MAX	// never the length of a send
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct uring_receiver {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+
+	char *buffers;
+	unsigned nbuf;
+	size_t buf_size;
+
+	// buffers handed to the consumer, back to the ring after its flush
+	unsigned short *used;
+	unsigned nused;
+
+	bool armed;
+
+	struct uring_stats stats;
+};
+
+struct uring_sender {
+	struct io_uring ring;
+
+	char *buffer;
+	size_t size;
+
+	unsigned depth;
+	unsigned inflight;	// sends whose buffer the kernel may still read
+	bool broken;		// a cancel could not account for every send
+
+	struct uring_send_stats stats;
+};
+
+static __thread char error[BUFSIZ];
+
+static void uring_receiver_recycle(UringReceiver ur)
+{
+	int mask = io_uring_buf_ring_mask(ur->nbuf);
+
+	for (unsigned i = 0; i < ur->nused; i++)
+		io_uring_buf_ring_add(ur->br,
+			ur->buffers + ur->used[i] * ur->buf_size,
+			ur->buf_size, ur->used[i], mask, i);
+
+	io_uring_buf_ring_advance(ur->br, ur->nused);
+	ur->nused = 0;
+}
+
+UringReceiver uring_receiver_create(void *buffers, unsigned nbuf,
+				    size_t buf_size)
+{
+	UringReceiver ur;
+	int ret;
+
+	// the kernel masks buffer ring indices, so the size is a power of two
+	if (nbuf == 0 || nbuf > 32768 || (nbuf & (nbuf - 1))) {
+		ERROR("buffer count %u is not a power of two up to 32768",
+		      nbuf);
+		goto RETURN_NULL;
+	}
+
+	if (buf_size == 0) {
+		ERROR("provided buffers are empty");
+		goto RETURN_NULL;
+	}
+
+	ur = malloc(sizeof(struct uring_receiver));
+	if (ur == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	ur->used = calloc(nbuf, sizeof(unsigned short));
+	if (ur->used == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_RECEIVER;
+	}
+
+	ret = io_uring_queue_init(URING_ENTRIES, &ur->ring, 0);
+	if (ret < 0) {
+		ERROR("failed to io_uring_queue_init(): %s", strerror(-ret));
+		goto FREE_USED;
+	}
+
+	ret = io_uring_register_files_sparse(&ur->ring, 1);
+	if (ret < 0) {
+		ERROR("failed to io_uring_register_files_sparse(): %s",
+		      strerror(-ret));
+		goto QUEUE_EXIT;
+	}
+
+	ur->br = io_uring_setup_buf_ring(&ur->ring, nbuf, BUF_GROUP, 0, &ret);
+	if (ur->br == NULL) {
+		ERROR("failed to io_uring_setup_buf_ring(): %s",
+		      strerror(-ret));
+		goto QUEUE_EXIT;
+	}
+
+	ur->buffers = buffers;
+	ur->nbuf = nbuf;
+	ur->buf_size = buf_size;
+	ur->armed = false;
+	ur->stats = (struct uring_stats) { 0 };
+
+	// every buffer starts out in the ring
+	ur->nused = nbuf;
+	for (unsigned i = 0; i < nbuf; i++)
+		ur->used[i] = i;
+
+	uring_receiver_recycle(ur);
+
+	return ur;
+
+QUEUE_EXIT:	io_uring_queue_exit(&ur->ring);
+FREE_USED:	free(ur->used);
+FREE_RECEIVER:	free(ur);
+RETURN_NULL:	return NULL;
+}
+
+static int uring_receiver_arm(UringReceiver ur)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ur->ring);
+	if (sqe == NULL) {
+		ERROR("submission queue is full");
+		return -1;
+	}
+
+	// one submission keeps posting completions until it runs dry
+	io_uring_prep_recv_multishot(sqe, FILE_INDEX, NULL, 0, 0);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	io_uring_sqe_set_data64(sqe, URING_RECV);
+
+	ur->armed = true;
+	ur->stats.arms++;
+
+	return 0;
+}
+
+static int uring_receiver_complete(UringReceiver ur,
+				   struct io_uring_cqe *cqe,
+				   struct uring_consumer *consumer, bool *eof)
+{
+	char *buffer = NULL;
+
+	if ( !(cqe->flags & IORING_CQE_F_MORE))
+		ur->armed = false;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		ur->used[ur->nused++] = bid;
+		buffer = ur->buffers + bid * ur->buf_size;
+	}
+
+	// armed again once the consumer hands its buffers back
+	if (cqe->res == -ENOBUFS) {
+		ur->stats.nobufs++;
+		return 0;
+	}
+
+	if (cqe->res < 0) {
+		ERROR("multishot recv failed: %s", strerror(-cqe->res));
+		return -1;
+	}
+
+	if (cqe->res == 0) {
+		*eof = true;
+		return 0;
+	}
+
+	ur->stats.completions++;
+
+	if (consumer->data(consumer->arg, buffer, cqe->res) == -1) {
+		ERROR("consumer failed to take %d bytes", cqe->res);
+		return -1;
+	}
+
+	return 0;
+}
+
+// stop the multishot recv and reap what it still posts, so the next run
+// starts from an empty completion queue and a full buffer ring
+static void uring_receiver_cancel(UringReceiver ur)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	bool cancelled;
+
+	if ( !ur->armed)
+		return;
+
+	sqe = io_uring_get_sqe(&ur->ring);
+	if (sqe == NULL)
+		return;
+
+	io_uring_prep_cancel_fd(sqe, FILE_INDEX, IORING_ASYNC_CANCEL_FD_FIXED);
+	io_uring_sqe_set_data64(sqe, URING_CANCEL);
+
+	if (io_uring_submit(&ur->ring) < 0)
+		return;
+
+	cancelled = false;
+	while (ur->armed || !cancelled) {
+		if (io_uring_wait_cqe(&ur->ring, &cqe) < 0)
+			break;
+
+		if (io_uring_cqe_get_data64(cqe) == URING_CANCEL)
+			cancelled = true;
+		else if ( !(cqe->flags & IORING_CQE_F_MORE))
+			ur->armed = false;
+
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			ur->used[ur->nused++] =
+				cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		io_uring_cqe_seen(&ur->ring, cqe);
+	}
+}
+
+int uring_receiver_run(UringReceiver ur, int fd,
+		       struct uring_consumer *consumer)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, count;
+	bool eof;
+	int ret, none = -1;
+
+	// a fixed file skips the fd table lookup on every completion
+	ret = io_uring_register_files_update(&ur->ring, FILE_INDEX, &fd, 1);
+	if (ret < 0) {
+		ERROR("failed to io_uring_register_files_update(): %s",
+		      strerror(-ret));
+		return -1;
+	}
+
+	eof = false;
+	while ( !eof) {
+		if ( !ur->armed && uring_receiver_arm(ur) == -1)
+			goto CANCEL;
+
+		ret = io_uring_submit_and_wait(&ur->ring, 1);
+		ur->stats.enters++;
+		if (ret == -EINTR)
+			continue;
+
+		if (ret < 0) {
+			ERROR("failed to io_uring_submit_and_wait(): %s",
+			      strerror(-ret));
+			goto CANCEL;
+		}
+
+		ret = count = 0;
+		io_uring_for_each_cqe(&ur->ring, head, cqe) {
+			count++;
+
+			ret = uring_receiver_complete(ur, cqe, consumer, &eof);
+			if (ret == -1)
+				break;
+		}
+
+		io_uring_cq_advance(&ur->ring, count);
+
+		if (ret == -1)
+			goto CANCEL;
+
+		if (consumer->flush(consumer->arg) == -1) {
+			ERROR("consumer failed to flush");
+			goto CANCEL;
+		}
+
+		uring_receiver_recycle(ur);
+	}
+
+	(void) io_uring_register_files_update(&ur->ring, FILE_INDEX, &none, 1);
+
+	return 0;
+
+CANCEL:	uring_receiver_cancel(ur);
+	uring_receiver_recycle(ur);
+	(void) io_uring_register_files_update(&ur->ring, FILE_INDEX, &none, 1);
+	return -1;
+}
+
+void uring_receiver_get_stats(UringReceiver ur, struct uring_stats *stats)
+{
+	*stats = ur->stats;
+}
+
+void uring_receiver_destroy(UringReceiver ur)
+{
+	(void) io_uring_free_buf_ring(&ur->ring, ur->br, ur->nbuf, BUF_GROUP);
+	io_uring_queue_exit(&ur->ring);
+	free(ur->used);
+	free(ur);
+}
+
+UringSender uring_sender_create(void *buffer, size_t size, unsigned depth)
+{
+	UringSender us;
+	struct iovec iov;
+	int ret;
+
+	if (depth == 0) {
+		ERROR("send queue needs room for at least one send");
+		goto RETURN_NULL;
+	}
+
+	us = malloc(sizeof(struct uring_sender));
+	if (us == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	// two completions per send fit the default completion queue
+	ret = io_uring_queue_init(depth, &us->ring, 0);
+	if (ret < 0) {
+		ERROR("failed to io_uring_queue_init(): %s", strerror(-ret));
+		goto FREE_SENDER;
+	}
+
+	ret = io_uring_register_files_sparse(&us->ring, 1);
+	if (ret < 0) {
+		ERROR("failed to io_uring_register_files_sparse(): %s",
+		      strerror(-ret));
+		goto QUEUE_EXIT;
+	}
+
+	// a registered buffer is pinned once instead of on every send
+	iov = (struct iovec) { .iov_base = buffer, .iov_len = size };
+	ret = io_uring_register_buffers(&us->ring, &iov, 1);
+	if (ret < 0) {
+		ERROR("failed to io_uring_register_buffers(): %s",
+		      strerror(-ret));
+		goto QUEUE_EXIT;
+	}
+
+	us->buffer = buffer;
+	us->size = size;
+	us->depth = depth;
+	us->inflight = 0;
+	us->broken = false;
+	us->stats = (struct uring_send_stats) { 0 };
+
+	return us;
+
+QUEUE_EXIT:	io_uring_queue_exit(&us->ring);
+FREE_SENDER:	free(us);
+RETURN_NULL:	return NULL;
+}
+
+// reap what completed after waiting for `wait` completions; -1 if a send
+// failed, with the in-flight count still right so the caller can drain
+static int uring_sender_reap(UringSender us, unsigned wait)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head, count;
+	int ret;
+
+	do {
+		ret = io_uring_submit_and_wait(&us->ring, wait);
+		us->stats.enters++;
+	} while (ret == -EINTR);
+
+	if (ret < 0) {
+		ERROR("failed to io_uring_submit_and_wait(): %s",
+		      strerror(-ret));
+		return -1;
+	}
+
+	ret = count = 0;
+	io_uring_for_each_cqe(&us->ring, head, cqe) {
+		count++;
+
+		// the kernel is done with the buffer of this send
+		if (cqe->flags & IORING_CQE_F_NOTIF) {
+			us->stats.notifications++;
+			if (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED)
+				us->stats.copied++;
+
+			us->inflight--;
+			continue;
+		}
+
+		// without F_MORE no notification follows
+		if ( !(cqe->flags & IORING_CQE_F_MORE))
+			us->inflight--;
+
+		if (cqe->res < 0) {
+			ERROR("SEND_ZC failed: %s", strerror(-cqe->res));
+			ret = -1;
+		} else if (cqe->res != io_uring_cqe_get_data64(cqe)) {
+			ERROR("SEND_ZC sent %d of %zu bytes", cqe->res,
+			      (size_t) io_uring_cqe_get_data64(cqe));
+			ret = -1;
+		}
+	}
+
+	io_uring_cq_advance(&us->ring, count);
+
+	return ret;
+}
+
+// cancel whatever is still in flight and wait until the kernel let go of
+// the buffer; if that fails too, the sender cannot be trusted again
+static void uring_sender_cancel(UringSender us)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	bool cancelled;
+
+	sqe = io_uring_get_sqe(&us->ring);
+	if (sqe == NULL)
+		goto BREAK_SENDER;
+
+	io_uring_prep_cancel(sqe, NULL, IORING_ASYNC_CANCEL_ANY);
+	io_uring_sqe_set_data64(sqe, URING_SEND_CANCEL);
+
+	if (io_uring_submit(&us->ring) < 0)
+		goto BREAK_SENDER;
+
+	cancelled = false;
+	while (us->inflight > 0 || !cancelled) {
+		if (io_uring_wait_cqe(&us->ring, &cqe) < 0)
+			goto BREAK_SENDER;
+
+		if (io_uring_cqe_get_data64(cqe) == URING_SEND_CANCEL)
+			cancelled = true;
+		else if (cqe->flags & IORING_CQE_F_NOTIF)
+			us->inflight--;
+		else if ( !(cqe->flags & IORING_CQE_F_MORE))
+			us->inflight--;
+
+		io_uring_cqe_seen(&us->ring, cqe);
+	}
+
+	return;
+
+BREAK_SENDER:	us->broken = true;
+}
+
+int uring_sender_send(UringSender us, int fd,
+		      size_t offset, size_t len, size_t chunk)
+{
+	struct io_uring_sqe *sqe;
+	size_t end, part;
+	bool failed;
+	int ret, none = -1;
+
+	if (us->broken) {
+		ERROR("sends of an earlier failure may still be in flight");
+		return -1;
+	}
+
+	if (offset > us->size || len > us->size - offset) {
+		ERROR("[%zu, +%zu) is outside the registered buffer",
+		      offset, len);
+		return -1;
+	}
+
+	ret = io_uring_register_files_update(&us->ring, FILE_INDEX, &fd, 1);
+	if (ret < 0) {
+		ERROR("failed to io_uring_register_files_update(): %s",
+		      strerror(-ret));
+		return -1;
+	}
+
+	if (chunk == 0)
+		chunk = len;
+
+	failed = false;
+	end = offset + len;
+	for (; offset < end; offset += part) {
+		part = end - offset < chunk ? end - offset : chunk;
+
+		while (us->inflight >= us->depth && !failed) {
+			us->stats.stalls++;
+			if (uring_sender_reap(us, 1) == -1)
+				failed = true;
+		}
+
+		if (failed)
+			break;
+
+		// never NULL, every queued send is also counted in flight
+		sqe = io_uring_get_sqe(&us->ring);
+
+		io_uring_prep_send_zc_fixed(sqe, FILE_INDEX, us->buffer + offset,
+					    part, MSG_WAITALL,
+					    IORING_SEND_ZC_REPORT_USAGE, 0);
+		sqe->flags |= IOSQE_FIXED_FILE;
+		io_uring_sqe_set_data64(sqe, part);
+
+		us->inflight++;
+		us->stats.sends++;
+	}
+
+	// the buffer is refilled by the next run, so wait for every send
+	while (us->inflight > 0 && !failed)
+		if (uring_sender_reap(us, 1) == -1)
+			failed = true;
+
+	// a failed enter reaps nothing, so waiting on would never end
+	if (failed)
+		uring_sender_cancel(us);
+
+	(void) io_uring_register_files_update(&us->ring, FILE_INDEX, &none, 1);
+
+	return failed ? -1 : 0;
+}
+
+void uring_sender_get_stats(UringSender us, struct uring_send_stats *stats)
+{
+	*stats = us->stats;
+}
+
+void uring_sender_destroy(UringSender us)
+{
+	(void) io_uring_unregister_buffers(&us->ring);
+	io_uring_queue_exit(&us->ring);
+	free(us);
+}
+
+char *uring_get_error(void)
+{
+	return error;
+}
@@ -0,0 +1,334 @@
+#include "validator.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// bool, true, false
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <pthread.h>	// pthread_create(), pthread_cond_wait(), ...
+
+#include "pattern.h"
+#include "integrity.h"
+#include "affinity.h"
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+// below this a buffer is not worth waking the threads up for
+#define VALIDATOR_MIN_SHARE	(1024 * 1024)
+
+enum validator_op {
+	VALIDATOR_FILL,
+	VALIDATOR_VERIFY,
+	VALIDATOR_HASH,
+	VALIDATOR_CHECK
+};
+
+struct validator_thread {
+	pthread_t thread;
+	Validator validator;
+	int index;
+
+	size_t result;		// first mismatch in its share, or PATTERN_OK
+};
+
+struct validator {
+	struct validator_thread *threads;
+	int nthread;
+
+	// the job every thread takes a contiguous share of
+	enum validator_op op;
+	char *buffer;
+	size_t offset, len;
+	size_t block;		// shares are cut on these boundaries, or 1
+	uint32_t *hashes;
+
+	// one job at a time, while several servers may share the threads
+	pthread_mutex_t run;
+
+	unsigned long generation;
+	int pending;
+	bool stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+};
+
+static __thread char error[BUFSIZ];
+
+static void validator_share(Validator validator, int index,
+			    size_t *start, size_t *end)
+{
+	size_t units = validator->len / validator->block;
+
+	*start = units / validator->nthread * index * validator->block;
+	*end = index == validator->nthread - 1
+	     ? validator->len
+	     : *start + units / validator->nthread * validator->block;
+}
+
+static void *validator_main(void *arg)
+{
+	struct validator_thread *self = arg;
+	Validator validator = self->validator;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&validator->lock);
+	while (true) {
+		size_t start, end, at;
+
+		while ( !validator->stop && validator->generation == seen)
+			pthread_cond_wait(&validator->work, &validator->lock);
+
+		if (validator->stop)
+			break;
+
+		seen = validator->generation;
+		validator_share(validator, self->index, &start, &end);
+		pthread_mutex_unlock(&validator->lock);
+
+		if (validator->op == VALIDATOR_FILL) {
+			pattern_fill(validator->buffer + start,
+				     validator->offset + start, end - start);
+			self->result = PATTERN_OK;
+		} else if (validator->op == VALIDATOR_CHECK) {
+			at = integrity_check(validator->buffer + start,
+					     end - start, validator->block,
+					     validator->hashes
+					     + start / validator->block);
+			self->result = at == INTEGRITY_OK ? PATTERN_OK
+							  : start + at;
+		} else if (validator->op == VALIDATOR_HASH) {
+			integrity_hash(validator->buffer + start, end - start,
+				       validator->block,
+				       validator->hashes
+				       + start / validator->block);
+			self->result = PATTERN_OK;
+		} else {
+			at = pattern_verify(validator->buffer + start,
+					    validator->offset + start,
+					    end - start);
+			self->result = at == PATTERN_OK ? PATTERN_OK
+							: start + at;
+		}
+
+		pthread_mutex_lock(&validator->lock);
+		if (--validator->pending == 0)
+			pthread_cond_signal(&validator->done);
+	}
+	pthread_mutex_unlock(&validator->lock);
+
+	return NULL;
+}
+
+static int validator_place(Validator validator, int node)
+{
+	int *cpus, count;
+
+	cpus = malloc(sizeof(int) * validator->nthread);
+	if (cpus == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	count = affinity_get_node_cpus(node, cpus, validator->nthread);
+	if (count == -1) {
+		ERROR("failed to affinity_get_node_cpus(): %s",
+		      affinity_get_error());
+		goto FREE_CPUS;
+	}
+
+	// more threads than CPUs on the node share them round robin
+	for (int i = 0; i < validator->nthread; i++)
+		if (affinity_pin_thread(validator->threads[i].thread,
+					cpus[i % count]) == -1) {
+			ERROR("failed to affinity_pin_thread(): %s",
+			      affinity_get_error());
+			goto FREE_CPUS;
+		}
+
+	free(cpus);
+
+	return 0;
+
+FREE_CPUS:	free(cpus);
+		return -1;
+}
+
+void validator_destroy(Validator validator)
+{
+	pthread_mutex_lock(&validator->lock);
+	validator->stop = true;
+	pthread_cond_broadcast(&validator->work);
+	pthread_mutex_unlock(&validator->lock);
+
+	for (int i = 0; i < validator->nthread; i++)
+		pthread_join(validator->threads[i].thread, NULL);
+
+	pthread_cond_destroy(&validator->done);
+	pthread_cond_destroy(&validator->work);
+	pthread_mutex_destroy(&validator->lock);
+	pthread_mutex_destroy(&validator->run);
+
+	free(validator->threads);
+	free(validator);
+}
+
+Validator validator_create(int nthread, int node)
+{
+	Validator validator;
+	int ret;
+
+	if (nthread < 1) {
+		ERROR("invalid number of threads %d", nthread);
+		goto RETURN_NULL;
+	}
+
+	validator = malloc(sizeof(struct validator));
+	if (validator == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	validator->threads = calloc(nthread,
+				    sizeof(struct validator_thread));
+	if (validator->threads == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_VALIDATOR;
+	}
+
+	validator->nthread = 0;
+	validator->generation = 0;
+	validator->pending = 0;
+	validator->stop = false;
+
+	pthread_mutex_init(&validator->run, NULL);
+	pthread_mutex_init(&validator->lock, NULL);
+	pthread_cond_init(&validator->work, NULL);
+	pthread_cond_init(&validator->done, NULL);
+
+	for (int i = 0; i < nthread; i++) {
+		struct validator_thread *thread = validator->threads + i;
+
+		thread->validator = validator;
+		thread->index = i;
+
+		ret = pthread_create(&thread->thread, NULL,
+		       		     validator_main, thread);
+		if (ret != 0) {
+			ERROR("failed to pthread_create(): %s", strerror(ret));
+			goto DESTROY_VALIDATOR;
+		}
+
+		validator->nthread++;
+	}
+
+	if (node != -1 && validator_place(validator, node) == -1)
+		goto DESTROY_VALIDATOR;
+
+	return validator;
+
+DESTROY_VALIDATOR:	validator_destroy(validator);
+			goto RETURN_NULL;
+FREE_VALIDATOR:		free(validator);
+RETURN_NULL:		return NULL;
+}
+
+// returns once every thread is done with its share
+static size_t validator_run(Validator validator, enum validator_op op,
+			    char *buffer, size_t offset, size_t len,
+			    size_t block, uint32_t *hashes)
+{
+	size_t result = PATTERN_OK;
+
+	pthread_mutex_lock(&validator->run);
+	pthread_mutex_lock(&validator->lock);
+
+	validator->op = op;
+	validator->buffer = buffer;
+	validator->offset = offset;
+	validator->len = len;
+	validator->block = block;
+	validator->hashes = hashes;
+
+	validator->pending = validator->nthread;
+	validator->generation++;
+	pthread_cond_broadcast(&validator->work);
+
+	while (validator->pending > 0)
+		pthread_cond_wait(&validator->done, &validator->lock);
+
+	pthread_mutex_unlock(&validator->lock);
+
+	// the lowest offset wins, whichever thread finished first
+	for (int i = 0; i < validator->nthread; i++)
+		if (validator->threads[i].result < result)
+			result = validator->threads[i].result;
+
+	pthread_mutex_unlock(&validator->run);
+
+	return result;
+}
+
+void validator_fill(Validator validator, void *buffer,
+		    size_t offset, size_t len)
+{
+	if (len < VALIDATOR_MIN_SHARE * validator->nthread) {
+		pattern_fill(buffer, offset, len);
+		return;
+	}
+
+	(void) validator_run(validator, VALIDATOR_FILL, buffer, offset, len,
+			     1, NULL);
+}
+
+size_t validator_verify(Validator validator, const void *buffer,
+			size_t offset, size_t len)
+{
+	if (len < VALIDATOR_MIN_SHARE * validator->nthread)
+		return pattern_verify(buffer, offset, len);
+
+	return validator_run(validator, VALIDATOR_VERIFY,
+		      	     (char *) buffer, offset, len, 1, NULL);
+}
+
+void validator_hash(Validator validator, const void *buffer, size_t len,
+		    size_t block, uint32_t *hashes)
+{
+	if (len < VALIDATOR_MIN_SHARE * validator->nthread
+	 || len / block < (size_t) validator->nthread) {
+		integrity_hash(buffer, len, block, hashes);
+		return;
+	}
+
+	(void) validator_run(validator, VALIDATOR_HASH,
+		      	     (char *) buffer, 0, len, block, hashes);
+}
+
+size_t validator_check(Validator validator, const void *buffer, size_t len,
+		       size_t block, const uint32_t *hashes)
+{
+	size_t at;
+
+	if (len < VALIDATOR_MIN_SHARE * validator->nthread
+	 || len / block < (size_t) validator->nthread)
+		return integrity_check(buffer, len, block, hashes);
+
+	at = validator_run(validator, VALIDATOR_CHECK, (char *) buffer, 0, len,
+			   block, (uint32_t *) hashes);
+
+	return at == PATTERN_OK ? INTEGRITY_OK : at;
+}
+
+int validator_get_size(Validator validator)
+{
+	return validator->nthread;
+}
+
+char *validator_get_error(void)
+{
+	return error;
+}
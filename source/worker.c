@@ -0,0 +1,255 @@
+#include "worker.h"
+
+#include <stdio.h>	// BUFSIZ, snprintf()
+#include <stdbool.h>	// false
+#include <stdlib.h>	// malloc(), calloc(), free()
+#include <string.h>	// strerror()
+#include <errno.h>	// errno
+
+#include <stdatomic.h>	// atomic_uint, atomic_load(), atomic_store()
+
+#include <pthread.h>	// pthread_create(), pthread_join()
+
+#include "affinity.h"
+
+#define ERROR(...) do {					\
+	snprintf(error, BUFSIZ, __VA_ARGS__);		\
+} while(false)
+
+struct worker {
+	pthread_t thread;
+	WorkerPool pool;
+
+	Server server;
+	int cpu;
+	atomic_uint napi_id;	// last NAPI context seen on `cpu`, 0 if none
+
+	int ret;
+	char error[BUFSIZ];
+};
+
+struct worker_pool {
+	struct worker *workers;
+	int nworker;
+
+	Memory dmabuf;
+	struct server_quota quota;
+};
+
+static __thread char error[BUFSIZ];
+
+WorkerPool worker_pool_create(Memory context, size_t size,
+			      char *address, int port,
+			      int nworker, int *cpus)
+{
+	WorkerPool pool;
+	int i;
+
+	pool = malloc(sizeof(struct worker_pool));
+	if (pool == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		goto RETURN_NULL;
+	}
+
+	pool->workers = calloc(nworker, sizeof(struct worker));
+	if (pool->workers == NULL) {
+		ERROR("failed to calloc(): %s", strerror(errno));
+		goto FREE_POOL;
+	}
+
+	// every worker owns a listener in the same SO_REUSEPORT group
+	for (i = 0; i < nworker; i++) {
+		struct worker *worker = pool->workers + i;
+
+		worker->server = server_setup(context, size, address, port);
+		if (worker->server == NULL) {
+			ERROR("failed to server_setup(): %s",
+			      server_get_error());
+			goto CLEANUP_SERVERS;
+		}
+
+		worker->pool = pool;
+		worker->cpu = cpus ? cpus[i] : -1;
+		atomic_init(&worker->napi_id, 0);
+	}
+
+	pool->nworker = nworker;
+	pool->dmabuf = NULL;
+
+	return pool;
+
+CLEANUP_SERVERS:	while (--i >= 0)
+				server_cleanup(pool->workers[i].server);
+			free(pool->workers);
+FREE_POOL:		free(pool);
+RETURN_NULL:		return NULL;
+}
+
+static struct worker *worker_find(WorkerPool pool, int cpu,
+				  unsigned int napi_id)
+{
+	for (int i = 0; i < pool->nworker; i++)
+		if (pool->workers[i].cpu != -1 && pool->workers[i].cpu == cpu)
+			return pool->workers + i;
+
+	// RPS or a moved IRQ: follow the NAPI context the flow came from
+	if (napi_id != 0)
+		for (int i = 0; i < pool->nworker; i++)
+			if (atomic_load(&pool->workers[i].napi_id) == napi_id)
+				return pool->workers + i;
+
+	return NULL;
+}
+
+static int worker_dispatch(void *arg, int fd, int cpu, unsigned int napi_id)
+{
+	struct worker *worker = arg, *owner;
+
+	if (cpu == worker->cpu) {
+		if (napi_id != 0)
+			atomic_store(&worker->napi_id, napi_id);
+
+		return 0;
+	}
+
+	owner = worker_find(worker->pool, cpu, napi_id);
+	if (owner == NULL || owner == worker)
+		return 0;
+
+	if (server_hand_off(owner->server, fd) == -1)
+		return -1;
+
+	return 1;
+}
+
+int worker_pool_set_dispatch(WorkerPool pool, bool steering)
+{
+	int *cpus;
+
+	for (int i = 0; i < pool->nworker; i++) {
+		struct worker *worker = pool->workers + i;
+
+		if (server_set_dispatch(worker->server, worker->cpu,
+					worker_dispatch, worker) == -1) {
+			ERROR("failed to server_set_dispatch(): %s",
+			      server_get_error());
+			return -1;
+		}
+	}
+
+	if ( !steering)
+		return 0;
+
+	cpus = malloc(sizeof(int) * pool->nworker);
+	if (cpus == NULL) {
+		ERROR("failed to malloc(): %s", strerror(errno));
+		return -1;
+	}
+
+	// listeners joined the group in worker order
+	for (int i = 0; i < pool->nworker; i++)
+		cpus[i] = pool->workers[i].cpu;
+
+	if (server_set_steering(pool->workers[0].server,
+				cpus, pool->nworker) == -1) {
+		ERROR("failed to server_set_steering(): %s",
+		      server_get_error());
+		free(cpus);
+		return -1;
+	}
+
+	free(cpus);
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *worker = arg;
+	WorkerPool pool = worker->pool;
+
+	worker->ret = 0;
+
+	if (worker->cpu != -1 && affinity_pin(worker->cpu) == -1) {
+		snprintf(worker->error, BUFSIZ, "failed to affinity_pin(): %s",
+	   		 affinity_get_error());
+		worker->ret = -1;
+		goto STOP_OTHERS;
+	}
+
+	worker->ret = server_run_shared_loop(worker->server, pool->dmabuf,
+				      	     &pool->quota);
+	if (worker->ret == -1) {
+		snprintf(worker->error, BUFSIZ,
+	   		 "failed to server_run_shared_loop(): %s",
+	   		 server_get_error());
+		goto STOP_OTHERS;
+	}
+
+	return NULL;
+
+	// let the rest drain what they already have and return
+STOP_OTHERS:	atomic_store(&pool->quota.accept, 0);
+		atomic_store(&pool->quota.finish, 0);
+		return NULL;
+}
+
+int worker_pool_run(WorkerPool pool, Memory dmabuf, int nconn)
+{
+	int started;
+	int ret;
+
+	pool->dmabuf = dmabuf;
+	atomic_init(&pool->quota.accept, nconn);
+	atomic_init(&pool->quota.finish, nconn);
+
+	ret = 0;
+	for (started = 0; started < pool->nworker; started++) {
+		struct worker *worker = pool->workers + started;
+
+		ret = pthread_create(&worker->thread, NULL, worker_main, worker);
+		if (ret != 0) {
+			ERROR("failed to pthread_create(): %s", strerror(ret));
+			atomic_store(&pool->quota.accept, 0);
+			atomic_store(&pool->quota.finish, 0);
+			ret = -1;
+			break;
+		}
+	}
+
+	for (int i = 0; i < started; i++) {
+		struct worker *worker = pool->workers + i;
+
+		pthread_join(worker->thread, NULL);
+		if (worker->ret == -1 && ret == 0) {
+			ERROR("worker %d: %s", i, worker->error);
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+int worker_pool_get_size(WorkerPool pool)
+{
+	return pool->nworker;
+}
+
+Server worker_pool_get_server(WorkerPool pool, int worker)
+{
+	return pool->workers[worker].server;
+}
+
+void worker_pool_destroy(WorkerPool pool)
+{
+	for (int i = 0; i < pool->nworker; i++)
+		server_cleanup(pool->workers[i].server);
+
+	free(pool->workers);
+	free(pool);
+}
+
+char *worker_get_error(void)
+{
+	return error;
+}